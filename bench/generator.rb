@@ -0,0 +1,204 @@
+require 'zlib'
+require 'digest'
+require 'fileutils'
+
+class CHD
+module Bench
+
+#
+# Generate deterministic CHD files for benchmarking.
+#
+# Data is generated from a seeded PRNG, mixing hunks of various
+# compressibility (blank, text, random, half-random), and audio-like
+# samples for CD audio tracks.
+#
+# Uncompressed and zlib CHD files are written by {CHD::Writer}
+# (zlib hunks are deflated here), other codecs (lzma, flac) are
+# obtained by recompressing the zlib file with chdman, if available.
+#
+class Generator
+    # Default hunk size for raw images
+    HUNK_BYTES  = 16384
+
+    # Default sector size for raw images
+    UNIT_BYTES  = 512
+
+    # Number of CD frames in a hunk (as chdman)
+    CD_FRAMES_PER_HUNK = 8
+
+    # Codec names used by chdman, according to layout
+    CHDMAN_CODECS = {
+        :raw => { 'lzma' => 'lzma', 'flac' => 'flac' },
+        :cd  => { 'lzma' => 'cdlz', 'flac' => 'cdfl' },
+    }.freeze
+
+    # Supported codecs
+    CODECS      = %w[ none zlib lzma flac ].freeze
+
+    # @param dir  [String]  directory where the files are generated
+    # @param seed [Integer] PRNG seed
+    #
+    def initialize(dir, seed: 0)
+        @dir  = dir
+        @seed = seed
+        FileUtils.mkdir_p(dir)
+    end
+
+    # Generate a CHD file.
+    #
+    # @param layout     [:raw, :cd]  layout of the image
+    # @param codec      [String]     one of {CODECS}
+    # @param size       [Integer]    approximate logical size in bytes
+    # @param hunk_bytes [Integer]    hunk size (raw layout only)
+    # @param tracks     [Array<Array(Symbol, Float)>] CD tracks as
+    #                                type and fraction of the size
+    #
+    # @raise [NotSupportedError] if chdman is required and not found
+    #
+    # @return [Hash{Symbol => Object}] description of the generated file
+    #
+    def generate(layout:, codec:, size:, hunk_bytes: HUNK_BYTES,
+                 tracks: [ [ :MODE1, 0.5 ], [ :AUDIO, 0.5 ] ])
+        unless CODECS.include?(codec)
+            raise ArgumentError, "unsupported codec (#{codec})"
+        end
+
+        name   = "%s-%s-%d-%d-%d" % [ layout, codec, size, hunk_bytes, @seed ]
+        path   = File.join(@dir, "#{name}.chd")
+        info   = { :path => path, :layout => layout, :codec => codec }
+
+        if ! File.exist?(path)
+            if %w[ none zlib ].include?(codec)
+                _generate(path, layout, codec, size, hunk_bytes, tracks)
+            else
+                source = generate(layout: layout, codec: 'zlib', size: size,
+                                  hunk_bytes: hunk_bytes, tracks: tracks)
+                _chdman_copy(source[:path], path,
+                             CHDMAN_CODECS.dig(layout, codec))
+            end
+        end
+
+        CHD.open(path) {|chd|
+            info.merge(:hunk_bytes    => chd.hunk_bytes,
+                       :logical_bytes => chd.header[:logical_bytes],
+                       :file_bytes    => File.size(path))
+        }
+    end
+
+
+    private
+
+    def _generate(path, layout, codec, size, hunk_bytes, tracks)
+        rnd = Random.new(@seed)
+
+        case layout
+        when :raw
+            unit_bytes = UNIT_BYTES
+            hunks      = (size + hunk_bytes - 1) / hunk_bytes
+            metadata   = [ [ Metadata::HARD_DISK,
+                             "CYLS:%d,HEADS:1,SECS:%d,BPS:%d\0" % [
+                                 hunks, hunk_bytes / unit_bytes, unit_bytes ]
+                         ] ]
+            data       = hunks.times.lazy.map {|idx|
+                _hunk_data(rnd, idx, hunk_bytes)
+            }
+        when :cd
+            unit_bytes = CD::FRAME_SIZE
+            hunk_bytes = CD_FRAMES_PER_HUNK * unit_bytes
+            metadata, frames = _cd_layout(size, tracks)
+            data       = frames.each_slice(CD_FRAMES_PER_HUNK).lazy.map {|list|
+                list.map {|type, idx| _frame_data(rnd, type, idx) }.join
+                    .ljust(hunk_bytes, "\0")
+            }
+        else
+            raise ArgumentError, "unsupported layout (#{layout})"
+        end
+
+        raw    = Digest::SHA1.new
+        CHD::Writer.open(path, hunk_bytes:  hunk_bytes,
+                               unit_bytes:  unit_bytes,
+                               compression: codec == 'zlib' ? [ 'zlib' ] : []
+                        ) do |writer|
+            metadata.each {|tag, text| writer.add_metadata(tag, text) }
+            data.each do |hunk|
+                raw << hunk
+                writer << _encode(hunk, codec)
+            end
+            writer.raw_sha1 = raw.digest
+        end
+    end
+
+    # Encode a hunk, keeping it uncompressed if not worth it
+    def _encode(hunk, codec)
+        if codec == 'zlib'
+            zdata = Zlib::Deflate.new(Zlib::BEST_COMPRESSION, -Zlib::MAX_WBITS)
+                                 .then {|z| z.deflate(hunk, Zlib::FINISH)
+                                             .tap { z.close } }
+            if zdata.bytesize < hunk.bytesize
+                return { :type  => :compressed, :codec => 'zlib',
+                         :data  => zdata,       :crc16 => CHD.crc16(hunk) }
+            end
+        end
+        { :type => :none, :data => hunk }
+    end
+
+    # Data of a raw hunk, according to its position
+    def _hunk_data(rnd, idx, length)
+        case idx % 4
+        when 0 then "\0" * length
+        when 1 then ("hunk %08d: benchmark data for CHD\n" % idx) *
+                    (length / 36 + 1)
+        when 2 then rnd.bytes(length)
+        when 3 then rnd.bytes(length / 2)
+        end.byteslice(0, length).ljust(length, "\0")
+    end
+
+    # Frame data (sector and empty subcode)
+    def _frame_data(rnd, type, idx)
+        sector = case type
+                 when nil    then ''
+                 when :AUDIO
+                     # 588 stereo samples: sine waves and some noise
+                     588.times.flat_map {|i|
+                         t = idx * 588 + i
+                         v = (8000 * Math.sin(t / 20.0)).to_i + rnd.rand(64)
+                         [ v, -v ]
+                     }.pack('s>*')
+                 else
+                     _hunk_data(rnd, idx, CD::TRACK_TYPE_DATASIZE[type])
+                 end
+        sector.ljust(CD::FRAME_SIZE, "\0")
+    end
+
+    # Track metadata, and list of frames as [ type, index ]
+    # (type is nil for padding frames)
+    def _cd_layout(size, tracks)
+        total    = tracks.sum {|_, fraction| fraction }
+        metadata = []
+        frames   = []
+        tracks.each_with_index do |(type, fraction), idx|
+            count = [ (size * fraction / total /
+                       CD::TRACK_TYPE_DATASIZE.fetch(type)).to_i, 1 ].max
+            metadata << [ Metadata::CDROM_TRACK_PREGAP,
+                          "TRACK:%d TYPE:%s SUBTYPE:NONE FRAMES:%d PREGAP:0 " \
+                          "PGTYPE:MODE1 PGSUB:RW POSTGAP:0\0" % [
+                              idx + 1, type, count ] ]
+            frames.concat(count.times.map {|i| [ type, i ] })
+            padding = -count % CD::TRACK_PADDING
+            frames.concat([ [ nil, 0 ] ] * padding)
+        end
+        [ metadata, frames ]
+    end
+
+    def _chdman_copy(source, path, codec)
+        chdman = ENV['CHDMAN'] || 'chdman'
+        unless system(chdman, 'copy', '-f', '-i', source, '-o', path,
+                      '-c', codec, out: File::NULL, err: File::NULL)
+            FileUtils.rm_f(path)
+            raise NotSupportedError, "chdman is required for #{codec}"
+        end
+    end
+end
+
+end
+end
@@ -0,0 +1,79 @@
+# Run the benchmarks, and output the results as JSON.
+#
+# Configuration is done using environment variables:
+#   BENCH_DIR      directory of generated files (default: tmp/bench)
+#   BENCH_SIZE     logical size of the images in MiB (default: 64)
+#   BENCH_HUNK     hunk size of raw images (default: 16384)
+#   BENCH_LAYOUTS  image layouts: raw,cd (default: raw,cd)
+#   BENCH_CODECS   codecs: none,zlib,lzma,flac (default: all)
+#   BENCH_TRACKS   CD tracks as TYPE:fraction (default: MODE1:1,AUDIO:1)
+#   BENCH_OPS      number of random operations (default: 2000)
+#   BENCH_STRIDE   sector stride for strided access (default: 16)
+#   BENCH_THREADS  number of threads (default: number of processors)
+#   BENCH_SEED     PRNG seed (default: 0)
+#   BENCH_OUTPUT   output file (default: standard output)
+#   CHDMAN         path to chdman (used for lzma and flac)
+
+require 'json'
+require 'etc'
+require 'chd'
+require 'chd/version'
+require_relative 'generator'
+require_relative 'workloads'
+
+env     = ->(name, default) { ENV.fetch("BENCH_#{name}", default) }
+config  = {
+    :dir     => env.('DIR',     'tmp/bench'),
+    :size    => Integer(env.('SIZE',    '64')) * 1024 * 1024,
+    :hunk    => Integer(env.('HUNK',    CHD::Bench::Generator::HUNK_BYTES.to_s)),
+    :layouts => env.('LAYOUTS', 'raw,cd').split(',').map(&:to_sym),
+    :codecs  => env.('CODECS',  CHD::Bench::Generator::CODECS.join(','))
+                   .split(','),
+    :tracks  => env.('TRACKS',  'MODE1:1,AUDIO:1').split(',').map {|t|
+                    type, fraction = t.split(':')
+                    [ type.to_sym, Float(fraction || 1) ]
+                },
+    :ops     => Integer(env.('OPS',     '2000')),
+    :stride  => Integer(env.('STRIDE',  '16')),
+    :threads => Integer(env.('THREADS', Etc.nprocessors.to_s)),
+    :seed    => Integer(env.('SEED',    '0')),
+}
+
+generator = CHD::Bench::Generator.new(config[:dir], seed: config[:seed])
+images    = []
+skipped   = []
+results   = []
+
+config[:layouts].product(config[:codecs]).each do |layout, codec|
+    begin
+        info = generator.generate(layout: layout, codec: codec,
+                                  size: config[:size],
+                                  hunk_bytes: config[:hunk],
+                                  tracks: config[:tracks])
+    rescue CHD::NotSupportedError => e
+        skipped << { :layout => layout, :codec => codec, :reason => e.message }
+        next
+    end
+    images  << info.merge(:path => File.basename(info[:path]))
+    results.concat(CHD::Bench::Workloads.new(info, ops:     config[:ops],
+                                                   stride:  config[:stride],
+                                                   threads: config[:threads],
+                                                   seed:    config[:seed]).run)
+end
+
+report = {
+    :ruby    => RUBY_DESCRIPTION,
+    :chd     => CHD::VERSION,
+    :config  => config.merge(:tracks => config[:tracks].map {|t| t.join(':') }),
+    :images  => images,
+    :skipped => skipped,
+    :results => results,
+    :stats   => CHD.stats,
+}
+
+json = JSON.pretty_generate(report)
+if output = ENV['BENCH_OUTPUT']
+    File.write(output, json + "\n")
+else
+    puts json
+end
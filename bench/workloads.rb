@@ -0,0 +1,174 @@
+class CHD
+module Bench
+
+#
+# Access workloads measured against a CHD file.
+#
+# Each workload performs a list of operations, timing each of them,
+# and reports throughput, latency percentiles, and allocations.
+#
+class Workloads
+    # Chunk size of sequential byte reads
+    SEQUENTIAL_CHUNK = 1024 * 1024
+
+    # Size of random byte reads
+    RANDOM_CHUNK     = 4096
+
+    # Size of random byte reads in multi-threaded workload
+    THREADED_CHUNK   = 64 * 1024
+
+    # @param info    [Hash]    description of the CHD file
+    #                          (see {Generator#generate})
+    # @param ops     [Integer] number of random operations
+    # @param stride  [Integer] sector stride for strided access
+    # @param threads [Integer] number of threads
+    # @param seed    [Integer] PRNG seed
+    #
+    def initialize(info, ops:, stride:, threads:, seed: 0)
+        @info    = info
+        @ops     = ops
+        @stride  = stride
+        @threads = threads
+        @seed    = seed
+    end
+
+    # Run all the workloads applicable to the CHD file.
+    #
+    # @return [Array<Hash{Symbol => Object}>] results
+    #
+    def run
+        names  = %i[ sequential_hunk sequential_bytes random_unit
+                     random_bytes threaded_random ]
+        names << :strided_sector if @info[:layout] == :cd
+
+        names.map {|name|
+            CHD.open(@info[:path]) {|chd| send(name, chd) }
+                .merge(:workload => name, :image => File.basename(@info[:path]))
+        }
+    end
+
+    # Read all the hunks in order (CHD#read_hunk)
+    def sequential_hunk(chd)
+        measure(chd, chd.hunk_count.times) {|idx|
+            chd.read_hunk(idx).bytesize
+        }
+    end
+
+    # Read the whole logical data by chunks (CHD#read_bytes)
+    def sequential_bytes(chd)
+        size = chd.header[:logical_bytes]
+        measure(chd, (0 ... size).step(SEQUENTIAL_CHUNK)) {|offset|
+            chd.read_bytes(offset, [ SEQUENTIAL_CHUNK, size - offset ].min)
+               .bytesize
+        }
+    end
+
+    # Read random units (CHD#read_unit)
+    def random_unit(chd)
+        rnd   = Random.new(@seed)
+        units = Array.new(@ops) { rnd.rand(chd.unit_count) }
+        measure(chd, units) {|idx| chd.read_unit(idx).bytesize }
+    end
+
+    # Read random small chunks (CHD#read_bytes)
+    def random_bytes(chd)
+        rnd     = Random.new(@seed)
+        size    = chd.header[:logical_bytes]
+        chunk   = [ RANDOM_CHUNK, size ].min
+        offsets = Array.new(@ops) {
+            rnd.rand(size - chunk + 1) / 512 * 512
+        }
+        measure(chd, offsets) {|offset|
+            chd.read_bytes(offset, chunk).bytesize
+        }
+    end
+
+    # Read one sector every stride sectors (CHD::CD#read_sector)
+    def strided_sector(chd)
+        cd      = CD.new(chd)
+        last    = cd.track_start(0xAA)
+        measure(chd, (0 ... last).step(@stride)) {|lba|
+            cd.read_sector(lba).bytesize
+        }
+    end
+
+    # Read random chunks from several threads, each using
+    # its own access to the CHD file
+    def threaded_random(chd)
+        rnd     = Random.new(@seed)
+        size    = chd.header[:logical_bytes]
+        chunk   = [ THREADED_CHUNK, size ].min
+        offsets = Array.new(@ops) { rnd.rand(size - chunk + 1) }
+        jobs    = offsets.each_slice((@ops + @threads - 1) / @threads).to_a
+        handles = jobs.map { chd.dup }
+
+        measure(chd, jobs.each_with_index, threads: @threads) {|list, idx|
+            handle = handles[idx]
+            list.map {|offset|
+                started = clock
+                handle.read_bytes(offset, chunk)
+                clock - started
+            }.then {|latencies| [ list.size * chunk, latencies ] }
+        }.merge(:threads => @threads)
+    ensure
+        handles&.each(&:close)
+    end
+
+
+    private
+
+    def clock
+        Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+    end
+
+    # Time each operation, the block returns the number of bytes read
+    # (or, for threaded workloads, the number of bytes and latencies
+    # of all the operations performed by the thread)
+    def measure(chd, enum, threads: nil)
+        enum      = enum.to_a
+        stats     = chd.stats
+        GC.start
+        allocated = GC.stat(:total_allocated_objects)
+        started   = clock
+
+        if threads
+            results   = enum.map {|args| Thread.new { yield(*args) } }
+                            .map(&:value)
+            bytes     = results.sum(&:first)
+            latencies = results.flat_map(&:last)
+        else
+            bytes     = 0
+            latencies = Array.new(enum.size)
+            enum.each_with_index do |args, i|
+                t0 = clock
+                bytes += yield(args)
+                latencies[i] = clock - t0
+            end
+        end
+
+        elapsed   = (clock - started) / 1e9
+        allocated = GC.stat(:total_allocated_objects) - allocated
+        latencies.sort!
+        decoded   = chd.stats[:chd_reads] - stats[:chd_reads]
+
+        { :ops             => latencies.size,
+          :bytes           => bytes,
+          :seconds         => elapsed.round(6),
+          :mb_per_s        => (bytes / elapsed / 1e6).round(3),
+          :ops_per_s       => (latencies.size / elapsed).round(3),
+          :allocations     => allocated,
+          :allocations_per_op => (allocated.to_f / latencies.size).round(3),
+          :latency_p50_us  => percentile(latencies, 0.50),
+          :latency_p99_us  => percentile(latencies, 0.99),
+          :hunks_decoded   => threads ? nil : decoded,
+        }.compact
+    end
+
+    def percentile(sorted, p)
+        return nil if sorted.empty?
+        (sorted[((sorted.size - 1) * p).round] / 1e3).round(3)
+    end
+end
+
+end
+end
@@ -1,9 +1,19 @@
 #include <ruby.h>
 #include <ruby/io.h>
+#include <ruby/encoding.h>
+#include <ruby/thread.h>
 #include <libchdr/chd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 /**
  * Document-class: CHD
@@ -11,6 +21,27 @@
  * Accessing CHD MAME file.
  */
 
+/**
+ * Document-class: CHD::SharedCache
+ *
+ * Cache of decoded hunks shared between processes.
+ *
+ * The cache is a shared memory segment: anonymous when created
+ * without a path (so it must be created before forking the processes
+ * using it), or a mapped file (for example in `/dev/shm`) that
+ * unrelated processes can attach to, provided they use the same
+ * size and hunk size.
+ *
+ * Hunks are identified by the SHA-1 of the CHD file and their index,
+ * so all the accesses to the same CHD file, in all the processes,
+ * share the hunks decoded by any of them. The slots are protected by
+ * sequence locks: a process never waits for another one.
+ *
+ * @example Pre-forked workers
+ *   CHD.shared_cache = CHD::SharedCache.new(512 * 1024 * 1024)
+ *   4.times { fork { ... CHD.new('game.chd').read_bytes(...) ... } }
+ */
+
 /**
  * Document-class: CHD::Error
  *
@@ -102,6 +133,13 @@
                  typeof(&arr[0]))])) * 0)
 #endif
 
+/* Hunk types found in a V5 map (once decoded by libchdr) */
+#define CHD_V5_COMPRESSION_TYPE_0     0
+#define CHD_V5_COMPRESSION_TYPE_3     3
+#define CHD_V5_COMPRESSION_NONE       4
+#define CHD_V5_COMPRESSION_SELF       5
+#define CHD_V5_COMPRESSION_PARENT     6
+
 #ifndef CHD_METATADATA_BUFFER_MAXSIZE
 #define CHD_METATADATA_BUFFER_MAXSIZE 256
 #endif
@@ -126,38 +164,514 @@
 #define chd_rb_get_typeddata(chd, obj)					\
     TypedData_Get_Struct(obj, struct chd_rb_data, &chd_data_type, chd)
 
+#define chd_rb_get_shm(shm, obj)					\
+    TypedData_Get_Struct(obj, struct chd_rb_shm, &chd_rb_shm_type, shm)
+
+/* Default size of shared cache slots (a CD-ROM hunk: 8 frames) */
+#define CHD_RB_SHM_HUNK_BYTES (8 * (2352 + 96))
+
+
+/*
+ * Decoding statistics.
+ *
+ * Decodes are accounted per codec, with a latency histogram
+ * using log2 buckets of nanoseconds (bucket i: [2^i, 2^(i+1)) ns).
+ * Counters of a handle are updated with the instance lock held,
+ * process-wide counters are updated atomically.
+ */
+#define CHD_RB_STATS_BUCKETS 32
+
+enum chd_rb_stats_slot {
+    CHD_RB_SLOT_ZLIB,  CHD_RB_SLOT_LZMA,  CHD_RB_SLOT_HUFF,  CHD_RB_SLOT_FLAC,
+    CHD_RB_SLOT_CDZL,  CHD_RB_SLOT_CDLZ,  CHD_RB_SLOT_CDFL,  CHD_RB_SLOT_ZSTD,
+    CHD_RB_SLOT_CDZS,  CHD_RB_SLOT_NONE,  CHD_RB_SLOT_SELF,  CHD_RB_SLOT_PARENT,
+    CHD_RB_SLOT_OTHER, CHD_RB_SLOT_COUNT
+};
+
+static const char *chd_rb_stats_slot_names[CHD_RB_SLOT_COUNT] = {
+    "zlib", "lzma", "huff", "flac", "cdzl", "cdlz", "cdfl", "zstd",
+    "cdzs", "none", "self", "parent", "other",
+};
+
+/* Codec tags of the codec slots (as named above) */
+static const UINT32 chd_rb_stats_slot_tags[CHD_RB_SLOT_NONE] = {
+    CHD_MAKE_TAG('z','l','i','b'), CHD_MAKE_TAG('l','z','m','a'),
+    CHD_MAKE_TAG('h','u','f','f'), CHD_MAKE_TAG('f','l','a','c'),
+    CHD_MAKE_TAG('c','d','z','l'), CHD_MAKE_TAG('c','d','l','z'),
+    CHD_MAKE_TAG('c','d','f','l'), CHD_MAKE_TAG('z','s','t','d'),
+    CHD_MAKE_TAG('c','d','z','s'),
+};
+
+struct chd_rb_codec_stats {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t bytes_read;
+    uint64_t bytes_decompressed;
+    uint64_t ns;
+    uint64_t histogram[CHD_RB_STATS_BUCKETS];
+};
+
+struct chd_rb_stats {
+    uint64_t                  cache_hits;
+    uint64_t                  shared_hits;
+    struct chd_rb_codec_stats codecs[CHD_RB_SLOT_COUNT];
+};
+
+/* Decode event, reported to the on_decode callback */
+struct chd_rb_decode_event {
+    uint32_t hunkidx;
+    uint32_t slot;
+    uint32_t bytes_read;
+    uint64_t ns;
+    int      err;
+};
+
+static struct chd_rb_stats chd_rb_global_stats;
+
 
 struct chd_rb_data {
 #define CHD_RB_DATA_INITIALIZED  0x01
 #define CHD_RB_DATA_OPENED       0x02
 #define CHD_RB_DATA_PRECACHED    0x04
+#define CHD_RB_DATA_FREED        0x08     /* freed, but still a parent */
           int         flags;
-          chd_file   *file;
+          int         mode;
+          int         fd;
+          char       *path;           /* path, for a deferred opening */
+          chd_file   *file;           /* NULL until loaded (chd_rb_load) */
     const chd_header *header;
-          uint8_t    *cached_hunk;
-          int         cached_hunkidx;
+          chd_header  header_data;
+    struct chd_rb_data *parent;
+          int         children;       /* instances using it as parent */
+          uint64_t    precached_bytes;
           int         units_per_hunk;
+    pthread_mutex_t   lock;
+    struct {                      /* LRU cache of decoded hunks       */
+	VALUE        *strings;    /*   pool of hunk buffers (frozen)  */
+	uint8_t      *state;      /*   state of a pool entry          */
+	uint64_t     *generation; /*   rewrites of a pool entry       */
+	uint32_t      entries;
+	uint32_t     *entry;      /*   pool entry of a slot           */
+	int64_t      *hunkidx;    /*   hunk held by a slot (or -1)    */
+	uint64_t     *used;       /*   last use of a slot             */
+	uint64_t      tick;
+	uint32_t      slots;
+	uint32_t      hunkbytes;
+	struct chd_rb_data  *next; /*  registry of pools (see below)  */
+	struct chd_rb_data **prev;
+    } cache;
+    struct {                      /* Background decoding in the cache */
+	pthread_t     thread;
+	pthread_cond_t cond;
+	int           running;
+	int           stop;
+	uint32_t     *queue;      /*   ring of hunks to decode        */
+	uint32_t      head;
+	uint32_t      count;
+	uint32_t      readahead;  /*   hunks read ahead (0: disabled) */
+    } prefetch;
+    struct chd_rb_stats stats;
+    struct chd_rb_shm  *shm;      /* shared cache (if attached)       */
+    uint8_t             shm_key[CHD_SHA1_BYTES];
     struct {
 	VALUE header;
+	VALUE file;
+	VALUE parent;
+	VALUE on_decode;
+	VALUE shared_cache;
     } value;
 };
 
-static void chd_rb_data_type_free(void *data) {
+static void chd_rb_prefetch_stop(struct chd_rb_data *chd);
+
+
+/*
+ * Cache of decoded hunks shared between processes (CHD::SharedCache).
+ *
+ * The cache is a memory segment, either an anonymous shared mapping
+ * (inherited by forked processes) or a mapped file (such as in
+ * /dev/shm), made of a header holding the geometry and statistics,
+ * followed by the slots. A slot holds a decoded hunk keyed by the
+ * digest of the CHD (its SHA-1) and the hunk index; slots are
+ * grouped in sets of CHD_RB_SHM_WAYS, in which the least recently
+ * used slot is replaced.
+ *
+ * Slots are protected by a seqlock: a writer makes the sequence odd
+ * (giving up if it already is), updates the slot, and makes the
+ * sequence even again; a reader copies the slot data, and discards
+ * the copy if the sequence was odd or has changed meanwhile. So no
+ * process ever waits for another (a process dying while writing only
+ * loses the slot).
+ */
+#define CHD_RB_SHM_MAGIC 0x4348445348433031ULL     /* "CHDSHC01" */
+#define CHD_RB_SHM_WAYS  4
+
+struct chd_rb_shm_header {
+    uint64_t magic;
+    uint32_t slots;
+    uint32_t slot_bytes;          /* maximum hunk size                */
+    uint64_t tick;                /* clock for the LRU replacement    */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stores;
+    uint64_t evictions;
+} __attribute__((aligned(64)));
+
+struct chd_rb_shm_slot {
+    uint64_t seq;
+    uint64_t used;                /* last use (0: empty)              */
+    uint8_t  key[CHD_SHA1_BYTES];
+    uint32_t hunkidx;
+    uint32_t length;
+} __attribute__((aligned(64)));   /* followed by the hunk data        */
+
+/* The geometry is copied from the header once validated, as the
+ * segment can be written by any process */
+struct chd_rb_shm {
+    struct chd_rb_shm_header *header;
+    size_t                    size;
+    size_t                    stride;
+    uint32_t                  slots;
+    uint32_t                  slot_bytes;
+    uint32_t                  refs;  /* ruby object + attached CHD    */
+};
+
+static struct chd_rb_shm_slot *
+chd_rb_shm_slot(struct chd_rb_shm *shm, uint32_t idx)
+{
+    return (struct chd_rb_shm_slot *)
+	((char *)shm->header + sizeof(struct chd_rb_shm_header) +
+	 (size_t)idx * shm->stride);
+}
+
+/* First slot of the set of a hunk (FNV-1a of the key) */
+static uint32_t
+chd_rb_shm_set(struct chd_rb_shm *shm, const uint8_t *key, uint32_t hunkidx)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0 ; i < CHD_SHA1_BYTES ; i++)
+	hash = (hash ^ key[i]) * 0x100000001b3ULL;
+    for (int i = 0 ; i < 4 ; i++, hunkidx >>= 8)
+	hash = (hash ^ (hunkidx & 0xff)) * 0x100000001b3ULL;
+    return (hash % (shm->slots / CHD_RB_SHM_WAYS)) * CHD_RB_SHM_WAYS;
+}
+
+static int
+chd_rb_shm_lookup(struct chd_rb_shm *shm, const uint8_t *key,
+		  uint32_t hunkidx, void *buffer, uint32_t length)
+{
+    struct chd_rb_shm_header *header = shm->header;
+    uint32_t set = chd_rb_shm_set(shm, key, hunkidx);
+
+    for (int way = 0 ; way < CHD_RB_SHM_WAYS ; way++) {
+	struct chd_rb_shm_slot *slot = chd_rb_shm_slot(shm, set + way);
+	uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if ((seq & 1) || (slot->used == 0) || (slot->hunkidx != hunkidx) ||
+	    (slot->length != length) || memcmp(slot->key, key, CHD_SHA1_BYTES))
+	    continue;
+
+	memcpy(buffer, slot + 1, length);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+	    continue;
+
+	__atomic_store_n(&slot->used,
+			 __atomic_add_fetch(&header->tick, 1, __ATOMIC_RELAXED),
+			 __ATOMIC_RELAXED);
+	__atomic_fetch_add(&header->hits, 1, __ATOMIC_RELAXED);
+	return 1;
+    }
+
+    __atomic_fetch_add(&header->misses, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void
+chd_rb_shm_store(struct chd_rb_shm *shm, const uint8_t *key,
+		 uint32_t hunkidx, const void *data, uint32_t length)
+{
+    struct chd_rb_shm_header *header = shm->header;
+    struct chd_rb_shm_slot   *victim = NULL;
+    uint32_t set = chd_rb_shm_set(shm, key, hunkidx);
+
+    if (length > shm->slot_bytes)
+	return;
+
+    // Least recently used slot of the set
+    // (unless already stored by another process)
+    for (int way = 0 ; way < CHD_RB_SHM_WAYS ; way++) {
+	struct chd_rb_shm_slot *slot = chd_rb_shm_slot(shm, set + way);
+	uint64_t used = __atomic_load_n(&slot->used, __ATOMIC_RELAXED);
+	if ((used != 0) && (slot->hunkidx == hunkidx) &&
+	    (memcmp(slot->key, key, CHD_SHA1_BYTES) == 0))
+	    return;
+	if ((victim == NULL) || (used < victim->used))
+	    victim = slot;
+    }
+
+    // Lock the slot (give up if another process is writing it)
+    uint64_t seq = __atomic_load_n(&victim->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) ||
+	! __atomic_compare_exchange_n(&victim->seq, &seq, seq + 1, 0,
+				      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	return;
+
+    if (victim->used != 0)
+	__atomic_fetch_add(&header->evictions, 1, __ATOMIC_RELAXED);
+    memcpy(victim->key, key, CHD_SHA1_BYTES);
+    memcpy(victim + 1, data, length);
+    victim->hunkidx = hunkidx;
+    victim->length  = length;
+    victim->used    = __atomic_add_fetch(&header->tick, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&header->stores, 1, __ATOMIC_RELAXED);
+}
+
+static void
+chd_rb_shm_release(struct chd_rb_shm *shm)
+{
+    if (__atomic_sub_fetch(&shm->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+	if (shm->header)
+	    munmap(shm->header, shm->size);
+	free(shm);
+    }
+}
+
+/* Detach the shared cache (the instance lock must be held, if it
+ * can be used concurrently) */
+static void
+chd_rb_shm_detach(struct chd_rb_data *chd)
+{
+    if (chd->shm) {
+	chd_rb_shm_release(chd->shm);
+	chd->shm = NULL;
+    }
+}
+
+/* Key identifying the CHD in the shared cache (SHA-1, or MD5 before
+ * version 3); returns 0 if the CHD has no digest */
+static int
+chd_rb_shm_key(struct chd_rb_data *chd, uint8_t *key)
+{
+    static const uint8_t null[CHD_SHA1_BYTES] = { 0 };
+
+    memset(key, 0, CHD_SHA1_BYTES);
+    if (chd->header->version >= 3)
+	memcpy(key, chd->header->sha1, CHD_SHA1_BYTES);
+    else
+	memcpy(key, chd->header->md5,  CHD_MD5_BYTES);
+    return memcmp(key, null, CHD_SHA1_BYTES) != 0;
+}
+
+/*
+ * Take the instance lock from a ruby thread.
+ *
+ * The lock is held while decoding (possibly by a background thread),
+ * so it is waited for without the GVL, not to block the other ruby
+ * threads meanwhile. As rb_thread_call_without_gvl2 doesn't call the
+ * function if interrupted, pending interrupts are processed (before
+ * the lock is held) and the attempt is renewed.
+ */
+static void *
+chd_rb_lock_nogvl(void *data)
+{
     struct chd_rb_data *chd = data;
-    if (chd->file) {
-	chd_close(chd->file);
+    pthread_mutex_lock(&chd->lock);
+    return chd;
+}
+
+static void
+chd_rb_lock(struct chd_rb_data *chd)
+{
+    while (pthread_mutex_trylock(&chd->lock) != 0) {
+	if (rb_thread_call_without_gvl2(chd_rb_lock_nogvl, chd, NULL, NULL))
+	    return;
+	rb_thread_check_ints();
+    }
+}
+
+/* Attach a shared cache (or none), replacing the current one */
+static void
+chd_rb_shm_attach(struct chd_rb_data *chd, struct chd_rb_shm *shm)
+{
+    chd_rb_lock(chd);
+    chd_rb_shm_detach(chd);
+    if (shm && chd_rb_shm_key(chd, chd->shm_key)) {
+	__atomic_add_fetch(&shm->refs, 1, __ATOMIC_ACQ_REL);
+	chd->shm = shm;
+    }
+    pthread_mutex_unlock(&chd->lock);
+}
+
+
+/* The segment is released once no longer used by any instance */
+static void chd_rb_shm_type_free(void *data) {
+    chd_rb_shm_release(data);
+}
+static size_t chd_rb_shm_type_size(const void *data) {
+    const struct chd_rb_shm *shm = data;
+    return sizeof(struct chd_rb_shm) + shm->size;
+}
+
+static const rb_data_type_t chd_rb_shm_type = {
+    .wrap_struct_name = "chd/shared_cache",
+    .function         = { .dfree = chd_rb_shm_type_free,
+			  .dsize = chd_rb_shm_type_size, },
+    .data             = NULL,
+    .flags            = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+/* Shared cache attached to CHD when opened (see CHD.shared_cache=) */
+static VALUE chd_rb_default_shared_cache = Qnil;
+
+/* Shared cache of a value (nil allowed), checking it can be used */
+static struct chd_rb_shm *
+chd_rb_shm_get(VALUE cache)
+{
+    struct chd_rb_shm *shm = NULL;
+    if (! NIL_P(cache)) {
+	chd_rb_get_shm(shm, cache);
+	if (shm->header == NULL)
+	    rb_bug("uninitialized instance");
+    }
+    return shm;
+}
+
+
+/*
+ * Registry of the hunk cache pools.
+ *
+ * The strings of a pool are marked from the registry rather than
+ * from their instance: once an instance is garbage, its strings must
+ * survive until the background decoding, which may still be writing
+ * into them, has been stopped by the free function.
+ */
+static struct chd_rb_data *chd_rb_cache_pools     = NULL;
+static VALUE               chd_rb_cache_pools_obj = Qnil;
+
+static void chd_rb_cache_pools_mark(void *data) {
+    struct chd_rb_data **pools = data;
+    for (struct chd_rb_data *chd = *pools ; chd ;
+	 chd = chd->cache.next) {
+	rb_gc_mark_locations(chd->cache.strings,
+			     chd->cache.strings + chd->cache.entries);
     }
-    if (chd->cached_hunk) {
-	free(chd->cached_hunk);
+}
+
+static const rb_data_type_t chd_rb_cache_pools_type = {
+    .wrap_struct_name = "chd/cache",
+    .function         = { .dmark = chd_rb_cache_pools_mark, },
+    .data             = NULL,
+    .flags            = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static void
+chd_rb_cache_register(struct chd_rb_data *chd)
+{
+    chd->cache.next = chd_rb_cache_pools;
+    chd->cache.prev = &chd_rb_cache_pools;
+    if (chd_rb_cache_pools)
+	chd_rb_cache_pools->cache.prev = &chd->cache.next;
+    chd_rb_cache_pools = chd;
+}
+
+static void
+chd_rb_cache_unregister(struct chd_rb_data *chd)
+{
+    if (chd->cache.prev == NULL)
+	return;
+    if (chd->cache.next)
+	chd->cache.next->cache.prev = chd->cache.prev;
+    *chd->cache.prev = chd->cache.next;
+    chd->cache.next  = NULL;
+    chd->cache.prev  = NULL;
+}
+
+
+static void chd_rb_release(struct chd_rb_data *chd);
+
+static void
+chd_rb_data_destroy(struct chd_rb_data *chd)
+{
+    free(chd->cache.strings);
+    free(chd->cache.state);
+    free(chd->cache.generation);
+    free(chd->cache.entry);
+    free(chd->cache.hunkidx);
+    free(chd->cache.used);
+    free(chd->prefetch.queue);
+    pthread_cond_destroy(&chd->prefetch.cond);
+    pthread_mutex_destroy(&chd->lock);
+    free(chd);
+}
+
+/*
+ * As a parent can be collected along with its children, in any order,
+ * its destruction is deferred until the last child is released
+ * (see chd_rb_release).
+ */
+static void chd_rb_data_type_free(void *data) {
+    struct chd_rb_data *chd = data;
+    chd_rb_prefetch_stop(chd);
+    chd_rb_cache_unregister(chd);
+    chd_rb_shm_detach(chd);
+    chd->flags = (chd->flags & ~CHD_RB_DATA_OPENED) | CHD_RB_DATA_FREED;
+    chd_rb_release(chd);
+}
+
+/*
+ * Approximate memory used by libchdr for a decoder context,
+ * according to its codec implementations (the CD codecs also
+ * have a zlib context for the subcode, and a hunk buffer).
+ */
+static size_t
+chd_rb_codec_footprint(uint32_t codec, uint32_t hunkbytes)
+{
+    const size_t zlib = 40 * 1024;      /* inflate state and window  */
+    const size_t lzma = 32 * 1024;      /* + dictionary (hunk size)  */
+    const size_t huff = 132 * 1024;     /* 16-bit lookup table       */
+    const size_t flac = 16 * 1024;
+    const size_t zstd = 160 * 1024;     /* + window (hunk size)      */
+
+    switch (codec) {
+    case CHD_MAKE_TAG('z','l','i','b'): return zlib;
+    case CHD_MAKE_TAG('l','z','m','a'): return lzma + hunkbytes;
+    case CHD_MAKE_TAG('h','u','f','f'): return huff;
+    case CHD_MAKE_TAG('f','l','a','c'): return flac;
+    case CHD_MAKE_TAG('z','s','t','d'): return zstd + hunkbytes;
+    case CHD_MAKE_TAG('c','d','z','l'): return zlib + zlib + hunkbytes;
+    case CHD_MAKE_TAG('c','d','l','z'): return lzma + 2 * hunkbytes + zlib;
+    case CHD_MAKE_TAG('c','d','f','l'): return flac + zlib + hunkbytes;
+    case CHD_MAKE_TAG('c','d','z','s'): return zstd + 2 * hunkbytes + zstd;
+    default:                            return 0;
     }
-    free(data);
 }
+
 static size_t chd_rb_data_type_size(const void *data) {
     const struct chd_rb_data *chd = data;
     size_t size             = sizeof(struct chd_rb_data);
 
-    if (chd->cached_hunk)
-	size += chd->header->hunkbytes;
+    // libchdr handle: map, hunk buffers, and decoder contexts
+    // (precaching loads the whole file in memory)
+    if (chd->file) {
+	const chd_header *header = chd->header;
+	size += (size_t)header->totalhunks *
+	            ((header->compression[0] != CHD_CODEC_NONE) ? 12 : 4) +
+	        2 * (size_t)header->hunkbytes + chd->precached_bytes;
+	for (size_t i = 0 ; i < ARRAY_SIZE(header->compression) ; i++)
+	    size += chd_rb_codec_footprint(header->compression[i],
+					   header->hunkbytes);
+    }
+    if (chd->path)
+	size += strlen(chd->path) + 1;
+
+    // (hunk buffers are strings, accounted by themselves)
+    if (chd->cache.strings)
+	size += (size_t)chd->cache.entries *
+	            (sizeof(VALUE) + sizeof(uint8_t) + sizeof(uint64_t)) +
+	        (size_t)chd->cache.slots *
+	            (sizeof(uint32_t) + sizeof(int64_t) + sizeof(uint64_t) +
+		     sizeof(uint32_t));
 
     return size;
 }
@@ -177,7 +691,9 @@ static rb_data_type_t chd_data_type = {
 };
 
 
+
 static VALUE cCHD                        = Qundef;
+static VALUE cCHDSharedCache             = Qundef;
 static VALUE eCHDError                   = Qundef;
 static VALUE eCHDNotSupportedError       = Qundef;
 static VALUE eCHDIOError                 = Qundef;
@@ -189,6 +705,7 @@ static VALUE eCHDParentRequiredError     = Qundef;
 static VALUE eCHDParentInvalidError      = Qundef;
 
 static ID id_parent;
+static ID id_path;
 static ID id_version;
 static ID id_compression;
 static ID id_md5;
@@ -199,6 +716,42 @@ static ID id_hunk_count;
 static ID id_unit_bytes;
 static ID id_unit_count;
 static ID id_logical_bytes;
+static ID id_offset;
+static ID id_length;
+static ID id_swap;
+static ID id_tail;
+static ID id_raw;
+static ID id_type;
+static ID id_codec;
+static ID id_crc16;
+static ID id_data;
+static ID id_none;
+static ID id_self;
+static ID id_compressed;
+static ID id_call;
+static ID id_hunks;
+static ID id_willneed;
+static ID id_dontneed;
+static ID id_sequential;
+static ID id_random;
+static ID id_normal;
+static ID id_count;
+static ID id_cache_hits;
+static ID id_shared_hits;
+static ID id_slots;
+static ID id_slot_bytes;
+static ID id_used;
+static ID id_hits;
+static ID id_misses;
+static ID id_stores;
+static ID id_evictions;
+static ID id_chd_reads;
+static ID id_errors;
+static ID id_bytes_read;
+static ID id_bytes_decompressed;
+static ID id_seconds;
+static ID id_histogram;
+static ID id_codecs;
 
 
 static VALUE chd_m_close(VALUE self);
@@ -211,7 +764,14 @@ chd_rb_alloc(VALUE klass)
     struct chd_rb_data *chd;
     VALUE               obj = TypedData_Make_Struct(cCHD, struct chd_rb_data,
 						    &chd_data_type, chd);
-    chd->value.header = Qnil;
+    chd->value.header    = Qnil;
+    chd->value.file      = Qnil;
+    chd->value.parent    = Qnil;
+    chd->value.on_decode = Qnil;
+    chd->value.shared_cache = Qnil;
+    chd->fd              = -1;
+    pthread_mutex_init(&chd->lock, NULL);
+    pthread_cond_init(&chd->prefetch.cond, NULL);
     return obj;
 }
 
@@ -232,6 +792,18 @@ chd_rb_ensure_opened(struct chd_rb_data *chd)
     }
 }
 
+/* Take the instance lock, raising an error if the file was closed
+ * (possibly while waiting for the lock) */
+static void
+chd_rb_lock_opened(struct chd_rb_data *chd)
+{
+    chd_rb_lock(chd);
+    if (! (chd->flags & CHD_RB_DATA_OPENED)) {
+	pthread_mutex_unlock(&chd->lock);
+	rb_raise(eCHDError, "closed");
+    }
+}
+
 static void
 chd_rb_raise_if_error(chd_error err) {
     switch(err) {
@@ -345,7 +917,7 @@ chd_rb_header(const chd_header *header) {
 
     if (header->version >= 5) {
 	VALUE compression = rb_ary_new();
-	for (int i = 0 ; i < ARRAY_SIZE(header->compression) ; i++) {
+	for (size_t i = 0 ; i < ARRAY_SIZE(header->compression) ; i++) {
 	    if (header->compression[i] == CHD_CODEC_NONE)
 		continue;
 
@@ -367,484 +939,2619 @@ chd_rb_header(const chd_header *header) {
 }
 
 
-/**
- * (see CHD#initialize)
+/*
+ * CRC-16 (CCITT) as used by the CHD V5 map to protect hunk data.
  */
-static VALUE
-chd_s_new(int argc, VALUE *argv, VALUE klass)
+static uint16_t
+chd_rb_crc16(const uint8_t *data, size_t length)
 {
-    return rb_class_new_instance_kw(argc, argv, klass, RB_PASS_CALLED_KEYWORDS);
+    static uint16_t table[256];
+    static int      table_ready = 0;
+
+    if (! table_ready) {
+	for (int i = 0 ; i < 256 ; i++) {
+	    uint16_t crc = i << 8;
+	    for (int b = 0 ; b < 8 ; b++)
+		crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+	    table[i] = crc;
+	}
+	table_ready = 1;
+    }
+
+    uint16_t crc = 0xffff;
+    while (length--)
+	crc = (crc << 8) ^ table[(crc >> 8) ^ *data++];
+    return crc;
 }
 
 
-/**
- * Open a CHD file.
- *
- * With no associated block {CHD.open} is synonym for {CHD.new}.
- * If the optional code block is given, it will be passed the opened CHD file
- * as an argument and the CHD object will automatically be closed when
- * the block terminates. The value of the block will be returned.
- *
- * @note Only the read-only mode ({RDONLY}) is currently supported.
- *
- * @overload open(file, mode=RDONLY, parent: nil)
- *   @param file   [String, IO] path-string or open IO on the CHD file
- *   @param mode   [Integer]    opening mode ({RDONLY} or {RDWR})
- *   @param parent [String, IO] path-string or open IO on the CHD parent file.
- * 
- * @yield [chd] the opened CHD file
+/*
+ * Decoded entry of the V5 hunk map.
  *
- * @example
- *   CHD.open('file.chd') do |chd|
- *     puts chd.metadata
- *   end
+ * For NONE and compressed hunks the offset is the position in the file,
+ * for SELF the referenced hunk, and for PARENT the referenced unit.
  */
-static VALUE
-chd_s_open(int argc, VALUE *argv, VALUE klass)
+struct chd_rb_map_entry {
+    uint8_t  type;
+    uint32_t length;
+    uint64_t offset;
+    uint16_t crc;
+    int      has_crc;
+};
+
+/*
+ * Open the libchdr handle of a CHD opened from a path, which is
+ * deferred until hunks need to be decoded (see chd_rb_open), as it
+ * allocates the decompression contexts and loads the hunk map.
+ * The parent, if any, is loaded first.
+ * Must be called with the instance lock held.
+ */
+static chd_error
+chd_rb_load(struct chd_rb_data *chd)
 {
-    VALUE chd;
+    if (chd->file)
+	return CHDERR_NONE;
+    if (chd->path == NULL)
+	return CHDERR_FILE_NOT_FOUND;
+
+    chd_file *parent_file = NULL;
+    if (chd->parent) {
+	pthread_mutex_lock(&chd->parent->lock);
+	chd_error err = chd_rb_load(chd->parent);
+	parent_file   = chd->parent->file;
+	pthread_mutex_unlock(&chd->parent->lock);
+	if (parent_file == NULL)
+	    return (err == CHDERR_NONE) ? CHDERR_REQUIRES_PARENT : err;
+    }
 
-    chd = rb_class_new_instance_kw(argc, argv, klass, RB_PASS_CALLED_KEYWORDS);
+    return chd_open(chd->path, chd->mode, parent_file, &chd->file);
+}
 
-    if (rb_block_given_p()) {
-        return rb_ensure(rb_yield, chd, chd_m_close, chd);
-    }
+static void *
+chd_rb_load_nogvl(void *data)
+{
+    struct chd_rb_data *chd = data;
+    chd_error           err;
 
-    return chd;
+    pthread_mutex_lock(&chd->lock);
+    err = chd_rb_load(chd);
+    pthread_mutex_unlock(&chd->lock);
+
+    return (void *)(intptr_t)err;
 }
 
+static void
+chd_rb_ensure_loaded(struct chd_rb_data *chd)
+{
+    if (chd->file == NULL) {
+	void *err = rb_thread_call_without_gvl(chd_rb_load_nogvl, chd,
+					       NULL, NULL);
+	chd_rb_raise_if_error((chd_error)(intptr_t)err);
+    }
+}
 
-/**
- * Retrieve the header from a CHD file.
- *
- * For a detailed description of the header, see {#header}.
- * 
- * @param filename [String] path to CHD file
- *
- * @return [Hash{Symbol => Object}]
- */
-static VALUE
-chd_s_header(VALUE klass, VALUE filename)
+/* Raw hunk map (only available once loaded) */
+static const uint8_t *
+chd_rb_rawmap(struct chd_rb_data *chd)
 {
-    chd_header header;
-    chd_error  err;
+    return chd->file ? chd_get_header(chd->file)->rawmap : NULL;
+}
 
-    err = chd_read_header(StringValueCStr(filename), &header);
-    chd_rb_raise_if_error(err);    
+static void
+chd_rb_ensure_v5_map(struct chd_rb_data *chd)
+{
+    if (chd->header->version >= 5)
+	chd_rb_ensure_loaded(chd);
+    if ((chd->header->version < 5) || (chd_rb_rawmap(chd) == NULL)) {
+	rb_raise(eCHDNotSupportedError,
+		 "hunk map is only available for CHD version 5");
+    }
+}
 
-    return chd_rb_header(&header);
+static void
+chd_rb_map_entry(struct chd_rb_data *chd, uint32_t hunkidx,
+		 struct chd_rb_map_entry *entry)
+{
+    const chd_header *header = chd->header;
+    const uint8_t    *rawmap = chd_rb_rawmap(chd);
+
+    // Compressed CHD: 12-bytes entries
+    //   type(1), length(3), offset(6), crc16(2)
+    if (header->compression[0] != CHD_CODEC_NONE) {
+	const uint8_t *raw = &rawmap[hunkidx * 12];
+	entry->type    = raw[0];
+	entry->length  = ((uint32_t)raw[1] << 16) | (raw[2] << 8) | raw[3];
+	entry->offset  = 0;
+	for (int i = 4 ; i < 10 ; i++)
+	    entry->offset = (entry->offset << 8) | raw[i];
+	entry->crc     = (raw[10] << 8) | raw[11];
+	entry->has_crc = entry->type <= CHD_V5_COMPRESSION_NONE;
+
+    // Uncompressed CHD: 4-bytes entries
+    //   offset in hunk unit (0: parent if any, or zero-filled)
+    } else {
+	const uint8_t *raw = &rawmap[hunkidx * 4];
+	uint32_t blockoffs = ((uint32_t)raw[0] << 24) | (raw[1] << 16) |
+	                     (raw[2] << 8) | raw[3];
+	entry->has_crc = 0;
+	entry->crc     = 0;
+	if (blockoffs != 0) {
+	    entry->type    = CHD_V5_COMPRESSION_NONE;
+	    entry->length  = header->hunkbytes;
+	    entry->offset  = (uint64_t)blockoffs * header->hunkbytes;
+	} else if (header->flags & CHDFLAGS_HAS_PARENT) {
+	    entry->type    = CHD_V5_COMPRESSION_PARENT;
+	    entry->length  = 0;
+	    entry->offset  = (uint64_t)hunkidx * header->hunkbytes /
+		                             header->unitbytes;
+	} else {
+	    entry->type    = CHD_V5_COMPRESSION_NONE;
+	    entry->length  = 0;
+	    entry->offset  = 0;
+	}
+    }
 }
 
 
-/**
- * Create a new access to a CHD file.
+/*
+ * Hunk decoding is performed without holding the GVL, so that it
+ * can run concurrently with other ruby threads. As a libchdr handle
+ * is not thread-safe, accesses to the chd file and to the hunk cache
+ * are serialized using the instance lock.
  *
- * @note Only the read-only mode ({RDONLY}) is currently supported.
- *
- * @overload initialize(file, mode=RDONLY, parent: nil)
- *   @param file   [String, IO] path-string or open IO on the CHD file
- *   @param mode   [Integer]    opening mode ({RDONLY} or {RDWR})
- *   @param parent [String, IO] path-string or open IO on the CHD parent file.
+ * As the file can be closed by another thread meanwhile, the geometry
+ * is copied while the GVL is held, and the file is checked to still
+ * be opened once the lock is taken (see chd_rb_read_opened).
  *
- * @return [CHD]
+ * Depending on the operation, offset/size are expressed in
+ * hunks, units, or bytes.
  */
-static VALUE
-chd_m_initialize(int argc, VALUE *argv, VALUE self)
-{
-    VALUE file, mode, opts;
-    ID    kwargs_id[1] = { id_parent };
-    VALUE kwargs   [1];
-    
-    // Retrieve typed data
+struct chd_rb_read {
     struct chd_rb_data *chd;
-    chd_rb_get_typeddata(chd, self);
+    char               *buffer;
+    uint64_t            offset;
+    uint64_t            size;
+    uint32_t            hunkbytes;
+    uint32_t            unitbytes;
+    uint32_t            units_per_hunk;
+    int                 closed;
+    uint32_t            slice_offset;
+    uint32_t            slice_length;
+    uint32_t            slice_tail;
+    int                 swap;
+    chd_error           err;
+    int                 background;
+    uint32_t            entry;
+    uint64_t            generation;
+    struct chd_rb_decode_event *events;
+    size_t              events_count;
+    size_t              events_size;
+};
 
-    // Sanity check
-    if (chd->flags & CHD_RB_DATA_INITIALIZED) {
-	rb_warn("%"PRIsVALUE" refusing to initialize same instance twice",
-		rb_obj_as_string(cCHD));
-	return Qnil;
+/* Is the file still opened? (to be checked once the instance lock
+ * is taken, as it may have been closed by another thread) */
+static int
+chd_rb_read_opened(struct chd_rb_read *rd)
+{
+    if (rd->chd->flags & CHD_RB_DATA_OPENED)
+	return 1;
+    rd->closed = 1;
+    return 0;
+}
+
+/* Statistics slot of a hunk, and number of bytes read from the file */
+static enum chd_rb_stats_slot
+chd_rb_stats_slot(struct chd_rb_data *chd, uint32_t hunkidx,
+		  uint32_t *bytes_read)
+{
+    struct chd_rb_map_entry entry;
+
+    *bytes_read = 0;
+    if ((chd->header->version < 5) || (chd_rb_rawmap(chd) == NULL) ||
+	(hunkidx >= chd->header->totalhunks))
+	return CHD_RB_SLOT_OTHER;
+
+    chd_rb_map_entry(chd, hunkidx, &entry);
+    switch (entry.type) {
+    case CHD_V5_COMPRESSION_NONE:
+	*bytes_read = entry.length;
+	return CHD_RB_SLOT_NONE;
+    case CHD_V5_COMPRESSION_SELF:
+	return CHD_RB_SLOT_SELF;
+    case CHD_V5_COMPRESSION_PARENT:
+	return CHD_RB_SLOT_PARENT;
     }
 
-    // Retrieve arguments
-    rb_scan_args_kw(RB_SCAN_ARGS_LAST_HASH_KEYWORDS, argc, argv, "11:",
-		    &file, &mode, &opts);
-    rb_get_kwargs(opts, kwargs_id, 0, 2, kwargs);
+    *bytes_read = entry.length;
+    for (int i = 0 ; i < CHD_RB_SLOT_NONE ; i++)
+	if (chd_rb_stats_slot_tags[i] == chd->header->compression[entry.type])
+	    return i;
+    return CHD_RB_SLOT_OTHER;
+}
 
-    // If mode not specified, default to read-only
-    if (NIL_P(mode)) {
-	mode = INT2FIX(CHD_OPEN_READ);
-    }
-    
+#define CHD_RB_STATS_ADD(atomic, var, val)				\
+    do {								\
+	if (atomic) __atomic_fetch_add(&(var), (val), __ATOMIC_RELAXED); \
+	else        (var) += (val);					\
+    } while(0)
+
+static void
+chd_rb_stats_record(struct chd_rb_stats *stats, int atomic,
+		    enum chd_rb_stats_slot slot, uint32_t bytes_read,
+		    uint32_t bytes_decompressed, uint64_t ns, chd_error err)
+{
+    struct chd_rb_codec_stats *codec = &stats->codecs[slot];
+    int bucket = 0;
+    for (uint64_t v = ns ; v > 1 && bucket < CHD_RB_STATS_BUCKETS - 1 ; v >>= 1)
+	bucket++;
+
+    CHD_RB_STATS_ADD(atomic, codec->count,                   1);
+    CHD_RB_STATS_ADD(atomic, codec->ns,                     ns);
+    CHD_RB_STATS_ADD(atomic, codec->histogram[bucket],       1);
+    CHD_RB_STATS_ADD(atomic, codec->bytes_read,     bytes_read);
+    if (err == CHDERR_NONE) {
+	CHD_RB_STATS_ADD(atomic, codec->bytes_decompressed, bytes_decompressed);
+    } else {
+	CHD_RB_STATS_ADD(atomic, codec->errors,              1);
+    }
+}
+
+static void
+chd_rb_stats_cache_hit(struct chd_rb_data *chd)
+{
+    chd->stats.cache_hits++;
+    CHD_RB_STATS_ADD(1, chd_rb_global_stats.cache_hits, 1);
+}
+
+/*
+ * May decoding the hunk access the parent? (parent reference, possibly
+ * through self references, or unknown without the V5 hunk map)
+ */
+static int
+chd_rb_reaches_parent(struct chd_rb_data *chd, uint32_t hunkidx)
+{
+    struct chd_rb_map_entry entry;
+
+    if (chd->parent == NULL)
+	return 0;
+    if ((chd->header->version < 5) || (chd_rb_rawmap(chd) == NULL))
+	return 1;
+
+    chd_rb_map_entry(chd, hunkidx, &entry);
+    while ((entry.type == CHD_V5_COMPRESSION_SELF) && (entry.offset < hunkidx)) {
+	hunkidx = entry.offset;
+	chd_rb_map_entry(chd, hunkidx, &entry);
+    }
+    return (entry.type == CHD_V5_COMPRESSION_SELF  ) ||
+	   (entry.type == CHD_V5_COMPRESSION_PARENT);
+}
+
+/*
+ * Lock (or unlock) the parent, grand-parent, ... of an instance.
+ * Locks are always taken from child to parent, so that they can't
+ * be waiting for each other.
+ */
+static void
+chd_rb_lock_ancestors(struct chd_rb_data *chd, int lock)
+{
+    for (struct chd_rb_data *p = chd->parent ; p ; p = p->parent) {
+	if (lock)
+	    pthread_mutex_lock(&p->lock);
+	else
+	    pthread_mutex_unlock(&p->lock);
+    }
+}
+
+/*
+ * Decode a hunk (chd_read), accounting it in the statistics,
+ * and recording the event if a callback is registered.
+ * Must be called with the instance lock held.
+ */
+static chd_error
+chd_rb_decode(struct chd_rb_read *rd, uint32_t hunkidx, void *buffer)
+{
+    struct chd_rb_data *chd = rd->chd;
+    struct timespec     start, end;
+    uint32_t            bytes_read;
+
+    // Hunk already decoded by another process (or handle)
+    if (chd->shm &&
+	chd_rb_shm_lookup(chd->shm, chd->shm_key, hunkidx, buffer,
+			  chd->header->hunkbytes)) {
+	chd->stats.shared_hits++;
+	CHD_RB_STATS_ADD(1, chd_rb_global_stats.shared_hits, 1);
+	return CHDERR_NONE;
+    }
+
+    chd_error err = chd_rb_load(chd);
+    if (err != CHDERR_NONE)
+	return err;
+
+    enum chd_rb_stats_slot slot = chd_rb_stats_slot(chd, hunkidx, &bytes_read);
+
+    // libchdr reads parent hunks with the handle of the parent,
+    // which is shared with the parent instance (and its other children)
+    int ancestors = chd_rb_reaches_parent(chd, hunkidx);
+    if (ancestors)
+	chd_rb_lock_ancestors(chd, 1);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    err = chd_read(chd->file, hunkidx, buffer);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (ancestors)
+	chd_rb_lock_ancestors(chd, 0);
+
+    uint64_t ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000 +
+	          end.tv_nsec - start.tv_nsec;
+    chd_rb_stats_record(&chd->stats,         0, slot, bytes_read,
+			chd->header->hunkbytes, ns, err);
+    chd_rb_stats_record(&chd_rb_global_stats, 1, slot, bytes_read,
+			chd->header->hunkbytes, ns, err);
+
+    if (chd->shm && (err == CHDERR_NONE))
+	chd_rb_shm_store(chd->shm, chd->shm_key, hunkidx, buffer,
+			 chd->header->hunkbytes);
+
+    if (! NIL_P(chd->value.on_decode) && ! rd->background) {
+	if (rd->events_count == rd->events_size) {
+	    size_t size = rd->events_size ? 2 * rd->events_size : 16;
+	    void  *events = realloc(rd->events, size * sizeof(*rd->events));
+	    if (events == NULL)
+		return err;
+	    rd->events      = events;
+	    rd->events_size = size;
+	}
+	rd->events[rd->events_count++] = (struct chd_rb_decode_event) {
+	    .hunkidx = hunkidx, .slot = slot, .bytes_read = bytes_read,
+	    .ns      = ns,      .err  = err,
+	};
+    }
+
+    return err;
+}
+
+/*
+ * Hunk cache.
+ *
+ * Decoded hunks are kept in a small LRU cache, filled by partial
+ * reads, and by background decoding of the hunks that were advised
+ * (see CHD#advise) or that are read ahead on sequential accesses.
+ *
+ * Hunks are decoded in frozen strings, taken from a pool, so that
+ * a read up to the end of a hunk can be returned as a shared substring
+ * (copy-on-write) instead of a copy. Once shared, a string is never
+ * decoded into again: when its slot is recycled, a spare string
+ * takes its place, and the shared one is released from the pool
+ * (to be collected when no substring refers to it anymore).
+ *
+ * As strings can only be allocated with the GVL held, a spare is
+ * allocated each time a string is shared, so that there are always
+ * as many spares as shared strings in slots. A slot and its string
+ * can thus be recycled without the GVL (decoding, prefetching).
+ *
+ * Unless stated, functions must be called with the instance lock held.
+ */
+#define CHD_RB_CACHE_SLOTS  16
+#define CHD_RB_READAHEAD     4
+
+/* State of a pool entry */
+#define CHD_RB_ENTRY_EMPTY   0    /* no string                           */
+#define CHD_RB_ENTRY_SPARE   1    /* string available for a slot         */
+#define CHD_RB_ENTRY_SLOT    2    /* string of a slot                    */
+#define CHD_RB_ENTRY_SHARED  3    /* shared string of a slot (read-only) */
+#define CHD_RB_ENTRY_RETIRED 4    /* shared string no longer in a slot   */
+
+/* Allocate a hunk buffer (GVL must be held, lock must NOT be held) */
+static VALUE
+chd_rb_cache_string(struct chd_rb_data *chd)
+{
+    return rb_obj_freeze(rb_str_new(NULL, chd->cache.hunkbytes));
+}
+
+/* Allocate the cache (GVL must be held) */
+static chd_error
+chd_rb_cache_init(struct chd_rb_data *chd)
+{
+    uint32_t slots   = CHD_RB_CACHE_SLOTS;
+    uint32_t entries = 3 * slots;    /* slots + spares + retired */
+
+    chd->cache.strings    = malloc(entries * sizeof(VALUE));
+    chd->cache.state      = calloc(entries,  sizeof(uint8_t));
+    chd->cache.generation = calloc(entries,  sizeof(uint64_t));
+    chd->cache.entry      = malloc(slots * sizeof(uint32_t));
+    chd->cache.hunkidx    = malloc(slots * sizeof(int64_t));
+    chd->cache.used       = calloc(slots,  sizeof(uint64_t));
+    chd->prefetch.queue   = malloc(slots * sizeof(uint32_t));
+    if (!chd->cache.strings || !chd->cache.state || !chd->cache.generation ||
+	!chd->cache.entry   || !chd->cache.hunkidx || !chd->cache.used     ||
+	!chd->prefetch.queue)
+	return CHDERR_OUT_OF_MEMORY;
+
+    for (uint32_t i = 0 ; i < entries ; i++)
+	chd->cache.strings[i] = Qnil;
+    chd->cache.entries   = entries;
+    chd_rb_cache_register(chd);
+    chd->cache.slots     = slots;
+    chd->cache.hunkbytes = chd->header->hunkbytes;
+    chd->cache.tick      = 0;
+
+    for (uint32_t i = 0 ; i < slots ; i++) {
+	chd->cache.entry[i]   = i;
+	chd->cache.hunkidx[i] = -1;
+	chd->cache.state[i]   = CHD_RB_ENTRY_SLOT;
+	chd->cache.strings[i] = chd_rb_cache_string(chd);
+    }
+    return CHDERR_NONE;
+}
+
+/* Empty the cache, releasing the strings (GVL must be held) */
+static void
+chd_rb_cache_clear(struct chd_rb_data *chd)
+{
+    for (uint32_t i = 0 ; i < chd->cache.slots ; i++) {
+	chd->cache.hunkidx[i] = -1;
+	chd->cache.used[i]    = 0;
+    }
+    for (uint32_t i = 0 ; i < chd->cache.entries ; i++) {
+	chd->cache.strings[i]     = Qnil;
+	chd->cache.state[i]       = CHD_RB_ENTRY_EMPTY;
+	chd->cache.generation[i] += 1;
+    }
+    chd->prefetch.count = 0;
+}
+
+/* Hunk data held by a slot */
+static inline uint8_t *
+chd_rb_cache_data(struct chd_rb_data *chd, uint32_t slot)
+{
+    return (uint8_t *)RSTRING_PTR(chd->cache.strings[chd->cache.entry[slot]]);
+}
+
+/* Slot holding the hunk, or -1 */
+static int
+chd_rb_cache_lookup(struct chd_rb_data *chd, uint32_t hunkidx)
+{
+    for (uint32_t i = 0 ; i < chd->cache.slots ; i++) {
+	if (chd->cache.hunkidx[i] == hunkidx) {
+	    chd->cache.used[i] = ++chd->cache.tick;
+	    return i;
+	}
+    }
+    return -1;
+}
+
+/* Decode a hunk in the least recently used slot
+ * (replacing its string by a spare one if it is shared) */
+static chd_error
+chd_rb_cache_fill(struct chd_rb_read *rd, uint32_t hunkidx, int *slot)
+{
+    struct chd_rb_data *chd  = rd->chd;
+    uint32_t            s    = 0;
+
+    for (uint32_t i = 1 ; i < chd->cache.slots ; i++)
+	if (chd->cache.used[i] < chd->cache.used[s])
+	    s = i;
+
+    uint32_t e = chd->cache.entry[s];
+    if (chd->cache.state[e] == CHD_RB_ENTRY_SHARED) {
+	uint32_t spare = 0;
+	while ((spare < chd->cache.entries) &&
+	       (chd->cache.state[spare] != CHD_RB_ENTRY_SPARE))
+	    spare++;
+	if (spare == chd->cache.entries)
+	    return CHDERR_OUT_OF_MEMORY;
+	chd->cache.state[e]     = CHD_RB_ENTRY_RETIRED;
+	chd->cache.state[spare] = CHD_RB_ENTRY_SLOT;
+	chd->cache.entry[s]     = e = spare;
+    }
+
+    chd->cache.generation[e] += 1;
+    chd_error err = chd_rb_decode(rd, hunkidx, chd_rb_cache_data(chd, s));
+    chd->cache.hunkidx[s] = (err == CHDERR_NONE) ? (int64_t)hunkidx : -1;
+    chd->cache.used[s]    = (err == CHDERR_NONE) ? ++chd->cache.tick : 0;
+    *slot = s;
+    return err;
+}
+
+/* Retrieve a hunk from the cache (filling the cache if necessary) */
+static chd_error
+chd_rb_cache_hunk(struct chd_rb_read *rd, uint32_t hunkidx, int *slot)
+{
+    struct chd_rb_data *chd = rd->chd;
+
+    if ((*slot = chd_rb_cache_lookup(chd, hunkidx)) >= 0) {
+	chd_rb_stats_cache_hit(chd);
+	return CHDERR_NONE;
+    }
+    return chd_rb_cache_fill(rd, hunkidx, slot);
+}
+
+/* Mark the string of a pool entry as shared, and add a spare string
+ * to the pool, releasing the retired ones (GVL must be held) */
+static void
+chd_rb_cache_share(struct chd_rb_data *chd, uint32_t e, VALUE spare)
+{
+    chd->cache.state[e] = CHD_RB_ENTRY_SHARED;
+
+    for (uint32_t i = 0 ; i < chd->cache.entries ; i++) {
+	if (chd->cache.state[i] == CHD_RB_ENTRY_RETIRED) {
+	    chd->cache.strings[i]     = Qnil;
+	    chd->cache.state[i]       = CHD_RB_ENTRY_EMPTY;
+	    chd->cache.generation[i] += 1;
+	}
+    }
+    for (uint32_t i = 0 ; i < chd->cache.entries ; i++) {
+	if (chd->cache.state[i] == CHD_RB_ENTRY_EMPTY) {
+	    chd->cache.strings[i]     = spare;
+	    chd->cache.state[i]       = CHD_RB_ENTRY_SPARE;
+	    chd->cache.generation[i] += 1;
+	    return;
+	}
+    }
+    rb_bug("no free entry in the hunk cache pool");
+}
+
+/* Drop the cached hunks in the range (and the pending prefetch) */
+static void
+chd_rb_cache_drop(struct chd_rb_data *chd, uint32_t first, uint32_t last)
+{
+    for (uint32_t i = 0 ; i < chd->cache.slots ; i++) {
+	if ((chd->cache.hunkidx[i] >= first) &&
+	    (chd->cache.hunkidx[i] <= last)) {
+	    chd->cache.hunkidx[i] = -1;
+	    chd->cache.used[i]    = 0;
+	}
+    }
+
+    uint32_t count = 0;
+    for (uint32_t i = 0 ; i < chd->prefetch.count ; i++) {
+	uint32_t hunkidx = chd->prefetch.queue[
+	                       (chd->prefetch.head + i) % chd->cache.slots];
+	if ((hunkidx < first) || (hunkidx > last))
+	    chd->prefetch.queue[(chd->prefetch.head + count++) %
+				chd->cache.slots] = hunkidx;
+    }
+    chd->prefetch.count = count;
+}
+
+/* Background decoding of the queued hunks */
+static void *
+chd_rb_prefetch_thread(void *data)
+{
+    struct chd_rb_data *chd = data;
+    struct chd_rb_read  rd  = { .chd = chd, .background = 1 };
+
+    pthread_mutex_lock(&chd->lock);
+    for (;;) {
+	while (!chd->prefetch.stop && (chd->prefetch.count == 0))
+	    pthread_cond_wait(&chd->prefetch.cond, &chd->lock);
+	if (chd->prefetch.stop)
+	    break;
+
+	uint32_t hunkidx = chd->prefetch.queue[chd->prefetch.head];
+	chd->prefetch.head   = (chd->prefetch.head + 1) % chd->cache.slots;
+	chd->prefetch.count -= 1;
+
+	int slot;
+	if ((chd->flags & CHD_RB_DATA_OPENED) &&
+	    (chd_rb_cache_lookup(chd, hunkidx) < 0))
+	    chd_rb_cache_fill(&rd, hunkidx, &slot);
+    }
+    pthread_mutex_unlock(&chd->lock);
+
+    return NULL;
+}
+
+/* Queue a hunk for background decoding (if not already cached/queued) */
+static void
+chd_rb_prefetch(struct chd_rb_data *chd, uint64_t hunkidx)
+{
+    if ((hunkidx >= chd->header->totalhunks)        ||
+	(chd->prefetch.count >= chd->cache.slots)  ||
+	(chd->prefetch.stop                      ))
+	return;
+
+    // (in range: a free slot, -1, doesn't match)
+    for (uint32_t i = 0 ; i < chd->cache.slots ; i++)
+	if (chd->cache.hunkidx[i] == (int64_t)hunkidx)
+	    return;
+    for (uint32_t i = 0 ; i < chd->prefetch.count ; i++)
+	if (chd->prefetch.queue[(chd->prefetch.head + i) %
+				chd->cache.slots] == hunkidx)
+	    return;
+
+    if (! chd->prefetch.running) {
+	if (pthread_create(&chd->prefetch.thread, NULL,
+			   chd_rb_prefetch_thread, chd) != 0)
+	    return;
+	chd->prefetch.running = 1;
+    }
+
+    chd->prefetch.queue[(chd->prefetch.head + chd->prefetch.count) %
+			chd->cache.slots] = hunkidx;
+    chd->prefetch.count += 1;
+    pthread_cond_signal(&chd->prefetch.cond);
+}
+
+/* Read ahead the hunks following the last accessed one */
+static void
+chd_rb_readahead(struct chd_rb_data *chd, uint64_t hunkidx)
+{
+    for (uint32_t i = 1 ; i <= chd->prefetch.readahead ; i++)
+	chd_rb_prefetch(chd, hunkidx + i);
+}
+
+/* Stop the background decoding (instance lock must NOT be held) */
+static void
+chd_rb_prefetch_stop(struct chd_rb_data *chd)
+{
+    pthread_mutex_lock(&chd->lock);
+    int running = chd->prefetch.running;
+    chd->prefetch.stop    = 1;
+    chd->prefetch.running = 0;
+    chd->prefetch.count   = 0;
+    pthread_cond_signal(&chd->prefetch.cond);
+    pthread_mutex_unlock(&chd->lock);
+
+    if (running)
+	pthread_join(chd->prefetch.thread, NULL);
+}
+
+static void *
+chd_rb_prefetch_stop_nogvl(void *data)
+{
+    chd_rb_prefetch_stop(data);
+    return NULL;
+}
+
+static void *
+chd_rb_read_hunk_nogvl(void *data)
+{
+    struct chd_rb_read *rd  = data;
+    struct chd_rb_data *chd = rd->chd;
+    
+    rd->err = CHDERR_NONE;
+
+    pthread_mutex_lock(&chd->lock);
+    if (chd_rb_read_opened(rd)) {
+	int slot = chd_rb_cache_lookup(chd, rd->offset);
+	if (slot >= 0) {
+	    memcpy(rd->buffer, chd_rb_cache_data(chd, slot), rd->hunkbytes);
+	    chd_rb_stats_cache_hit(chd);
+	} else {
+	    rd->err = chd_rb_decode(rd, rd->offset, rd->buffer);
+	}
+	chd_rb_readahead(chd, rd->offset);
+    }
+    pthread_mutex_unlock(&chd->lock);
+    
+    return NULL;
+}
+
+static void *
+chd_rb_read_shared_nogvl(void *data)
+{
+    struct chd_rb_read *rd  = data;
+    struct chd_rb_data *chd = rd->chd;
+    int                 slot;
+
+    rd->err = CHDERR_NONE;
+
+    pthread_mutex_lock(&chd->lock);
+    if (chd_rb_read_opened(rd)) {
+	rd->err = chd_rb_cache_hunk(rd, rd->offset, &slot);
+	if (rd->err == CHDERR_NONE) {
+	    rd->entry      = chd->cache.entry[slot];
+	    rd->generation = chd->cache.generation[rd->entry];
+	    chd_rb_readahead(chd, rd->offset);
+	}
+    }
+    pthread_mutex_unlock(&chd->lock);
+
+    return NULL;
+}
+
+static void *
+chd_rb_read_units_nogvl(void *data)
+{
+    struct chd_rb_read *rd         = data;
+    struct chd_rb_data *chd        = rd->chd;
+    const uint32_t      unitbytes  = rd->unitbytes;
+    const uint32_t      unitlast   = rd->units_per_hunk - 1;
+    const int           wholeunit  = (rd->slice_offset == 0) &&
+	                             (rd->slice_length == unitbytes);
+    const uint64_t      unitend    = rd->offset + rd->size;
+          char         *buffer     = rd->buffer;
+
+    rd->err = CHDERR_NONE;
+    
+    pthread_mutex_lock(&chd->lock);
+    if (! chd_rb_read_opened(rd)) {
+	pthread_mutex_unlock(&chd->lock);
+	return NULL;
+    }
+    for (uint64_t unitidx = rd->offset ; unitidx < unitend ; ) {
+	uint32_t hunkidx = unitidx / rd->units_per_hunk;
+	uint32_t first   = unitidx % rd->units_per_hunk;
+	uint32_t last    = (unitend - unitidx > unitlast - first)
+	                 ? unitlast : (first + (unitend - unitidx) - 1);
+	
+	// if it's a full block, just read directly from disk
+	// (unless it's a cached hunk)
+	int slot = -1;
+	if (wholeunit                         &&
+	    (first   == 0                   ) &&
+	    (last    == unitlast            ) &&
+	    ((slot = chd_rb_cache_lookup(chd, hunkidx)) < 0)) {
+	    rd->err = chd_rb_decode(rd, hunkidx, buffer);
+	    if (rd->err != CHDERR_NONE)
+		break;
+	    buffer += rd->hunkbytes;
+	}
+	// otherwise, gather slices from the cache
+	// (and fill the cache if necessary)
+	else {
+	    if (slot >= 0) {
+		chd_rb_stats_cache_hit(chd);
+	    } else {
+		rd->err = chd_rb_cache_hunk(rd, hunkidx, &slot);
+		if (rd->err != CHDERR_NONE)
+		    break;
+	    }
+	    const uint8_t *src = chd_rb_cache_data(chd, slot) +
+		                 first * unitbytes;
+	    for (uint32_t i = first ; i <= last ; i++) {
+		memcpy(buffer, src + rd->slice_offset, rd->slice_length);
+		buffer += rd->slice_length;
+		if (rd->slice_tail > 0) {
+		    memcpy(buffer, src + unitbytes - rd->slice_tail,
+			   rd->slice_tail);
+		    buffer += rd->slice_tail;
+		}
+		src    += unitbytes;
+	    }
+	}
+
+	unitidx += last - first + 1;
+    }
+    if ((rd->err == CHDERR_NONE) && (rd->size > 0))
+	chd_rb_readahead(chd, (unitend - 1) / rd->units_per_hunk);
+    pthread_mutex_unlock(&chd->lock);
+
+    // swap 16-bit words (CD audio is stored big-endian),
+    // leaving the tails untouched
+    if (rd->swap && (rd->err == CHDERR_NONE)) {
+	const uint32_t stride = rd->slice_length + rd->slice_tail;
+	for (char *u = rd->buffer ; u < buffer ; u += stride) {
+	    for (char *p = u ; p + 1 < u + rd->slice_length ; p += 2) {
+		char c = p[0]; p[0] = p[1]; p[1] = c;
+	    }
+	}
+    }
+    
+    return NULL;
+}
+
+static void *
+chd_rb_read_bytes_nogvl(void *data)
+{
+    struct chd_rb_read *rd            = data;
+    struct chd_rb_data *chd           = rd->chd;
+    const uint32_t      hunkbytes     = rd->hunkbytes;
+    const uint64_t      hunkidx_first = rd->offset                / hunkbytes;
+    const uint64_t      hunkidx_last  = (rd->offset + rd->size - 1) / hunkbytes;
+          char         *buffer        = rd->buffer;
+
+    rd->err = CHDERR_NONE;
+    if (rd->size == 0)
+	return NULL;
+    
+    pthread_mutex_lock(&chd->lock);
+    if (! chd_rb_read_opened(rd)) {
+	pthread_mutex_unlock(&chd->lock);
+	return NULL;
+    }
+    for (uint64_t hunkidx = hunkidx_first; hunkidx <= hunkidx_last; hunkidx++) {
+	uint32_t startoffs = (hunkidx == hunkidx_first)
+	                   ? (rd->offset % hunkbytes)
+	                   : 0;
+	uint32_t endoffs   = (hunkidx == hunkidx_last)
+	                   ? ((rd->offset + rd->size - 1) % hunkbytes)
+	                   : (hunkbytes - 1);
+	size_t   chunksize = endoffs + 1 - startoffs;
+	
+	// if it's a full block, just read directly from disk
+	// (unless it's a cached hunk)
+	int slot = -1;
+	if ((startoffs == 0                   ) &&
+	    (endoffs   == (hunkbytes - 1)     ) &&
+	    ((slot = chd_rb_cache_lookup(chd, hunkidx)) < 0)) {
+	    rd->err = chd_rb_decode(rd, hunkidx, buffer);
+	}
+	// otherwise, read from the cache
+	// (and fill the cache if necessary)
+	else {
+	    if (slot >= 0) {
+		chd_rb_stats_cache_hit(chd);
+	    } else {
+		rd->err = chd_rb_cache_hunk(rd, hunkidx, &slot);
+	    }
+	    if (rd->err == CHDERR_NONE)
+		memcpy(buffer, chd_rb_cache_data(chd, slot) + startoffs,
+		       chunksize);
+	}
+	if (rd->err != CHDERR_NONE)
+	    break;
+	
+	buffer += chunksize;
+    }
+    if (rd->err == CHDERR_NONE)
+	chd_rb_readahead(chd, hunkidx_last);
+    pthread_mutex_unlock(&chd->lock);
+
+    return NULL;
+}
+
+static void *
+chd_rb_read_raw_nogvl(void *data)
+{
+    struct chd_rb_read *rd     = data;
+    struct chd_rb_data *chd    = rd->chd;
+    char               *buffer = rd->buffer;
+    uint64_t            offset = rd->offset;
+    uint64_t            size   = rd->size;
+
+    rd->err = CHDERR_NONE;
+    
+    pthread_mutex_lock(&chd->lock);
+    while (chd_rb_read_opened(rd) && (size > 0)) {
+	ssize_t n = pread(chd->fd, buffer, size, offset);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0) {
+	    rd->err = CHDERR_READ_ERROR;
+	    break;
+	}
+	buffer += n;
+	offset += n;
+	size   -= n;
+    }
+    pthread_mutex_unlock(&chd->lock);
+
+    return NULL;
+}
+
+/* Initiate the reading of a file extent into the page cache
+ * (the decoding will then find it there) */
+static void *
+chd_rb_readahead_nogvl(void *data)
+{
+    struct chd_rb_read *rd  = data;
+    struct chd_rb_data *chd = rd->chd;
+
+    rd->err = CHDERR_NONE;
+#ifdef POSIX_FADV_WILLNEED
+    pthread_mutex_lock(&chd->lock);
+    if (chd_rb_read_opened(rd))
+	posix_fadvise(chd->fd, rd->offset, rd->size, POSIX_FADV_WILLNEED);
+    pthread_mutex_unlock(&chd->lock);
+#endif
+    return NULL;
+}
+
+static VALUE
+chd_rb_read_dispatch_events(VALUE data)
+{
+    struct chd_rb_read *rd        = (struct chd_rb_read *)data;
+    VALUE               on_decode = rd->chd->value.on_decode;
+
+    for (size_t i = 0 ; (i < rd->events_count) && ! NIL_P(on_decode) ; i++) {
+	struct chd_rb_decode_event *event = &rd->events[i];
+	rb_funcall(on_decode, id_call, 4,
+		   UINT2NUM(event->hunkidx),
+		   rb_str_new_cstr(chd_rb_stats_slot_names[event->slot]),
+		   ULL2NUM(event->ns),
+		   UINT2NUM(event->bytes_read));
+    }
+    return Qnil;
+}
+
+static VALUE
+chd_rb_read_free_events(VALUE data)
+{
+    struct chd_rb_read *rd = (struct chd_rb_read *)data;
+    free(rd->events);
+    rd->events       = NULL;
+    rd->events_count = rd->events_size = 0;
+    return Qnil;
+}
+
+/* Report decode events (if any) and raise on error, once the GVL
+ * has been reacquired */
+static void
+chd_rb_read_finish(struct chd_rb_read *rd)
+{
+    if (rd->events) {
+	rb_ensure(chd_rb_read_dispatch_events, (VALUE)rd,
+		  chd_rb_read_free_events,     (VALUE)rd);
+    }
+    if (rd->closed) {
+	rb_raise(eCHDError, "closed");
+    }
+    chd_rb_raise_if_error(rd->err);
+}
+
+static void
+chd_rb_read_without_gvl(void *(*func)(void *), struct chd_rb_read *rd)
+{
+    rb_thread_call_without_gvl(func, rd, NULL, NULL);
+    chd_rb_read_finish(rd);
+}
+
+/* String of the pool entry filled by chd_rb_read_shared_nogvl,
+ * marked as shared; or nil if it has been decoded into since */
+static VALUE
+chd_rb_cache_export(struct chd_rb_data *chd, struct chd_rb_read *rd)
+{
+    VALUE spare = Qnil;
+    VALUE hunk  = Qnil;
+
+    chd_rb_lock(chd);
+    if ((chd->cache.generation[rd->entry] == rd->generation) &&
+	(chd->cache.state[rd->entry] == CHD_RB_ENTRY_SLOT)) {
+	pthread_mutex_unlock(&chd->lock);
+	spare = chd_rb_cache_string(chd);
+	chd_rb_lock(chd);
+    }
+    if (chd->cache.generation[rd->entry] == rd->generation) {
+	if (chd->cache.state[rd->entry] == CHD_RB_ENTRY_SLOT)
+	    chd_rb_cache_share(chd, rd->entry, spare);
+	hunk = chd->cache.strings[rd->entry];
+    }
+    pthread_mutex_unlock(&chd->lock);
+
+    return hunk;
+}
+
+/*
+ * Read inside a hunk, returned as a substring of the cached hunk
+ * (sharing its buffer, without copy).
+ *
+ * Ruby only shares the buffer of a substring extending to the end
+ * of the string (as it must be null-terminated), other substrings
+ * being copies: for them, the data is directly copied from the cache
+ * instead, as sharing the hunk would only cost a spare string, and
+ * its retirement once recycled.
+ */
+static VALUE
+chd_rb_read_shared(struct chd_rb_data *chd, uint32_t hunkidx,
+		   uint32_t offset, uint32_t length)
+{
+    VALUE hunk;
+
+    if (offset + length < chd->header->hunkbytes) {
+	VALUE strdata = rb_str_buf_new(length);
+	struct chd_rb_read rd = {
+	    .chd       = chd,
+	    .buffer    = RSTRING_PTR(strdata),
+	    .offset    = (uint64_t)hunkidx * chd->header->hunkbytes + offset,
+	    .size      = length,
+	    .hunkbytes = chd->header->hunkbytes,
+	};
+	chd_rb_read_without_gvl(chd_rb_read_bytes_nogvl, &rd);
+	rb_str_set_len(strdata, length);
+	return strdata;
+    }
+
+    do {
+	chd_rb_ensure_opened(chd);
+	struct chd_rb_read rd = {
+	    .chd       = chd,
+	    .offset    = hunkidx,
+	    .hunkbytes = chd->header->hunkbytes,
+	};
+	chd_rb_read_without_gvl(chd_rb_read_shared_nogvl, &rd);
+	hunk = chd_rb_cache_export(chd, &rd);
+    } while (NIL_P(hunk));
+
+    return rb_str_subseq(hunk, offset, length);
+}
+
+
+/**
+ * (see CHD#initialize)
+ */
+static VALUE
+chd_s_new(int argc, VALUE *argv, VALUE klass)
+{
+    return rb_class_new_instance_kw(argc, argv, klass, RB_PASS_CALLED_KEYWORDS);
+}
+
+
+/**
+ * Open a CHD file.
+ *
+ * With no associated block {CHD.open} is synonym for {CHD.new}.
+ * If the optional code block is given, it will be passed the opened CHD file
+ * as an argument and the CHD object will automatically be closed when
+ * the block terminates. The value of the block will be returned.
+ *
+ * @note Only the read-only mode ({RDONLY}) is currently supported.
+ *
+ * @overload open(file, mode=RDONLY, parent: nil)
+ *   @param file   [String, IO] path-string or open IO on the CHD file
+ *   @param mode   [Integer]    opening mode ({RDONLY} or {RDWR})
+ *   @param parent [String, IO] path-string or open IO on the CHD parent file.
+ * 
+ * @yield [chd] the opened CHD file
+ *
+ * @example
+ *   CHD.open('file.chd') do |chd|
+ *     puts chd.metadata
+ *   end
+ */
+static VALUE
+chd_s_open(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE chd;
+
+    chd = rb_class_new_instance_kw(argc, argv, klass, RB_PASS_CALLED_KEYWORDS);
+
+    if (rb_block_given_p()) {
+        return rb_ensure(rb_yield, chd, chd_m_close, chd);
+    }
+
+    return chd;
+}
+
+
+/**
+ * Retrieve the header from a CHD file.
+ *
+ * For a detailed description of the header, see {#header}.
+ * 
+ * @param filename [String] path to CHD file
+ *
+ * @return [Hash{Symbol => Object}]
+ */
+static VALUE
+chd_s_header(VALUE klass, VALUE filename)
+{
+    chd_header header;
+    chd_error  err;
+
+    err = chd_read_header(StringValueCStr(filename), &header);
+    chd_rb_raise_if_error(err);    
+
+    return chd_rb_header(&header);
+}
+
+
+/* Release the libchdr handle (if loaded), file descriptor, and path */
+static void
+chd_rb_unload(struct chd_rb_data *chd)
+{
+    if (chd->file)
+	chd_close(chd->file);
+    if (chd->fd >= 0)
+	close(chd->fd);
+    free(chd->path);
+    chd->file            = NULL;
+    chd->fd              = -1;
+    chd->path            = NULL;
+    chd->precached_bytes = 0;
+}
+
+/*
+ * Release the libchdr handle and the parent of a closed (or freed)
+ * instance.
+ *
+ * Children decode through the handle of their parent (libchdr reads
+ * the parent hunks with it), so the parent of opened instances keeps
+ * its handle when closed: it is released along with the last child.
+ * Must be called with the GVL held (children count), and the instance
+ * lock held or the instance no longer used.
+ */
+static void
+chd_rb_release(struct chd_rb_data *chd)
+{
+    while (chd->children == 0) {
+	struct chd_rb_data *parent = chd->parent;
+
+	chd_rb_unload(chd);
+	chd->parent = NULL;
+	if (chd->flags & CHD_RB_DATA_FREED)
+	    chd_rb_data_destroy(chd);
+
+	// Parent no longer used, and already closed: release it too
+	if ((parent == NULL) || (--parent->children > 0) ||
+	    (parent->flags & CHD_RB_DATA_OPENED))
+	    break;
+	chd = parent;
+    }
+}
+
+/*
+ * Check that the parent matches the digests recorded in the header
+ * (as libchdr does when opening, a null digest is not checked).
+ */
+static chd_error
+chd_rb_check_parent(const chd_header *header, struct chd_rb_data *parent)
+{
+    static const uint8_t nullmd5[CHD_MD5_BYTES]   = { 0 };
+    static const uint8_t nullsha1[CHD_SHA1_BYTES] = { 0 };
+
+    if (parent == NULL)
+	return (header->flags & CHDFLAGS_HAS_PARENT) ? CHDERR_REQUIRES_PARENT
+	                                             : CHDERR_NONE;
+
+    if (memcmp(nullmd5, header->parentmd5,      sizeof(nullmd5)) &&
+	memcmp(nullmd5, parent->header->md5,    sizeof(nullmd5)) &&
+	memcmp(parent->header->md5, header->parentmd5, sizeof(nullmd5)))
+	return CHDERR_INVALID_PARENT;
+    if (memcmp(nullsha1, header->parentsha1,    sizeof(nullsha1)) &&
+	memcmp(nullsha1, parent->header->sha1,  sizeof(nullsha1)) &&
+	memcmp(parent->header->sha1, header->parentsha1, sizeof(nullsha1)))
+	return CHDERR_INVALID_PARENT;
+
+    return CHDERR_NONE;
+}
+
+/*
+ * Open the CHD file and set up the instance (header, hunk cache).
+ *
+ * When opened from a path, only the header is read: the libchdr
+ * handle (decompression contexts, hunk map) is created on the first
+ * hunk decoding (see chd_rb_load), so that instances used only for
+ * their header or metadata are cheap. When opened from an IO,
+ * libchdr reads from the stdio stream which can't be reopened later,
+ * so the handle is created immediately, as it is for CHD prior to
+ * version 5 whose unit size is only known once opened.
+ *
+ * The file and parent are kept referenced, the later as libchdr
+ * will access it when reading hunks, the former to allow opening
+ * another independent access to the same file (see #initialize_copy).
+ */
+static void
+chd_rb_open(struct chd_rb_data *chd, VALUE file, int mode, VALUE parent)
+{
     // If given retrieve parent chd file
-    chd_file *parent = NULL;
-    if ((kwargs[0] != Qundef) && (kwargs[0] != Qnil)) {
-	if (! RTEST(rb_obj_is_kind_of(kwargs[0], cCHD))) {
+    struct chd_rb_data *chd_parent = NULL;
+    if (! NIL_P(parent)) {
+	if (! RTEST(rb_obj_is_kind_of(parent, cCHD))) {
 	    rb_raise(rb_eArgError, "parent must be a kind of %"PRIsVALUE,
 		     rb_obj_as_string(cCHD));
 	}
-	struct chd_rb_data *chd_parent;
-	chd_rb_get_typeddata(chd_parent, self);
-	parent = chd_parent->file;
+	chd_rb_get_typeddata(chd_parent, parent);
+	chd_rb_ensure_initialized(chd_parent);
+	chd_rb_ensure_opened(chd_parent);
+    }
+
+    // Open CHD
+    // (and keep a file descriptor for raw access to the file)
+    chd_error err = CHDERR_NONE;
+    if (RTEST(rb_obj_is_kind_of(file, rb_cIO))) {
+        rb_io_t *fptr;
+        GetOpenFile(file, fptr);
+	FILE *stdio = rb_io_stdio_file(fptr);
+
+	if (chd_parent)
+	    chd_rb_ensure_loaded(chd_parent);
+	err = chd_open_file(stdio, mode,
+			    chd_parent ? chd_parent->file : NULL, &chd->file);
+	if (err == CHDERR_NONE) {
+	    chd->header_data = *chd_get_header(chd->file);
+	    chd->fd = fcntl(fileno(stdio), F_DUPFD_CLOEXEC, 0);
+	}
+    } else {
+	file = rb_str_new_frozen(file);
+	err  = chd_read_header(StringValueCStr(file), &chd->header_data);
+	if (err == CHDERR_NONE)
+	    err = chd_rb_check_parent(&chd->header_data, chd_parent);
+	if ((err == CHDERR_NONE) && (chd->header_data.version < 5)) {
+	    // Before version 5, the unit size is not stored in the header:
+	    // libchdr guesses it from the metadata when opening the file
+	    // (a header-only read can't), so don't defer the handle
+	    if (chd_parent)
+		chd_rb_ensure_loaded(chd_parent);
+	    err = chd_open(RSTRING_PTR(file), mode,
+			   chd_parent ? chd_parent->file : NULL, &chd->file);
+	    if (err == CHDERR_NONE)
+		chd->header_data = *chd_get_header(chd->file);
+	}
+	if (err == CHDERR_NONE) {
+	    chd->fd = open(RSTRING_PTR(file), O_RDONLY | O_CLOEXEC);
+	    if ((chd->fd >= 0) &&
+		((chd->path = strdup(RSTRING_PTR(file))) == NULL)) {
+		close(chd->fd);
+		chd->fd = -1;
+		errno   = ENOMEM;
+	    }
+	}
+    }
+    chd_rb_raise_if_error(err);    
+    if (chd->fd < 0) {
+	int e = errno;
+	chd_rb_unload(chd);
+	rb_syserr_fail(e, "unable to access CHD file");
+    }
+
+    // Retrieve header and hunkbytes
+    chd->header         = &chd->header_data;
+    chd->parent         = chd_parent;
+    chd->mode           = mode;
+    chd->units_per_hunk = chd->header->hunkbytes / chd->header->unitbytes;
+    if (chd->header->hunkbytes % chd->header->unitbytes) {
+	chd_rb_unload(chd);
+	rb_raise(eCHDDataError, "CHD hunk is not a multiple of unit");
+    }
+
+    // Allocate cache
+    if (chd_rb_cache_init(chd) != CHDERR_NONE) {
+	chd_rb_unload(chd);
+	rb_raise(rb_eNoMemError, "out of memory (hunk cache)");
+    }
+
+    // Use the default shared cache, if suitable
+    struct chd_rb_shm *shm = chd_rb_shm_get(chd_rb_default_shared_cache);
+    if (shm && (shm->slot_bytes >= chd->header->hunkbytes)) {
+	chd_rb_shm_attach(chd, shm);
+	if (chd->shm)
+	    chd->value.shared_cache = chd_rb_default_shared_cache;
+    }
+
+    // Keep track of how it was opened
+    // (the parent is pinned, see chd_rb_release)
+    chd->value.file   = file;
+    chd->value.parent = parent;
+    if (chd_parent)
+	chd_parent->children++;
+    
+    // Mark as initialized and opened
+    chd->flags = CHD_RB_DATA_INITIALIZED | CHD_RB_DATA_OPENED;
+}
+
+
+/**
+ * Create a new access to a CHD file.
+ *
+ * When opened from a path-string, only the header is read and the
+ * parent checked: the decompression contexts and the hunk map are
+ * set up when the first hunk is decoded (header and metadata
+ * don't require them). So opening many CHD files, or duplicating
+ * an access (see {#initialize_copy}), is cheap. CHD prior to
+ * version 5 are fully opened, as their unit size is guessed
+ * from the metadata.
+ *
+ * @note Only the read-only mode ({RDONLY}) is currently supported.
+ *
+ * @overload initialize(file, mode=RDONLY, parent: nil)
+ *   @param file   [String, IO] path-string or open IO on the CHD file
+ *   @param mode   [Integer]    opening mode ({RDONLY} or {RDWR})
+ *   @param parent [CHD]        the opened CHD parent file.
+ *
+ * @return [CHD]
+ */
+static VALUE
+chd_m_initialize(int argc, VALUE *argv, VALUE self)
+{
+    VALUE file, mode, opts;
+    ID    kwargs_id[1] = { id_parent };
+    VALUE kwargs   [1];
+    
+    // Retrieve typed data
+    struct chd_rb_data *chd;
+    chd_rb_get_typeddata(chd, self);
+
+    // Sanity check
+    if (chd->flags & CHD_RB_DATA_INITIALIZED) {
+	rb_warn("%"PRIsVALUE" refusing to initialize same instance twice",
+		rb_obj_as_string(cCHD));
+	return Qnil;
+    }
+
+    // Retrieve arguments
+    rb_scan_args_kw(RB_SCAN_ARGS_LAST_HASH_KEYWORDS, argc, argv, "11:",
+		    &file, &mode, &opts);
+    rb_get_kwargs(opts, kwargs_id, 0, 1, kwargs);
+
+    // If mode not specified, default to read-only
+    if (NIL_P(mode)) {
+	mode = INT2FIX(CHD_OPEN_READ);
+    }
+
+    // Open
+    chd_rb_open(chd, file, FIX2INT(mode),
+		(kwargs[0] == Qundef) ? Qnil : kwargs[0]);
+    
+    return Qnil;
+}
+
+
+/**
+ * Open another independent access to the same CHD file.
+ *
+ * The new instance has its own libchdr handle and hunk cache,
+ * so that it can be used concurrently (from another thread)
+ * with the original one. If a parent was given, it is duplicated too.
+ *
+ * @note Only CHD opened from a path-string can be duplicated.
+ *
+ * @raise [NotSupportedError] if the CHD was opened from an IO
+ *
+ * @return [self]
+ */
+static VALUE
+chd_m_initialize_copy(VALUE self, VALUE orig) {
+    // Retrieve typed data
+    struct chd_rb_data *chd, *chd_orig;
+    chd_rb_get_typeddata(chd,      self);
+    chd_rb_get_typeddata(chd_orig, orig);
+    chd_rb_ensure_initialized(chd_orig);
+    chd_rb_ensure_opened(chd_orig);
+
+    if (! RB_TYPE_P(chd_orig->value.file, T_STRING)) {
+	rb_raise(eCHDNotSupportedError,
+		 "only CHD opened from a path can be duplicated");
+    }
+
+    VALUE parent = chd_orig->value.parent;
+    if (! NIL_P(parent)) {
+	parent = rb_obj_dup(parent);
+    }
+    
+    chd_rb_open(chd, chd_orig->value.file, chd_orig->mode, parent);
+    chd_rb_shm_attach(chd, chd_orig->shm);
+    RB_OBJ_WRITE(self, &chd->value.shared_cache, chd_orig->value.shared_cache);
+
+    return self;
+}
+
+
+/**
+ * Pre-cache the whole CHD in memory.
+ *
+ * @note
+ *  * It is not necessary to enable pre-cache just to improved
+ *    consecutive partial-read as the current hunk is always cached.
+ *  * Once enabled, there is no way to remove the cache.
+ *
+ * @return [self]
+ */
+static VALUE
+chd_m_precache(VALUE self) {
+    // Retrieve typed data
+    struct chd_rb_data *chd;
+    chd_rb_get_typeddata(chd, self);
+    chd_rb_ensure_initialized(chd);
+    chd_rb_ensure_opened(chd);
+
+    chd_rb_ensure_loaded(chd);
+    chd_error err = chd_precache(chd->file);
+    chd_rb_raise_if_error(err);
+    chd->flags |= CHD_RB_DATA_PRECACHED;
+
+    // (libchdr holds a copy of the whole file)
+    struct stat st;
+    if (fstat(chd->fd, &st) == 0)
+	chd->precached_bytes = st.st_size;
+
+    return self;
+}
+
+
+/**
+ * Has the CHD been pre-cached?
+ */
+static VALUE
+chd_m_precached_p(VALUE self) {
+    // Retrieve typed data
+    struct chd_rb_data *chd;
+    chd_rb_get_typeddata(chd, self);
+    chd_rb_ensure_initialized(chd);
+    chd_rb_ensure_opened(chd);
+
+    return (chd->flags & CHD_RB_DATA_PRECACHED) ? Qtrue : Qfalse;
+}
+
+
+/**
+ * Return the CHD header. 
+ * 
+ * The header contains information about:
+ *  * version
+ *  *  compression used
+ *  *  digest (sha1 or md5) for the file and the parent 
+ *  * hunk and unit (size and count)
+ *
+ * @return [Hash{Symbol => Object}]
+ */
+static VALUE
+chd_m_header(VALUE self) {
+    // Retrieve typed data
+    struct chd_rb_data *chd;
+    chd_rb_get_typeddata(chd, self);
+    chd_rb_ensure_initialized(chd);
+    chd_rb_ensure_opened(chd);
+    
+    if (NIL_P(chd->value.header)) {
+	chd->value.header = rb_obj_freeze(chd_rb_header(chd->header));
+    }
+
+    return chd->value.header;
+}
+
+
+/*
+ * Lookup metadata, reading the metadata entries directly from the file
+ * (as libchdr does), so that the libchdr handle doesn't need to
+ * be loaded. Entries are chained from the header metadata offset:
+ *   tag(4), flags(1), length(3), next(8), data(length)
+ *
+ * Before version 3, metadata is synthesized by libchdr from the header.
+ */
+static chd_error
+chd_rb_get_metadata(struct chd_rb_data *chd,
+		    uint32_t searchtag, uint32_t searchindex,
+		    void *output, uint32_t outputlen, uint32_t *resultlen,
+		    uint32_t *resulttag, uint8_t *resultflags)
+{
+    if (chd->header->version < 3) {
+	chd_rb_ensure_loaded(chd);
+	return chd_get_metadata(chd->file, searchtag, searchindex,
+				output, outputlen,
+				resultlen, resulttag, resultflags);
+    }
+
+    // (bounded, to not loop on a corrupted chain)
+    uint64_t offset = chd->header->metaoffset;
+    for (int count = 0 ; (offset != 0) && (count < 65536) ; count++) {
+	uint8_t raw[16];
+	if (pread(chd->fd, raw, sizeof(raw), offset) != sizeof(raw))
+	    return CHDERR_READ_ERROR;
+
+	uint32_t tag    = ((uint32_t)raw[0] << 24) | (raw[1] << 16) |
+	                  (raw[2] << 8) | raw[3];
+	uint32_t length = ((uint32_t)raw[5] << 16) | (raw[6] << 8) | raw[7];
+	uint64_t next   = 0;
+	for (int i = 8 ; i < 16 ; i++)
+	    next = (next << 8) | raw[i];
+
+	if (((searchtag == CHDMETATAG_WILDCARD) || (searchtag == tag)) &&
+	    (searchindex-- == 0)) {
+	    uint32_t size = (length < outputlen) ? length : outputlen;
+	    if (pread(chd->fd, output, size, offset + sizeof(raw)) != (ssize_t)size)
+		return CHDERR_READ_ERROR;
+	    *resultlen   = length;
+	    *resulttag   = tag;
+	    *resultflags = raw[4];
+	    return CHDERR_NONE;
+	}
+	offset = next;
+    }
+
+    return CHDERR_METADATA_NOT_FOUND;
+}
+
+
+/**
+ * Retrieve a single metadata.
+ *
+ * If specified the metadata tag is a 4-character symbol, some commonly used
+ * are `:GDDD`, `:IDNT`, `:'KEY '`, `:'CIS '`, `:CHTR`, `:CHT2`, `:CHGD`,
+ * `:AVAV`, `:AVLD`. Note the use of single-quote to include a white-space
+ * in some of the tag.
+ *
+ * Text metadata are terminated by a null-char, which is removed,
+ * unless the raw data is requested (such as to copy it).
+ *
+ * @overload get_metadata(index=0, tag=nil, raw: false)
+ *   @param index [Integer]      index from which to lookup for metadata
+ *   @param tag   [Symbol, nil]  tag of the metadata to lookup
+ *                               (using nil as a wildcard)
+ *   @param raw   [Boolean]      data as stored in the file
+ *
+ * @return [Array(String, Integer, Symbol)]
+ * @return [nil] if do metadata found
+ */
+static VALUE
+chd_m_get_metadata(int argc, VALUE *argv, VALUE self)
+{
+    VALUE tag, index, opts;
+    ID    kwargs_id[1] = { id_raw };
+    VALUE kwargs   [1];
+
+    // Retrieve arguments
+    rb_scan_args_kw(RB_SCAN_ARGS_LAST_HASH_KEYWORDS, argc, argv, "02:",
+		    &index, &tag, &opts);
+    rb_get_kwargs(opts, kwargs_id, 0, 1, kwargs);
+    const int raw = (kwargs[0] != Qundef) && RTEST(kwargs[0]);
+
+    if (! NIL_P(index)) {
+	rb_check_type(index, T_FIXNUM);	
+    }
+    
+    if (! NIL_P(tag)) {
+	rb_check_type(tag, T_SYMBOL);
+	tag = rb_sym2str(tag);
+	if (RSTRING_LEN(tag) != 4) {
+	    rb_raise(rb_eArgError, "tag must be a 4-char symbol");
+	}
+    }
+
+    // Retrieve typed data
+    struct chd_rb_data *chd;
+    chd_rb_get_typeddata(chd, self);
+    chd_rb_ensure_initialized(chd);
+    chd_rb_ensure_opened(chd);
+
+    // Perform query
+    char     buffer[CHD_METATADATA_BUFFER_MAXSIZE] = { 0 };
+    uint32_t buflen                                = sizeof(buffer);
+    uint32_t resultlen                             = 0;
+    uint32_t resulttag                             = 0;
+    uint8_t  resultflags                           = 0;    
+    uint32_t searchindex                           = 0;
+    uint32_t searchtag                             = CHDMETATAG_WILDCARD;
+
+    if (! NIL_P(index)) {
+	searchindex = FIX2INT(index);
+    }
+
+    if (! NIL_P(tag)) {
+	char *tag_str       = RSTRING_PTR(tag);
+	char *searchtag_str = (char *)&searchtag;
+	searchtag_str[0] = tag_str[3];
+	searchtag_str[1] = tag_str[2];
+	searchtag_str[2] = tag_str[1];
+	searchtag_str[3] = tag_str[0];
+    }
+    
+    chd_error err;
+    err = chd_rb_get_metadata(chd,
+			      searchtag, searchindex,
+			      buffer, buflen,
+			      &resultlen, &resulttag, &resultflags);
+
+    // return nil on not found, otherwise raise exception
+    if (err == CHDERR_METADATA_NOT_FOUND)
+	return Qnil;
+    chd_rb_raise_if_error(err);    
+
+    // Larger than the buffer (binary metadata): read it again whole
+    VALUE data;
+    if (resultlen <= buflen) {
+	data = rb_str_new(buffer, resultlen);
+    } else {
+	data = rb_str_new(NULL, resultlen);
+	err  = chd_rb_get_metadata(chd,
+				   searchtag, searchindex,
+				   RSTRING_PTR(data), resultlen,
+				   &resultlen, &resulttag, &resultflags);
+	chd_rb_raise_if_error(err);
+    }
+
+    // Assume it's ascii 8-bit text encoded, remove last null-char
+    const char *ptr = RSTRING_PTR(data);
+    if (! raw && (resultlen > 0) &&
+	(memchr(ptr, '\0', resultlen) == &ptr[resultlen-1])) {
+	rb_str_set_len(data, resultlen - 1);
+    }
+
+    // Returns result
+    char str[sizeof(uint32_t)];
+    rb_integer_pack(ULONG2NUM(resulttag), str, 1, sizeof(uint32_t), 0,
+		    INTEGER_PACK_BIG_ENDIAN);
+
+    VALUE res[] = { data,
+	            INT2FIX(resultflags),
+		    rb_to_symbol(rb_str_new(str, sizeof(str)))
+                  };
+    
+    return rb_ary_new_from_values(ARRAY_SIZE(res), res);
+}
+
+
+/**
+ * Retrieve all the metadata.
+ *
+ * @overload metadata(raw: false)
+ *   @param raw [Boolean] data as stored in the file
+ *                        (see {#get_metadata})
+ *
+ * @return [Array<Array(String, Integer, Symbol)>]
+ */
+static VALUE
+chd_m_metadata(int argc, VALUE *argv, VALUE self) {
+    VALUE list = rb_ary_new();
+    VALUE opts;
+
+    rb_scan_args_kw(RB_SCAN_ARGS_LAST_HASH_KEYWORDS, argc, argv, "0:",
+		    &opts);
+
+    for (int i = 0 ; ; i++) {
+	VALUE args[] = { INT2FIX(i), Qnil, opts };
+	VALUE md     = chd_m_get_metadata(NIL_P(opts) ? 1 : 3, args, self);
+	if (NIL_P(md))
+	    break;
+	rb_ary_push(list, md);
+    }
+    return list;
+}
+
+
+/**
+ * Read a CHD hunk.
+ *
+ * A hunk found in the cache is returned as a string sharing
+ * the cache buffer (copy-on-write).
+ *
+ * @param idx [Integer] hunk index (start at 0)
+ *
+ * @raise [RangeError] if the requested hunk doesn't exists
+ *
+ * @return [String]
+ */
+static VALUE
+chd_m_read_hunk(VALUE self, VALUE idx) {
+    // Retrieve typed data
+    struct chd_rb_data *chd;
+    chd_rb_get_typeddata(chd, self);
+    chd_rb_ensure_initialized(chd);
+    chd_rb_ensure_opened(chd);
+
+    const uint32_t hunkbytes = chd->header->hunkbytes;
+    uint32_t hunkidx = VALUE_TO_UINT32(idx);
+    if (hunkidx >= chd->header->totalhunks) {
+	rb_raise(rb_eRangeError, "hunk index (%d) is out of range (%d..%d)",
+		 hunkidx, 0, chd->header->totalhunks - 1);
+    }
+
+    // Cached hunk (shared with the cache)
+    chd_rb_lock_opened(chd);
+    int cached = chd_rb_cache_lookup(chd, hunkidx) >= 0;
+    pthread_mutex_unlock(&chd->lock);
+    if (cached) {
+	return chd_rb_read_shared(chd, hunkidx, 0, hunkbytes);
+    }
+
+    VALUE strdata = rb_str_buf_new(hunkbytes);
+    struct chd_rb_read rd = {
+	.chd       = chd,
+	.buffer    = RSTRING_PTR(strdata),
+	.offset    = hunkidx,
+	.hunkbytes = hunkbytes,
+    };
+    chd_rb_read_without_gvl(chd_rb_read_hunk_nogvl, &rd);
+
+    rb_str_set_len(strdata, hunkbytes);
+    return strdata;
+}
+
+
+/**
+ * Read a CHD hunk as stored in the file, without decoding it.
+ *
+ * The returned hash describes the hunk according to the V5 map:
+ * * `:type`   : `:compressed`, `:none` (stored uncompressed),
+ *               `:self` (copy of another hunk), or `:parent`
+ *               (copy of data from the parent)
+ * * `:codec`  : codec used (as found in {#header}), for `:compressed`
+ * * `:length` : number of bytes stored in the file
+ * * `:offset` : position in the file, hunk index for `:self`,
+ *               or unit index in the parent for `:parent`
+ * * `:crc16`  : CRC-16 of the decoded hunk (if available)
+ * * `:data`   : stored bytes, for `:compressed` and `:none`
+ *
+ * These hunks can be appended to another CHD using {Writer},
+ * allowing copying without decompression / recompression.
+ *
+ * @param idx [Integer] hunk index (start at 0)
+ *
+ * @raise [RangeError] if the requested hunk doesn't exists
+ * @raise [NotSupportedError] if the CHD is not version 5
+ *
+ * @return [Hash{Symbol => Object}]
+ */
+static VALUE
+chd_m_read_compressed_hunk(VALUE self, VALUE idx) {
+    // Retrieve typed data
+    struct chd_rb_data *chd;
+    chd_rb_get_typeddata(chd, self);
+    chd_rb_ensure_initialized(chd);
+    chd_rb_ensure_opened(chd);
+    chd_rb_ensure_v5_map(chd);
+
+    uint32_t hunkidx = VALUE_TO_UINT32(idx);
+    if (hunkidx >= chd->header->totalhunks) {
+	rb_raise(rb_eRangeError, "hunk index (%u) is out of range (%d..%d)",
+		 hunkidx, 0, chd->header->totalhunks - 1);
+    }
+
+    struct chd_rb_map_entry entry;
+    chd_rb_map_entry(chd, hunkidx, &entry);
+
+    VALUE hunk  = rb_hash_new();
+    VALUE type  = Qnil;
+    VALUE codec = Qnil;
+    switch(entry.type) {
+    case CHD_V5_COMPRESSION_NONE:   type = ID2SYM(id_none);       break;
+    case CHD_V5_COMPRESSION_SELF:   type = ID2SYM(id_self);       break;
+    case CHD_V5_COMPRESSION_PARENT: type = ID2SYM(id_parent);     break;
+    default:
+	if (entry.type > CHD_V5_COMPRESSION_TYPE_3) {
+	    rb_raise(eCHDDataError, "unknown hunk type (%d)", entry.type);
+	}
+	char str[sizeof(uint32_t)];
+	rb_integer_pack(ULONG2NUM(chd->header->compression[entry.type]),
+			str, 1, sizeof(uint32_t), 0, INTEGER_PACK_BIG_ENDIAN);
+	type  = ID2SYM(id_compressed);
+	codec = rb_str_new(str, sizeof(str));
+	break;
+    }
+    rb_hash_aset(hunk, ID2SYM(id_type),   type);
+    if (! NIL_P(codec)) {
+	rb_hash_aset(hunk, ID2SYM(id_codec), codec);
+    }
+    rb_hash_aset(hunk, ID2SYM(id_length), ULONG2NUM(entry.length));
+    rb_hash_aset(hunk, ID2SYM(id_offset), ULL2NUM(entry.offset));
+    rb_hash_aset(hunk, ID2SYM(id_crc16),
+		 entry.has_crc ? INT2FIX(entry.crc) : Qnil);
+
+    // Retrieve the stored bytes
+    if (entry.type <= CHD_V5_COMPRESSION_NONE) {
+	VALUE strdata = rb_str_buf_new(entry.length);
+	if (entry.offset == 0) {
+	    // Zero-filled hunk (uncompressed CHD without parent)
+	    entry.length = chd->header->hunkbytes;
+	    memset(RSTRING_PTR(strdata), 0, entry.length);
+	    rb_hash_aset(hunk, ID2SYM(id_length), ULONG2NUM(entry.length));
+	} else {
+	    struct chd_rb_read rd = {
+		.chd    = chd,
+		.buffer = RSTRING_PTR(strdata),
+		.offset = entry.offset,
+		.size   = entry.length,
+	    };
+	    chd_rb_read_without_gvl(chd_rb_read_raw_nogvl, &rd);
+	}
+	rb_str_set_len(strdata, entry.length);
+	rb_hash_aset(hunk, ID2SYM(id_data), strdata);
     }
 
-    // Open CHD
-    chd_error err = CHDERR_NONE;
-    if (RTEST(rb_obj_is_kind_of(file, rb_cIO))) {
-        rb_io_t *fptr;
-        GetOpenFile(file, fptr);
+    return hunk;
+}
+
+
+/**
+ * Retrieve the V5 hunk map.
+ *
+ * The map is returned as a packed string of 12-byte entries
+ * (one per hunk), all the values being big-endian:
+ * * type   (1 byte) : 0-3 compressed (index of the codec in
+ *                     {#header}), 4 uncompressed, 5 self, 6 parent
+ * * length (3 bytes): number of bytes stored in the file
+ * * offset (6 bytes): position in the file, hunk index for self,
+ *                     or unit index in the parent for parent
+ * * crc16  (2 bytes): CRC-16 of the decoded hunk
+ *                     (0 for an uncompressed CHD, as not available)
+ *
+ * @raise [NotSupportedError] if the CHD is not version 5
+ *
+ * @return [String]
+ */
+static VALUE
+chd_m_hunk_map(VALUE self) {
+    // Retrieve typed data
+    struct chd_rb_data *chd;
+    chd_rb_get_typeddata(chd, self);
+    chd_rb_ensure_initialized(chd);
+    chd_rb_ensure_opened(chd);
+    chd_rb_ensure_v5_map(chd);
+
+    const uint32_t totalhunks = chd->header->totalhunks;
+    VALUE          strmap     = rb_str_buf_new(totalhunks * 12);
+    uint8_t       *raw        = (uint8_t *)RSTRING_PTR(strmap);
+
+    // Compressed CHD: map is already in the right format
+    if (chd->header->compression[0] != CHD_CODEC_NONE) {
+	memcpy(raw, chd_rb_rawmap(chd), totalhunks * 12);
 
-	err = chd_open_file(rb_io_stdio_file(fptr),
-			    FIX2INT(mode), parent, &chd->file);
+    // Uncompressed CHD: build entries
     } else {
-	err = chd_open(StringValueCStr(file),
-		       FIX2INT(mode), parent, &chd->file);
+	for (uint32_t hunkidx = 0 ; hunkidx < totalhunks ; hunkidx++) {
+	    struct chd_rb_map_entry entry;
+	    chd_rb_map_entry(chd, hunkidx, &entry);
+	    raw[0] = entry.type;
+	    for (int i = 3 ; i >= 1  ; i--, entry.length >>= 8)
+		raw[i] = entry.length & 0xff;
+	    for (int i = 9 ; i >= 4  ; i--, entry.offset >>= 8)
+		raw[i] = entry.offset & 0xff;
+	    raw[10] = raw[11] = 0;
+	    raw += 12;
+	}
     }
-    chd_rb_raise_if_error(err);    
 
-    // Retrieve header and hunkbytes
-    chd->header         = chd_get_header(chd->file);
-    chd->units_per_hunk = chd->header->hunkbytes / chd->header->unitbytes;
-    if (chd->header->hunkbytes % chd->header->unitbytes) {
-	chd_close(chd->file);
-	rb_raise(eCHDDataError, "CHD hunk is not a multiple of unit");
+    rb_str_set_len(strmap, totalhunks * 12);
+    return strmap;
+}
+
+
+/**
+ * @!visibility private
+ *
+ * Read ahead an extent of the file (as stored, see {#hunk_map}),
+ * so that the hunks it contains are decoded without waiting
+ * for disk accesses (no-op if not supported by the system).
+ *
+ * @param offset [Integer] position in the file
+ * @param length [Integer] number of bytes
+ *
+ * @return [self]
+ */
+static VALUE
+chd_m_readahead(VALUE self, VALUE offset, VALUE length) {
+    // Retrieve typed data
+    struct chd_rb_data *chd;
+    chd_rb_get_typeddata(chd, self);
+    chd_rb_ensure_initialized(chd);
+    chd_rb_ensure_opened(chd);
+
+    struct chd_rb_read rd = {
+	.chd    = chd,
+	.offset = NUM2ULL(offset),
+	.size   = NUM2ULL(length),
+    };
+    if (rd.size > 0)
+	chd_rb_read_without_gvl(chd_rb_readahead_nogvl, &rd);
+
+    return self;
+}
+
+
+/**
+ * Compute the CRC-16 (CCITT) of data, as used in the V5 hunk map.
+ *
+ * @param data [String]
+ *
+ * @return [Integer]
+ */
+static VALUE
+chd_s_crc16(VALUE klass, VALUE data) {
+    StringValue(data);
+    return INT2FIX(chd_rb_crc16((uint8_t *)RSTRING_PTR(data),
+				RSTRING_LEN(data)));
+}
+
+
+/**
+ * Read a CHD unit.
+ *
+ * The unit is read from the cached hunk (see {#read_bytes}).
+ *
+ * @param idx [Integer] unit index (start at 0)
+ *
+ * @raise [RangeError] if the requested unit doesn't exists
+ *
+ * @return [String]
+ */
+static VALUE
+chd_m_read_unit(VALUE self, VALUE idx) {
+    // Retrieve typed data
+    struct chd_rb_data *chd;
+    chd_rb_get_typeddata(chd, self);
+    chd_rb_ensure_initialized(chd);
+    chd_rb_ensure_opened(chd);
+
+    const uint32_t unitbytes  = chd->header->unitbytes;
+    const uint32_t unitidx    = VALUE_TO_UINT32(idx);
+
+    if (unitidx >= chd->header->unitcount) {
+	rb_raise(rb_eRangeError, "unit index (%u) is out of range (%d..%llu)",
+		 unitidx, 0, (unsigned long long)chd->header->unitcount - 1);
+    }
+
+    // Unit inside a hunk (read from the cache)
+    if (chd->units_per_hunk > 1) {
+	return chd_rb_read_shared(chd, unitidx / chd->units_per_hunk,
+			(unitidx % chd->units_per_hunk) * unitbytes, unitbytes);
+    }
+
+    VALUE strdata = rb_str_buf_new(unitbytes);
+    struct chd_rb_read rd = {
+	.chd            = chd,
+	.buffer         = RSTRING_PTR(strdata),
+	.offset         = unitidx,
+	.size           = 1,
+	.hunkbytes      = chd->header->hunkbytes,
+	.unitbytes      = unitbytes,
+	.units_per_hunk = chd->units_per_hunk,
+	.slice_offset   = 0,
+	.slice_length   = unitbytes,
+    };
+    chd_rb_read_without_gvl(chd_rb_read_units_nogvl, &rd);
+
+    rb_str_set_len(strdata, unitbytes);
+    return strdata;
+}
+
+
+/**
+ * Read consecutive CHD units.
+ *
+ * Only a slice of each unit can be requested, in which case the slices
+ * are concatenated in the returned string. This allows gathering,
+ * for example, the sector data of CD-ROM frames without their subcode.
+ * The end of each unit (such as the subcode) can be appended to its
+ * slice, so that both are gathered from a single decoding of the hunks.
+ *
+ * Whole hunks are decoded directly in the returned string,
+ * bypassing the hunk cache. A slice of a single unit is read
+ * from the cached hunk (see {#read_bytes}).
+ *
+ * @overload read_units(idx, count, offset: 0, length: unit_bytes, tail: 0, swap: false)
+ *   @param idx    [Integer] index of the first unit (start at 0)
+ *   @param count  [Integer] number of units to read
+ *   @param offset [Integer] offset of the slice inside each unit
+ *   @param length [Integer] length of the slice inside each unit
+ *   @param tail   [Integer] number of bytes at the end of each unit
+ *                           appended to its slice (never swapped)
+ *   @param swap   [Boolean] swap bytes of 16-bit words of the slices
+ *                           (audio samples)
+ *
+ * @raise [RangeError] if the requested units don't exist
+ * @raise [ArgumentError] if the slice is not inside the unit,
+ *                       or overlaps its tail
+ *
+ * @return [String]
+ */
+static VALUE
+chd_m_read_units(int argc, VALUE *argv, VALUE self) {
+    VALUE idx, count, opts;
+    ID    kwargs_id[4] = { id_offset, id_length, id_tail, id_swap };
+    VALUE kwargs   [4];
+
+    // Retrieve arguments
+    rb_scan_args_kw(RB_SCAN_ARGS_LAST_HASH_KEYWORDS, argc, argv, "2:",
+		    &idx, &count, &opts);
+    rb_get_kwargs(opts, kwargs_id, 0, 4, kwargs);
+
+    // Retrieve typed data
+    struct chd_rb_data *chd;
+    chd_rb_get_typeddata(chd, self);
+    chd_rb_ensure_initialized(chd);
+    chd_rb_ensure_opened(chd);
+
+    const uint32_t unitbytes = chd->header->unitbytes;
+    const uint64_t unitidx   = NUM2ULL(idx);
+    const uint64_t unitcount = NUM2ULL(count);
+    const uint32_t offset    = (kwargs[0] == Qundef) ? 0
+	                     : VALUE_TO_UINT32(kwargs[0]);
+          uint32_t tail      = (kwargs[2] == Qundef) ? 0
+	                     : VALUE_TO_UINT32(kwargs[2]);
+          uint32_t length    = (kwargs[1] == Qundef) ? unitbytes - offset
+	                     : VALUE_TO_UINT32(kwargs[1]);
+    const int      swap      = (kwargs[3] != Qundef) && RTEST(kwargs[3]);
+
+    if ((unitidx   > chd->header->unitcount) ||
+	(unitcount > chd->header->unitcount - unitidx)) {
+	rb_raise(rb_eRangeError, "units are out of range (%d..%llu)",
+		 0, (unsigned long long)chd->header->unitcount - 1);
+    }
+    if ((offset > unitbytes) || (length > unitbytes - offset)) {
+	rb_raise(rb_eArgError, "slice is outside of unit (%u bytes)",
+		 unitbytes);
+    }
+    if (tail > unitbytes - offset - length) {
+	rb_raise(rb_eArgError, "slice overlaps the tail of the unit");
+    }
+    if (swap && (length % 2)) {
+	rb_raise(rb_eArgError, "can't swap an odd number of bytes");
+    }
+
+    // Tail following the slice: a single slice
+    if ((tail > 0) && !swap && (offset + length + tail == unitbytes)) {
+	length += tail;
+	tail    = 0;
+    }
+
+    // Slice of a unit inside a hunk (read from the cache)
+    if ((unitcount == 1) && !swap && (tail == 0) &&
+	(chd->units_per_hunk > 1)) {
+	return chd_rb_read_shared(chd, unitidx / chd->units_per_hunk,
+			(unitidx % chd->units_per_hunk) * unitbytes + offset,
+			length);
+    }
+
+    VALUE strdata = rb_str_buf_new(unitcount * (length + tail));
+    struct chd_rb_read rd = {
+	.chd            = chd,
+	.buffer         = RSTRING_PTR(strdata),
+	.offset         = unitidx,
+	.size           = unitcount,
+	.hunkbytes      = chd->header->hunkbytes,
+	.unitbytes      = unitbytes,
+	.units_per_hunk = chd->units_per_hunk,
+	.slice_offset   = offset,
+	.slice_length   = length,
+	.slice_tail     = tail,
+	.swap           = swap,
+    };
+    chd_rb_read_without_gvl(chd_rb_read_units_nogvl, &rd);
+
+    rb_str_set_len(strdata, unitcount * (length + tail));
+    return strdata;
+}
+
+
+/**
+ * Read bytes of data.
+ *
+ * Whole hunks are decoded directly in the returned string,
+ * bypassing the hunk cache. Unless a buffer is given, bytes inside
+ * a single hunk are read from the cached hunk: when extending to the
+ * end of the hunk, they are returned as a substring sharing its buffer
+ * (copy-on-write), otherwise they are copied.
+ *
+ * @overload read_bytes(offset, size, buffer=nil)
+ *   @param offset  [Integer] offset from which reading bytes start
+ *   @param size    [Integer] number of bytes to read
+ *   @param buffer  [String]  string receiving the data (its content
+ *                            is replaced), instead of a new string
+ *
+ * @raise [IOError] if the requested data is not available
+ *
+ * @return [String]
+ */
+static VALUE
+chd_m_read_bytes(int argc, VALUE *argv, VALUE self) {
+    VALUE offset, size, buffer;
+
+    // Retrieve arguments
+    rb_scan_args(argc, argv, "21", &offset, &size, &buffer);
+
+    // Retrieve typed data
+    struct chd_rb_data *chd;
+    chd_rb_get_typeddata(chd, self);
+    chd_rb_ensure_initialized(chd);
+    chd_rb_ensure_opened(chd);
+    
+    const uint64_t  _offset       = NUM2ULL(offset);
+    const long      _size         = NUM2LONG(size);
+
+    if (_size < 0) {
+	rb_raise(rb_eArgError, "negative size (%ld)", _size);
+    }
+    if (_offset > UINT64_MAX - _size) {
+	rb_raise(rb_eRangeError, "offset is out of range");
+    }
+
+    // Part of a hunk (read from the cache)
+    const uint32_t  hunkbytes     = chd->header->hunkbytes;
+    if (NIL_P(buffer) && (_size > 0) && (_size < hunkbytes) &&
+	(_offset / hunkbytes <  chd->header->totalhunks)         &&
+	(_offset / hunkbytes == (_offset + _size - 1) / hunkbytes)) {
+	return chd_rb_read_shared(chd, _offset / hunkbytes,
+				  _offset % hunkbytes, _size);
     }
 
-    // Allocate cache
-    chd->cached_hunk    = malloc(chd->header->hunkbytes);
-    chd->cached_hunkidx = -1;
-    if (chd->cached_hunk == NULL) {
-	chd_close(chd->file);
-	rb_raise(rb_eNoMemError, "out of memory (hunk cache)");
+    VALUE strdata;
+    if (NIL_P(buffer)) {
+	strdata = rb_str_buf_new(_size);
+    } else {
+	strdata = StringValue(buffer);
+	rb_str_resize(strdata, _size);
+	rb_str_modify(strdata);
+	rb_enc_associate_index(strdata, rb_ascii8bit_encindex());
     }
+    struct chd_rb_read rd = {
+	.chd       = chd,
+	.buffer    = RSTRING_PTR(strdata),
+	.offset    = _offset,
+	.size      = _size,
+	.hunkbytes = hunkbytes,
+    };
+    // the string is locked, so that it can't be resized or freed
+    // by another thread while the GVL is released
+    rb_str_locktmp(strdata);
+    rb_thread_call_without_gvl(chd_rb_read_bytes_nogvl, &rd, NULL, NULL);
+    rb_str_unlocktmp(strdata);
+    chd_rb_read_finish(&rd);
+
+    rb_str_set_len(strdata, _size);
+    return strdata;
+}
     
-    // Mark as initialized and opened
-    chd->flags = CHD_RB_DATA_INITIALIZED | CHD_RB_DATA_OPENED;
-    
-    return Qnil;
+
+static VALUE
+chd_rb_stats_to_hash(const struct chd_rb_stats *stats)
+{
+    VALUE    codecs = rb_hash_new();
+    uint64_t count = 0, errors = 0, bytes_read = 0, bytes_decompressed = 0;
+    uint64_t ns    = 0;
+
+    for (int i = 0 ; i < CHD_RB_SLOT_COUNT ; i++) {
+	const struct chd_rb_codec_stats *codec = &stats->codecs[i];
+	if (codec->count == 0)
+	    continue;
+
+	VALUE histogram = rb_ary_new_capa(CHD_RB_STATS_BUCKETS);
+	for (int b = 0 ; b < CHD_RB_STATS_BUCKETS ; b++)
+	    rb_ary_push(histogram, ULL2NUM(codec->histogram[b]));
+
+	VALUE h = rb_hash_new();
+	rb_hash_aset(h, ID2SYM(id_count),              ULL2NUM(codec->count));
+	rb_hash_aset(h, ID2SYM(id_errors),             ULL2NUM(codec->errors));
+	rb_hash_aset(h, ID2SYM(id_bytes_read),         ULL2NUM(codec->bytes_read));
+	rb_hash_aset(h, ID2SYM(id_bytes_decompressed),
+		                                ULL2NUM(codec->bytes_decompressed));
+	rb_hash_aset(h, ID2SYM(id_seconds),          DBL2NUM(codec->ns / 1e9));
+	rb_hash_aset(h, ID2SYM(id_histogram),        rb_ary_freeze(histogram));
+	rb_hash_aset(codecs, rb_str_new_cstr(chd_rb_stats_slot_names[i]),
+		     rb_hash_freeze(h));
+
+	count              += codec->count;
+	errors             += codec->errors;
+	bytes_read         += codec->bytes_read;
+	bytes_decompressed += codec->bytes_decompressed;
+	ns                 += codec->ns;
+    }
+
+    VALUE h = rb_hash_new();
+    rb_hash_aset(h, ID2SYM(id_chd_reads),          ULL2NUM(count));
+    rb_hash_aset(h, ID2SYM(id_cache_hits),         ULL2NUM(stats->cache_hits));
+    rb_hash_aset(h, ID2SYM(id_shared_hits),        ULL2NUM(stats->shared_hits));
+    rb_hash_aset(h, ID2SYM(id_errors),             ULL2NUM(errors));
+    rb_hash_aset(h, ID2SYM(id_bytes_read),         ULL2NUM(bytes_read));
+    rb_hash_aset(h, ID2SYM(id_bytes_decompressed), ULL2NUM(bytes_decompressed));
+    rb_hash_aset(h, ID2SYM(id_seconds),            DBL2NUM(ns / 1e9));
+    rb_hash_aset(h, ID2SYM(id_codecs),             rb_hash_freeze(codecs));
+    return rb_hash_freeze(h);
 }
 
 
 /**
- * Pre-cache the whole CHD in memory.
+ * Decoding statistics of this CHD file access.
  *
- * @note
- *  * It is not necessary to enable pre-cache just to improved
- *    consecutive partial-read as the current hunk is always cached.
- *  * Once enabled, there is no way to remove the cache.
+ * Each hunk decoding (`chd_read`) is accounted per codec (`zlib`,
+ * `lzma`, `huff`, `flac`, `cdzl`, `cdlz`, `cdfl`, `zstd`, `cdzs`, or
+ * `none`, `self`, `parent` according to the hunk map, `other` if
+ * unknown), with a latency histogram: bucket `i` counts the decodings
+ * that took between 2**i and 2**(i+1) nanoseconds.
  *
- * @return [self]
+ * Accesses obtained by {#dup} have their own statistics.
+ *
+ * @return [Hash{Symbol => Object}] statistics:
+ *   * `:chd_reads`          : number of hunks decoded
+ *   * `:cache_hits`         : number of hunks served by the hunk cache
+ *   * `:shared_hits`        : number of hunks served by the shared cache
+ *                             (see {#shared_cache=})
+ *   * `:errors`             : number of failed decodings
+ *   * `:bytes_read`         : number of bytes read from the file
+ *   * `:bytes_decompressed` : number of bytes produced by decoding
+ *   * `:seconds`            : time spent decoding
+ *   * `:codecs`             : same information (`:count` instead of
+ *                             `:chd_reads`, and `:histogram`) per codec
  */
 static VALUE
-chd_m_precache(VALUE self) {
+chd_m_stats(VALUE self)
+{
     // Retrieve typed data
     struct chd_rb_data *chd;
     chd_rb_get_typeddata(chd, self);
     chd_rb_ensure_initialized(chd);
-    chd_rb_ensure_opened(chd);
 
-    chd_error err = chd_precache(chd->file);
-    chd_rb_raise_if_error(err);
-    chd->flags |= CHD_RB_DATA_PRECACHED;
+    struct chd_rb_stats stats;
+    chd_rb_lock(chd);
+    stats = chd->stats;
+    pthread_mutex_unlock(&chd->lock);
 
-    return self;
+    return chd_rb_stats_to_hash(&stats);
 }
 
 
 /**
- * Has the CHD been pre-cached?
+ * Process-wide decoding statistics (all CHD files).
+ *
+ * @return [Hash{Symbol => Object}] statistics, see {CHD#stats}
  */
 static VALUE
-chd_m_precached_p(VALUE self) {
-    // Retrieve typed data
-    struct chd_rb_data *chd;
-    chd_rb_get_typeddata(chd, self);
-    chd_rb_ensure_initialized(chd);
-    chd_rb_ensure_opened(chd);
+chd_s_stats(VALUE klass)
+{
+    struct chd_rb_stats stats;
+    const uint64_t *src = (const uint64_t *)&chd_rb_global_stats;
+          uint64_t *dst = (uint64_t *)&stats;
 
-    return (chd->flags & CHD_RB_DATA_PRECACHED) ? Qtrue : Qfalse;
+    for (size_t i = 0 ; i < sizeof(stats) / sizeof(uint64_t) ; i++)
+	dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+
+    return chd_rb_stats_to_hash(&stats);
 }
 
 
 /**
- * Return the CHD header. 
- * 
- * The header contains information about:
- *  * version
- *  *  compression used
- *  *  digest (sha1 or md5) for the file and the parent 
- *  * hunk and unit (size and count)
+ * Register a callback called after each hunk decoding.
  *
- * @return [Hash{Symbol => Object}]
+ * The callback is called, once the read operation is done,
+ * for each hunk that was decoded.
+ *
+ * @yieldparam hunk    [Integer] hunk index
+ * @yieldparam codec   [String]  codec (see {#stats})
+ * @yieldparam ns      [Integer] decoding time in nanoseconds
+ * @yieldparam bytes   [Integer] number of bytes read from the file
+ *
+ * @return [nil]
+ *
+ * @example
+ *   chd.on_decode {|hunk, codec, ns, bytes|
+ *       warn "slow hunk #{hunk} (#{codec})" if ns > 10_000_000
+ *   }
+ *   chd.on_decode  # remove the callback
  */
 static VALUE
-chd_m_header(VALUE self) {
+chd_m_on_decode(VALUE self)
+{
     // Retrieve typed data
     struct chd_rb_data *chd;
     chd_rb_get_typeddata(chd, self);
     chd_rb_ensure_initialized(chd);
-    chd_rb_ensure_opened(chd);
-    
-    if (NIL_P(chd->value.header)) {
-	chd->value.header = rb_obj_freeze(chd_rb_header(chd->header));
-    }
 
-    return chd->value.header;
+    RB_OBJ_WRITE(self, &chd->value.on_decode,
+		 rb_block_given_p() ? rb_block_proc() : Qnil);
+    return Qnil;
 }
 
 
 /**
- * Retrieve a single metadata.
- *
- * If specified the metadata tag is a 4-character symbol, some commonly used
- * are `:GDDD`, `:IDNT`, `:'KEY '`, `:'CIS '`, `:CHTR`, `:CHT2`, `:CHGD`,
- * `:AVAV`, `:AVLD`. Note the use of single-quote to include a white-space
- * in some of the tag.
- *
- * @overload get_metadata(index=0, tag=nil)
- *   @param index [Integer]      index from which to lookup for metadata
- *   @param tag   [Symbol, nil]  tag of the metadata to lookup
- *                               (using nil as a wildcard)
- *
- * @return [Array(String, Integer, Symbol)]
- * @return [nil] if do metadata found
+ * (see CHD::SharedCache#initialize)
  */
 static VALUE
-chd_m_get_metadata(int argc, VALUE *argv, VALUE self)
+chd_rb_shm_alloc(VALUE klass)
 {
-    VALUE tag, index;
-
-    // Retrieve arguments
-    rb_scan_args_kw(RB_SCAN_ARGS_LAST_HASH_KEYWORDS, argc, argv, "02",
-		    &index, &tag);
+    struct chd_rb_shm *shm = calloc(1, sizeof(struct chd_rb_shm));
+    if (shm == NULL)
+	rb_raise(rb_eNoMemError, "out of memory (shared cache)");
+    shm->refs = 1;
+    return TypedData_Wrap_Struct(klass, &chd_rb_shm_type, shm);
+}
 
-    if (! NIL_P(index)) {
-	rb_check_type(index, T_FIXNUM);	
+/* Map the segment file (creating it if empty), checking that
+ * an existing one has the same geometry (the one of the instance,
+ * which fits in the mapping) */
+static void
+chd_rb_shm_map_file(struct chd_rb_shm *shm, VALUE path)
+{
+    const char *cpath = StringValueCStr(path);
+    int fd = open(cpath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+	rb_sys_fail_str(path);
+
+    // (serialize the initialization between processes)
+    struct stat st;
+    int         e = 0;
+    void       *addr = MAP_FAILED;
+    if ((flock(fd, LOCK_EX) < 0) || (fstat(fd, &st) < 0) ||
+	((st.st_size == 0) && (ftruncate(fd, shm->size) < 0))) {
+	e = errno;
+    } else if ((st.st_size != 0) && (st.st_size != (off_t)shm->size)) {
+	close(fd);
+	rb_raise(rb_eArgError, "shared cache file exists with another size");
+    } else {
+	addr = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, 0);
+	if (addr == MAP_FAILED)
+	    e = errno;
     }
-    
-    if (! NIL_P(tag)) {
-	rb_warn("%"PRIsVALUE" refusing to initialize same instance twice",
-		rb_obj_as_string(tag));
-	rb_check_type(tag, T_SYMBOL);
-	tag = rb_sym2str(tag);
-	if (RSTRING_LEN(tag) != 4) {
-	    rb_raise(rb_eArgError, "tag must be a 4-char symbol");
-	}
+    // (the mapping keeps the file open: the lock must be released)
+    flock(fd, LOCK_UN);
+    close(fd);
+    if (addr == MAP_FAILED)
+	rb_syserr_fail_str(e, path);
+
+    struct chd_rb_shm_header *header = addr;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == 0) {
+	header->slots      = shm->slots;
+	header->slot_bytes = shm->slot_bytes;
+	__atomic_store_n(&header->magic, CHD_RB_SHM_MAGIC, __ATOMIC_RELEASE);
+    } else if ((header->magic      != CHD_RB_SHM_MAGIC) ||
+	       (header->slots      != shm->slots)       ||
+	       (header->slot_bytes != shm->slot_bytes)) {
+	munmap(addr, shm->size);
+	rb_raise(rb_eArgError, "shared cache file exists with another layout");
     }
+    shm->header = header;
+}
 
-    // Retrieve typed data
-    struct chd_rb_data *chd;
-    chd_rb_get_typeddata(chd, self);
-    chd_rb_ensure_initialized(chd);
-    chd_rb_ensure_opened(chd);
-
-    // Perform query
-    char     buffer[CHD_METATADATA_BUFFER_MAXSIZE] = { 0 };
-    uint32_t buflen                                = sizeof(buffer);
-    uint32_t resultlen                             = 0;
-    uint32_t resulttag                             = 0;
-    uint8_t  resultflags                           = 0;    
-    uint32_t searchindex                           = 0;
-    uint32_t searchtag                             = CHDMETATAG_WILDCARD;
-
-    if (! NIL_P(index)) {
-	searchindex = FIX2INT(index);
-    }
+/**
+ * Create a shared cache.
+ *
+ * @overload initialize(size, hunk_bytes: 19584, path: nil)
+ *   @param size       [Integer]     size of the shared memory segment
+ *   @param hunk_bytes [Integer]     size of the largest hunk to cache
+ *                                   (larger hunks are not cached)
+ *   @param path       [String, nil] file of the shared memory segment
+ *                                   (nil: anonymous, for forked processes)
+ *
+ * @raise [ArgumentError] if the size is too small, or if the file
+ *                        exists with another size or hunk size
+ */
+static VALUE
+chd_rb_shm_initialize(int argc, VALUE *argv, VALUE self)
+{
+    VALUE size, opts;
+    ID    kwargs_id[2] = { id_hunk_bytes, id_path };
+    VALUE kwargs   [2];
 
-    if (! NIL_P(tag)) {
-	char *tag_str       = RSTRING_PTR(tag);
-	char *searchtag_str = (char *)&searchtag;
-	searchtag_str[0] = tag_str[3];
-	searchtag_str[1] = tag_str[2];
-	searchtag_str[2] = tag_str[1];
-	searchtag_str[3] = tag_str[0];
-    }
-    
-    chd_error err;
-    err = chd_get_metadata(chd->file,
-			   searchtag, searchindex,
-			   buffer, buflen,
-			   &resultlen, &resulttag, &resultflags);
+    // Retrieve arguments
+    rb_scan_args_kw(RB_SCAN_ARGS_LAST_HASH_KEYWORDS, argc, argv, "1:",
+		    &size, &opts);
+    rb_get_kwargs(opts, kwargs_id, 0, 2, kwargs);
 
-    // return nil on not found, otherwise raise exception
-    if (err == CHDERR_METADATA_NOT_FOUND)
+    // Retrieve typed data
+    struct chd_rb_shm *shm;
+    chd_rb_get_shm(shm, self);
+    if (shm->header) {
+	rb_warn("%"PRIsVALUE" refusing to initialize same instance twice",
+		rb_obj_as_string(cCHDSharedCache));
 	return Qnil;
-    chd_rb_raise_if_error(err);    
-
-    // Sanity check on buffer length
-    if (resultlen > buflen) {
-	rb_bug("decoding metadata buffer size (%d) is too small (got: %d)",
-	       (int)sizeof(buffer), resultlen);
     }
 
-    // Assume it's ascii 8-bit text encoded, remove last null-char
-    if ((resultlen > 0) &&
-	(buffer[resultlen-1] == '\0') &&
-	(strchr(buffer, '\0') == &buffer[resultlen-1])) {
-	resultlen -= 1;
+    const uint64_t _size      = NUM2ULL(size);
+    const uint32_t slot_bytes = (kwargs[0] == Qundef) ? CHD_RB_SHM_HUNK_BYTES
+	                      : VALUE_TO_UINT32(kwargs[0]);
+    const VALUE    path       = (kwargs[1] == Qundef) ? Qnil : kwargs[1];
+
+    // Geometry: whole sets of slots, data aligned as the slots
+    size_t   stride = sizeof(struct chd_rb_shm_slot) +
+	              (((size_t)slot_bytes + 63) & ~(size_t)63);
+    uint64_t slots  = (_size > sizeof(struct chd_rb_shm_header))
+	? (_size - sizeof(struct chd_rb_shm_header)) / stride : 0;
+    slots -= slots % CHD_RB_SHM_WAYS;
+    if ((slot_bytes == 0) || (slots == 0) || (slots > UINT32_MAX)) {
+	rb_raise(rb_eArgError,
+		 "shared cache size is not suitable for hunks of %u bytes",
+		 slot_bytes);
+    }
+    shm->stride     = stride;
+    shm->size       = sizeof(struct chd_rb_shm_header) + slots * stride;
+    shm->slots      = slots;
+    shm->slot_bytes = slot_bytes;
+
+    // Map segment
+    if (NIL_P(path)) {
+	void *addr = mmap(NULL, shm->size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+	    rb_sys_fail("unable to map shared cache");
+	shm->header             = addr;
+	shm->header->slots      = slots;
+	shm->header->slot_bytes = slot_bytes;
+	shm->header->magic      = CHD_RB_SHM_MAGIC;
+    } else {
+	chd_rb_shm_map_file(shm, rb_get_path(path));
     }
 
-    // Returns result
-    char str[sizeof(uint32_t)];
-    rb_integer_pack(ULONG2NUM(resulttag), str, 1, sizeof(uint32_t), 0,
-		    INTEGER_PACK_BIG_ENDIAN);
-
-    VALUE res[] = { rb_str_new(buffer, resultlen),
-	            INT2FIX(resultflags),
-		    rb_to_symbol(rb_str_new(str, sizeof(str)))
-                  };
-    
-    return rb_ary_new_from_values(ARRAY_SIZE(res), res);
+    return self;
 }
 
-
 /**
- * Retrieve all the metadata.
+ * Statistics of the shared cache (common to all the processes).
  *
- * @return [Array<Array(String, Integer, Symbol)>]
+ * @return [Hash{Symbol => Integer}] statistics:
+ *   * `:slots`      : number of slots
+ *   * `:slot_bytes` : size of the largest hunk that can be cached
+ *   * `:used`       : number of slots holding a hunk
+ *   * `:hits`       : number of hunks found in the cache
+ *   * `:misses`     : number of hunks not found in the cache
+ *   * `:stores`     : number of hunks stored in the cache
+ *   * `:evictions`  : number of hunks replaced by another one
  */
 static VALUE
-chd_m_metadata(VALUE self) {
-    VALUE list = rb_ary_new();
-    
-    for (int i = 0 ; ; i++) {
-	VALUE md  = chd_m_get_metadata(1, (VALUE []) { INT2FIX(i) }, self);
-	if (NIL_P(md))
-	    break;
-	rb_ary_push(list, md);
-    }
-    return list;
-}
+chd_rb_shm_stats(VALUE self)
+{
+    struct chd_rb_shm *shm;
+    chd_rb_get_shm(shm, self);
+    if (shm->header == NULL)
+	rb_bug("uninitialized instance");
 
+    struct chd_rb_shm_header *header = shm->header;
+    uint32_t used = 0;
+    for (uint32_t i = 0 ; i < shm->slots ; i++)
+	if (__atomic_load_n(&chd_rb_shm_slot(shm, i)->used, __ATOMIC_RELAXED))
+	    used++;
+
+    VALUE h = rb_hash_new();
+    rb_hash_aset(h, ID2SYM(id_slots),      UINT2NUM(shm->slots));
+    rb_hash_aset(h, ID2SYM(id_slot_bytes), UINT2NUM(shm->slot_bytes));
+    rb_hash_aset(h, ID2SYM(id_used),       UINT2NUM(used));
+    rb_hash_aset(h, ID2SYM(id_hits),
+		 ULL2NUM(__atomic_load_n(&header->hits,      __ATOMIC_RELAXED)));
+    rb_hash_aset(h, ID2SYM(id_misses),
+		 ULL2NUM(__atomic_load_n(&header->misses,    __ATOMIC_RELAXED)));
+    rb_hash_aset(h, ID2SYM(id_stores),
+		 ULL2NUM(__atomic_load_n(&header->stores,    __ATOMIC_RELAXED)));
+    rb_hash_aset(h, ID2SYM(id_evictions),
+		 ULL2NUM(__atomic_load_n(&header->evictions, __ATOMIC_RELAXED)));
+    return h;
+}
 
 /**
- * Read a CHD hunk.
+ * Use a shared cache for the decoded hunks of this access.
  *
- * @param idx [Integer] hunk index (start at 0)
+ * Before decoding a hunk, the shared cache is consulted, and the
+ * decoded hunk is stored into it.
  *
- * @raise [RangeError] if the requested hunk doesn't exists
+ * @param cache [SharedCache, nil] shared cache (nil: none)
  *
- * @return [String]
+ * @raise [ArgumentError]     if the hunks don't fit in the cache slots
+ * @raise [NotSupportedError] if the CHD has no digest identifying it
+ *
+ * @return [SharedCache, nil]
  */
 static VALUE
-chd_m_read_hunk(VALUE self, VALUE idx) {
+chd_m_set_shared_cache(VALUE self, VALUE cache)
+{
     // Retrieve typed data
     struct chd_rb_data *chd;
     chd_rb_get_typeddata(chd, self);
     chd_rb_ensure_initialized(chd);
     chd_rb_ensure_opened(chd);
 
-    uint32_t hunkidx = VALUE_TO_UINT32(idx);
-    if ((hunkidx < 0) || (hunkidx >= chd->header->totalhunks)) {
-	rb_raise(rb_eRangeError, "hunk index (%d) is out of range (%d..%d)",
-		 hunkidx, 0, chd->header->totalhunks - 1);
+    struct chd_rb_shm *shm = chd_rb_shm_get(cache);
+    if (shm) {
+	uint8_t key[CHD_SHA1_BYTES];
+	if (shm->slot_bytes < chd->header->hunkbytes) {
+	    rb_raise(rb_eArgError, "hunks are larger than the cache slots");
+	}
+	if (! chd_rb_shm_key(chd, key)) {
+	    rb_raise(eCHDNotSupportedError,
+		     "CHD has no digest to identify it in the shared cache");
+	}
     }
 
-    VALUE strdata = rb_str_buf_new(chd->header->hunkbytes);
-    char *buffer  = RSTRING_PTR(strdata);
-    
-    chd_error err = chd_read(chd->file, hunkidx, buffer);
-    chd_rb_raise_if_error(err);
-
-    rb_str_set_len(strdata, chd->header->hunkbytes);
-    return strdata;
+    chd_rb_shm_attach(chd, shm);
+    RB_OBJ_WRITE(self, &chd->value.shared_cache, cache);
+    return cache;
 }
 
-
 /**
- * Read a CHD unit.
- *
- * @param idx [Integer] unit index (start at 0)
- *
- * @raise [RangeError] if the requested unit doesn't exists
+ * Shared cache used by this access.
  *
- * @return [String]
+ * @return [SharedCache, nil]
  */
 static VALUE
-chd_m_read_unit(VALUE self, VALUE idx) {
+chd_m_shared_cache(VALUE self)
+{
     // Retrieve typed data
     struct chd_rb_data *chd;
     chd_rb_get_typeddata(chd, self);
     chd_rb_ensure_initialized(chd);
-    chd_rb_ensure_opened(chd);
 
-    const uint32_t hunkbytes  = chd->header->hunkbytes;
-    const uint32_t unitbytes  = chd->header->unitbytes;
-    const uint32_t unitidx    = VALUE_TO_UINT32(idx);
-    const uint32_t hunkidx    = unitidx / chd->units_per_hunk;
-    const size_t   offset     = (unitidx % chd->units_per_hunk) * unitbytes;
-	  
-    if (hunkidx != chd->cached_hunkidx) {
-	chd_error err = chd_read(chd->file, hunkidx, chd->cached_hunk);
-	chd->cached_hunkidx = (err == CHDERR_NONE) ? hunkidx : -1;
-	chd_rb_raise_if_error(err);
-    }
+    return chd->value.shared_cache;
+}
+
+/**
+ * Set the shared cache used by the CHD files opened afterward
+ * (CHD files without digest, or with hunks larger than the cache
+ * slots, don't use it).
+ *
+ * @param cache [SharedCache, nil] shared cache (nil: none)
+ *
+ * @return [SharedCache, nil]
+ */
+static VALUE
+chd_s_set_shared_cache(VALUE klass, VALUE cache)
+{
+    chd_rb_shm_get(cache);
+    chd_rb_default_shared_cache = cache;
+    return cache;
+}
 
-    return rb_str_new((char *) &chd->cached_hunk[offset], unitbytes);
+/**
+ * Shared cache used by default.
+ *
+ * @return [SharedCache, nil]
+ */
+static VALUE
+chd_s_shared_cache(VALUE klass)
+{
+    return chd_rb_default_shared_cache;
 }
 
 
 /**
- * Read bytes of data.
+ * Give advice about the expected accesses, to steer the hunk cache.
  *
- * @param offset  [Integer] offset from which reading bytes start
- * @param size    [Integer] number of bytes to read
+ * Hints are:
+ * * `:willneed`   : decode the hunks of the range in the cache,
+ *                   in the background (only as many hunks as the cache
+ *                   can hold are queued)
+ * * `:dontneed`   : drop the hunks of the range from the cache
+ * * `:sequential` : read ahead the hunks following the accessed ones
+ * * `:random`     : disable read-ahead
+ * * `:normal`     : default behaviour (no read-ahead)
  *
- * @raise [IOError] if the requested data is not available
+ * The `:sequential`, `:random`, and `:normal` hints apply to the
+ * whole file, the range is ignored.
  *
- * @return [String]
+ * @overload advise(range, hint, hunks: false)
+ *   @param range [Range, nil] range of bytes (or hunks)
+ *   @param hint  [Symbol]     access hint
+ *   @param hunks [Boolean]    range is expressed in hunks instead of bytes
+ *
+ * @raise [ArgumentError] if the hint is unknown
+ * @raise [RangeError]    if the range starts outside of the data
+ *
+ * @return [self]
+ *
+ * @example
+ *   chd.advise(0...64*1024, :willneed)   # boot sectors
+ *   chd.advise(nil, :sequential)
  */
 static VALUE
-chd_m_read_bytes(VALUE self, VALUE offset, VALUE size) {
+chd_m_advise(int argc, VALUE *argv, VALUE self)
+{
+    VALUE range, hint, opts;
+    ID    kwargs_id[1] = { id_hunks };
+    VALUE kwargs   [1];
+
+    // Retrieve arguments
+    rb_scan_args_kw(RB_SCAN_ARGS_LAST_HASH_KEYWORDS, argc, argv, "2:",
+		    &range, &hint, &opts);
+    rb_get_kwargs(opts, kwargs_id, 0, 1, kwargs);
+    const int in_hunks = (kwargs[0] != Qundef) && RTEST(kwargs[0]);
+
     // Retrieve typed data
     struct chd_rb_data *chd;
     chd_rb_get_typeddata(chd, self);
     chd_rb_ensure_initialized(chd);
     chd_rb_ensure_opened(chd);
-    
-    const uint32_t  _offset       = VALUE_TO_UINT32(offset);
-    const uint32_t  _size         = VALUE_TO_UINT32(size);
-    const uint32_t  hunkbytes     = chd->header->hunkbytes;
-    const uint32_t  hunkidx_first = _offset               / hunkbytes;
-    const uint32_t  hunkidx_last  = (_offset + _size - 1) / hunkbytes;
-    const VALUE     strdata       = rb_str_buf_new(_size);
-          char     *buffer        = RSTRING_PTR(strdata);
 
-    for (uint32_t hunkidx = hunkidx_first; hunkidx <= hunkidx_last; hunkidx++) {
-	uint32_t startoffs = (hunkidx == hunkidx_first)
-	                   ? (_offset % hunkbytes)
-	                   : 0;
-	uint32_t endoffs   = (hunkidx == hunkidx_last)
-	                   ? ((_offset + _size - 1) % hunkbytes)
-	                   : (hunkbytes - 1);
-	size_t   chunksize = endoffs + 1 - startoffs;
-	
-	// if it's a full block, just read directly from disk
-	// (unless it's the cached hunk)
-	if ((startoffs == 0                   ) &&
-	    (endoffs   == (hunkbytes - 1)     ) &&
-	    (hunkidx   != chd->cached_hunkidx)) {
-	    chd_error err = chd_read(chd->file, hunkidx, buffer);
-	    chd_rb_raise_if_error(err);
-	}
-	// otherwise, read from the cache
-	// (and fill the cache if necessary)
-	else {
-	    if (hunkidx != chd->cached_hunkidx) {
-		chd_error err = chd_read(chd->file, hunkidx, chd->cached_hunk);
-		chd->cached_hunkidx = (err == CHDERR_NONE) ? hunkidx : -1;
-		chd_rb_raise_if_error(err);
-	    }
-	    memcpy(buffer, &chd->cached_hunk[startoffs], chunksize);
-	}
-	
-	buffer += chunksize;
+    ID advice = SYMBOL_P(hint) ? SYM2ID(hint) : 0;
+
+    // Access pattern
+    if ((advice == id_sequential) || (advice == id_random) ||
+	(advice == id_normal)) {
+	chd_rb_lock_opened(chd);
+	chd->prefetch.readahead = (advice != id_sequential) ? 0
+	    : (CHD_RB_READAHEAD < chd->cache.slots - 1)
+	    ? CHD_RB_READAHEAD : chd->cache.slots - 1;
+	pthread_mutex_unlock(&chd->lock);
+	return self;
+    }
+    if ((advice != id_willneed) && (advice != id_dontneed)) {
+	rb_raise(rb_eArgError, "unknown hint (%"PRIsVALUE")", hint);
     }
 
-    rb_str_set_len(strdata, _size);
-    return strdata;
+    // Range of hunks
+    const uint32_t hunkbytes = chd->header->hunkbytes;
+    const uint64_t total     = in_hunks ? chd->header->totalhunks
+	                                : chd->header->logicalbytes;
+    long beg = 0, len = total;
+    if (!NIL_P(range) &&
+	(rb_range_beg_len(range, &beg, &len, total, 1) != Qtrue)) {
+	rb_raise(rb_eTypeError, "range expected");
+    }
+    if (len <= 0)
+	return self;
+    uint64_t first = in_hunks ? beg           : beg / hunkbytes;
+    uint64_t last  = in_hunks ? beg + len - 1 : (beg + len - 1) / hunkbytes;
+
+    chd_rb_lock_opened(chd);
+    if (advice == id_dontneed) {
+	chd_rb_cache_drop(chd, first, last);
+    } else {
+	for (uint64_t hunkidx = first ;
+	     (hunkidx <= last) && (hunkidx - first < chd->cache.slots) ;
+	     hunkidx++)
+	    chd_rb_prefetch(chd, hunkidx);
+    }
+    pthread_mutex_unlock(&chd->lock);
+
+    return self;
 }
-    
+
 
 /**
  * Close the file.
@@ -861,13 +3568,21 @@ chd_m_close(VALUE self) {
     chd_rb_get_typeddata(chd, self);
     chd_rb_ensure_initialized(chd);
 	
-    // If opened
+    // If opened (waiting for any pending read to complete)
     if (chd->flags & CHD_RB_DATA_OPENED) {
-	chd_close(chd->file);
-	chd->file         = NULL;
-	chd->header       = NULL;
-	chd->value.header = Qnil;
-	chd->flags       &= ~(CHD_RB_DATA_OPENED | CHD_RB_DATA_PRECACHED);
+	rb_thread_call_without_gvl(chd_rb_prefetch_stop_nogvl, chd,
+				   NULL, NULL);
+	chd_rb_lock(chd);
+	if (chd->flags & CHD_RB_DATA_OPENED) {
+	    chd_rb_shm_detach(chd);
+	    chd_rb_cache_clear(chd);
+	    chd->header         = NULL;
+	    chd->value.header   = Qnil;
+	    chd->value.shared_cache = Qnil;
+	    chd->flags         &= ~(CHD_RB_DATA_OPENED | CHD_RB_DATA_PRECACHED);
+	    chd_rb_release(chd);
+	}
+	pthread_mutex_unlock(&chd->lock);
     }
     
     return Qnil;
@@ -939,9 +3654,16 @@ chd_m_unit_count(VALUE self) {
 }
 
 void Init_core(void) {
+    /* Registry of hunk cache pools */
+    chd_rb_cache_pools_obj = TypedData_Wrap_Struct(0, &chd_rb_cache_pools_type,
+						   &chd_rb_cache_pools);
+    rb_gc_register_address(&chd_rb_cache_pools_obj);
+
     /* Main classes */
     cCHD      = rb_define_class("CHD", rb_cObject);
     eCHDError = rb_define_class_under(cCHD, "Error", rb_eStandardError);
+    cCHDSharedCache = rb_define_class_under(cCHD, "SharedCache", rb_cObject);
+    rb_gc_register_address(&chd_rb_default_shared_cache);
 
     /* Sub errors */
     eCHDIOError                 = rb_define_class_under(cCHD,
@@ -969,10 +3691,47 @@ void Init_core(void) {
     id_sha1          = rb_intern("sha1");
     id_sha1_raw      = rb_intern("sha1_raw");
     id_hunk_bytes    = rb_intern("hunk_bytes");
+    id_path          = rb_intern("path");
     id_hunk_count    = rb_intern("hunk_count");
     id_unit_bytes    = rb_intern("unit_bytes");
     id_unit_count    = rb_intern("unit_count");
     id_logical_bytes = rb_intern("logical_bytes");
+    id_offset        = rb_intern("offset");
+    id_length        = rb_intern("length");
+    id_swap          = rb_intern("swap");
+    id_tail          = rb_intern("tail");
+    id_raw           = rb_intern("raw");
+    id_type          = rb_intern("type");
+    id_codec         = rb_intern("codec");
+    id_crc16         = rb_intern("crc16");
+    id_data          = rb_intern("data");
+    id_none          = rb_intern("none");
+    id_self          = rb_intern("self");
+    id_compressed    = rb_intern("compressed");
+    id_call          = rb_intern("call");
+    id_hunks         = rb_intern("hunks");
+    id_willneed      = rb_intern("willneed");
+    id_dontneed      = rb_intern("dontneed");
+    id_sequential    = rb_intern("sequential");
+    id_random        = rb_intern("random");
+    id_normal        = rb_intern("normal");
+    id_count         = rb_intern("count");
+    id_cache_hits    = rb_intern("cache_hits");
+    id_shared_hits   = rb_intern("shared_hits");
+    id_slots         = rb_intern("slots");
+    id_slot_bytes    = rb_intern("slot_bytes");
+    id_used          = rb_intern("used");
+    id_hits          = rb_intern("hits");
+    id_misses        = rb_intern("misses");
+    id_stores        = rb_intern("stores");
+    id_evictions     = rb_intern("evictions");
+    id_chd_reads     = rb_intern("chd_reads");
+    id_errors        = rb_intern("errors");
+    id_bytes_read    = rb_intern("bytes_read");
+    id_bytes_decompressed = rb_intern("bytes_decompressed");
+    id_seconds       = rb_intern("seconds");
+    id_histogram     = rb_intern("histogram");
+    id_codecs        = rb_intern("codecs");
     
     /* Constants */
     /* 1: Read-only mode for opening CHD file. */
@@ -987,15 +3746,33 @@ void Init_core(void) {
     rb_define_singleton_method(cCHD, "new", chd_s_new, -1);
     rb_define_singleton_method(cCHD, "header", chd_s_header, 1);
     rb_define_singleton_method(cCHD, "open", chd_s_open, -1);
+    rb_define_singleton_method(cCHD, "crc16", chd_s_crc16, 1);
+    rb_define_singleton_method(cCHD, "stats", chd_s_stats, 0);
     rb_define_method(cCHD, "initialize", chd_m_initialize, -1);
+    rb_define_method(cCHD, "initialize_copy", chd_m_initialize_copy, 1);
     rb_define_method(cCHD, "precache", chd_m_precache, 0);
     rb_define_method(cCHD, "precached?", chd_m_precached_p, 0);
     rb_define_method(cCHD, "header", chd_m_header, 0);
     rb_define_method(cCHD, "get_metadata", chd_m_get_metadata, -1);
-    rb_define_method(cCHD, "metadata", chd_m_metadata, 0);
+    rb_define_method(cCHD, "metadata", chd_m_metadata, -1);
     rb_define_method(cCHD, "read_hunk", chd_m_read_hunk, 1);
+    rb_define_method(cCHD, "read_compressed_hunk", chd_m_read_compressed_hunk, 1);
+    rb_define_method(cCHD, "hunk_map", chd_m_hunk_map, 0);
+    rb_define_private_method(cCHD, "_readahead", chd_m_readahead, 2);
     rb_define_method(cCHD, "read_unit", chd_m_read_unit, 1);
-    rb_define_method(cCHD, "read_bytes", chd_m_read_bytes, 2);
+    rb_define_method(cCHD, "read_units", chd_m_read_units, -1);
+    rb_define_method(cCHD, "read_bytes", chd_m_read_bytes, -1);
+    rb_define_method(cCHD, "advise", chd_m_advise, -1);
+    rb_define_method(cCHD, "stats", chd_m_stats, 0);
+    rb_define_method(cCHD, "on_decode", chd_m_on_decode, 0);
+    rb_define_method(cCHD, "shared_cache", chd_m_shared_cache, 0);
+    rb_define_method(cCHD, "shared_cache=", chd_m_set_shared_cache, 1);
+    rb_define_singleton_method(cCHD, "shared_cache", chd_s_shared_cache, 0);
+    rb_define_singleton_method(cCHD, "shared_cache=", chd_s_set_shared_cache, 1);
+
+    rb_define_alloc_func(cCHDSharedCache, chd_rb_shm_alloc);
+    rb_define_method(cCHDSharedCache, "initialize", chd_rb_shm_initialize, -1);
+    rb_define_method(cCHDSharedCache, "stats", chd_rb_shm_stats, 0);
     rb_define_method(cCHD, "close", chd_m_close, 0);
     rb_define_method(cCHD, "closed?", chd_m_closed_p, 0);
     rb_define_method(cCHD, "version", chd_m_version, 0);
@@ -1,7 +1,19 @@
 # coding: utf-8
 require 'chd/core'
+require 'chd/parallel'
 require 'chd/metadata'
 require 'chd/cd'
+require 'chd/cd/extract'
+require 'chd/cd/filesystem'
+require 'chd/cd/track_io'
+require 'chd/hd'
+require 'chd/hunk_map'
+require 'chd/writer'
+require 'chd/diff'
+require 'chd/read_hunks'
+require 'chd/verify'
+require 'chd/index'
+require 'chd/nbd_server'
 
 class CHD
 
@@ -66,7 +66,7 @@ class CD
 	    if    md = chd.get_metadata(idx, Metadata::CDROM_TRACK,      )
 	    elsif md = chd.get_metadata(idx, Metadata::CDROM_TRACK_PREGAP)
 	    elsif md = chd.get_metadata(idx, Metadata::GDROM_OLD,        )
-                raise NotSupported, "upgrade your CHD to a more recent version"
+                raise NotSupportedError, "upgrade your CHD to a more recent version"
 	    elsif md = chd.get_metadata(idx, Metadata::GDROM_TRACK,      )
                 flags << :GDROM
 	    else
@@ -83,16 +83,77 @@ class CD
             end
             [ tracks, flags ]
         elsif chd.get_metadata(0, Metadata::CDROM_OLD)
-            raise NotSupported, "upgrade your CHD to a more recent version"
+            raise NotSupportedError, "upgrade your CHD to a more recent version"
         else
             raise NotFoundError, "provided CHD is not a CD-ROM"
         end
     end
             
     
-    def initialize(chd)
+    # Location of the requested data inside the sector data
+    # of a track.
+    #
+    # @param tracktype [Symbol]      type of the track
+    # @param datatype  [Symbol, nil] type of data requested
+    #                                (nil for same as track)
+    #
+    # @raise [NotSupportedError] if conversion is not possible
+    #
+    # @return [Array(Integer, Integer, Boolean)] offset, length, and if the
+    #                                            sector header need to be
+    #                                            generated (promotion)
+    #
+    def self.conversion(tracktype, datatype = nil)
+        # return same type or don't care
+        if (datatype == tracktype) || datatype.nil?
+            [ 0,  TRACK_TYPE_DATASIZE[tracktype], false ]
+                 
+	# return 2048 bytes of MODE1 data
+        #   from a 2352 byte MODE1 RAW sector
+	elsif (datatype  == :MODE1    ) &&
+              (tracktype == :MODE1_RAW)
+	    [ 16, 2048, false ]
+                 
+	# return 2352 byte MODE1 RAW sector
+        #  from 2048 bytes of MODE1 data
+	elsif (datatype  == :MODE1_RAW) &&
+              (tracktype == :MODE1    )
+            [ 0, 2048, true ]
+                 
+	# return 2048 bytes of MODE1 data
+        #   from a MODE2 FORM1 or RAW sector
+        elsif (datatype  == :MODE1      ) &&
+             ((tracktype == :MODE2_FORM1) || (tracktype == :MODE2_RAW  ))
+	    [ 24, 2048, false ]
+                 
+	# return 2048 bytes of MODE1 data
+        #   from a MODE2 FORM2 or XA sector
+	elsif (datatype  == :MODE1         ) &&
+              (tracktype == :MODE2_FORM_MIX)
+	    [  8, 2048, false ]
+                 
+        # return MODE2 2336 byte data
+        #   from a 2352 byte MODE1 or MODE2 RAW sector (skip the header)
+	elsif (datatype  == :MODE2) &&
+             ((tracktype == :MODE1_RAW) || (tracktype == :MODE2_RAW))
+	    [ 16, 2336, false ]
+                 
+        # Not supported
+        else
+            raise NotSupportedError,
+                  "conversion from type %s to type %s not supported" % [
+                      tracktype, datatype ]
+	end
+    end
+    
+    
+    # @param chd [CHD]                 a chd opened file
+    # @param toc [Array(Array, Set)]   previously read TOC and flags
+    #                                  (see {CD.read_toc}, {Index#toc})
+    #
+    def initialize(chd, toc: nil)
         @chd         = chd
-        @toc, @flags = CD.read_toc(chd)
+        @toc, @flags = toc || CD.read_toc(chd)
 
         # Build mapping 
 	chdofs = physofs = logofs = 0
@@ -137,7 +198,7 @@ class CD
         elsif ! (1 .. @toc.size).include?(track)
             raise RangeError, "track must be in 1..#{@toc.size}"
         else
-            @mappging.dig(track - 1, frame_ofs_type)
+            @mapping.dig(track - 1, frame_ofs_type)
         end
     end
 
@@ -150,72 +211,23 @@ class CD
     #
     def read_sector(lbasector, datatype = nil, phys = false)
         # Compute CHD sector and track index
-        frame_ofs_type = phys ? :physframeofs : :logframeofs
-        chdsector      = lbasector
-        trackidx       = 0
-        @mapping.each_cons(2).with_index do |(cur, nxt), idx|
-            if lbasector < nxt[frame_ofs_type]
-                chdsector = lbasector - cur[frame_ofs_type] + cur[:chdframeofs]
-                trackidx = idx
-                break
-            end
-        end
-
+        chdsector, trackidx = _locate(lbasector, phys)
 
         trackinfo = @toc[trackidx];
 	tracktype = trackinfo[:trktype]
 
-	offset, length, header =
-             # return same type or don't care
-             if (datatype == tracktype) || datatype.nil?
-                 [ 0,  trackinfo[:datasize] ]
-                 
-	     # return 2048 bytes of MODE1 data
-             #   from a 2352 byte MODE1 RAW sector
-	     elsif (datatype  == :MODE1    ) &&
-                   (tracktype == :MODE1_RAW)
-	         [ 16, 2048 ]
-                 
-	     # return 2352 byte MODE1 RAW sector
-             #  from 2048 bytes of MODE1 data
-	     elsif (datatype  == :MODE1_RAW) &&
-                   (tracktype == :MODE1    )
-	         warn "promotion of MODE1/FORM1 sector to MODE1 RAW is incomplete"
-                 m, sf = lba.divmod(60 * 75);
-                 s, f  = sf.divmod(75)
-                 hdr   = SYNCBYTES + [
-	             ((m / 10) << 4) | ((m % 10) << 0), # M
-	             ((s / 10) << 4) | ((s % 10) << 0), # S
-	             ((f / 10) << 4) | ((f % 10) << 0), # F
-                     1                                  # MODE1
-                 ].pack('C*') # MSF + MODE1
-                 
-                 [ 0, 2048, hdr ]
-                 
-	     # return 2048 bytes of MODE1 data
-             #   from a MODE2 FORM1 or RAW sector
-             elsif (datatype  == :MODE1      ) &&
-                  ((tracktype == :MODE2_FORM1) || (tracktype == :MODE2_RAW  ))
-	         [ 24, 2048 ]
-                 
-	     # return 2048 bytes of MODE1 data
-             #   from a MODE2 FORM2 or XA sector
-	     elsif (datatype  == :MODE1         ) &&
-                   (tracktype == :MODE2_FORM_MIX)
-	         [  8, 2048 ]
-                 
-             # return MODE2 2336 byte data
-             #   from a 2352 byte MODE1 or MODE2 RAW sector (skip the header)
-	     elsif (datatype  == :MODE2) &&
-                  ((tracktype == :MODE1_RAW) || (tracktype == :MODE2_RAW))
-	         [ 16, 2336 ]
-                 
-             # Not supported
-             else
-                 raise NotSupported,
-                       "conversion from type %s to type %s not supported" % [
-                           tracktype, datatype ]
-	     end
+        offset, length, promote = CD.conversion(tracktype, datatype)
+        header = if promote
+	             warn "promotion of MODE1/FORM1 sector to MODE1 RAW is incomplete"
+                     m, sf = lbasector.divmod(60 * 75);
+                     s, f  = sf.divmod(75)
+                     SYNCBYTES + [
+	                 ((m / 10) << 4) | ((m % 10) << 0), # M
+	                 ((s / 10) << 4) | ((s % 10) << 0), # S
+	                 ((f / 10) << 4) | ((f % 10) << 0), # F
+                         1                                  # MODE1
+                     ].pack('C*') # MSF + MODE1
+                 end
 
         # Read data
 	unless phys 
@@ -226,10 +238,10 @@ class CD
                 # to index 1 instead of index 0,
                 # so adjust the offset when phys=false.
 		chdsector += trackinfo[:pregap]
-            elsif  lbasector < trackinfo[:logframeofs]
+            elsif  lbasector < @mapping.dig(trackidx, :logframeofs)
 	        # if this is pregap info that isn't actually in the file,
                 # just return blank data
-                return '\0' * length
+                return "\0" * length
 	    end
 	end
 
@@ -237,10 +249,74 @@ class CD
         data = header + data if header
         data
     end
+
+    # Read consecutive sectors from a CD-ROM.
+    #
+    # Sectors are gathered track by track using {CHD#read_units},
+    # so that only the hunks involved are decoded, each of them once.
+    #
+    # @param lbasector [Integer] first sector number
+    # @param count     [Integer] number of sectors
+    # @param datatype  [Symbol]  type of data
+    #
+    # @raise [RangeError] if the sectors are not inside the disc
+    #
+    # @return [String] concatenated sector data
+    #
+    def read_sectors(lbasector, count, datatype = nil, phys = false)
+        frame_ofs_type = phys ? :physframeofs : :logframeofs
+        if lbasector < 0 || count < 0 ||
+           lbasector + count > @mapping.last[frame_ofs_type]
+            raise RangeError, "sectors are outside of the disc"
+        end
+
+        data = String.new(encoding: Encoding::BINARY)
+        while count > 0
+            chdsector, trackidx = _locate(lbasector, phys)
+            trackinfo = @toc[trackidx]
+            first     = @mapping.dig(trackidx, frame_ofs_type)
+            run       = [ count,
+                          @mapping.dig(trackidx + 1, frame_ofs_type) - lbasector
+                        ].min
+            offset, length, promote = CD.conversion(trackinfo[:trktype],
+                                                    datatype)
+
+            # Pregap not in the file, or sector header to generate:
+            # let read_sector deal with it
+            if promote || (!phys && trackinfo[:pgdatasize].zero? &&
+                           lbasector < first)
+                run   = [ run, first - lbasector ].min if lbasector < first
+                run.times {|i| data << read_sector(lbasector + i, datatype,
+                                                   phys) }
+            else
+                chdsector += trackinfo[:pregap] unless
+                    phys || trackinfo[:pgdatasize].zero?
+                data << @chd.read_units(chdsector, run, offset: offset,
+                                                        length: length)
+            end
+
+            lbasector += run
+            count     -= run
+        end
+        data
+    end
  
 
     private
     
+    # CHD frame (not accounting for the pregap data) and track index
+    # of a sector
+    def _locate(lbasector, phys = false)
+        frame_ofs_type = phys ? :physframeofs : :logframeofs
+        @mapping.each_cons(2).with_index do |(cur, nxt), idx|
+            if lbasector < nxt[frame_ofs_type]
+                return [ lbasector - cur[frame_ofs_type] + cur[:chdframeofs],
+                         idx ]
+            end
+        end
+        [ lbasector, 0 ]
+    end
+
 
     def _enhance_toc(toc)
 	chd_offset = physical_offset = logical_offset = 0
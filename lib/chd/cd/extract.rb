@@ -0,0 +1,226 @@
+class CHD
+class CD
+    # Number of bytes (approximately) gathered by a single extraction job.
+    EXTRACT_CHUNK_SIZE = 4 * 1024 * 1024
+
+    # Number of bytes buffered before writing them to the output file.
+    EXTRACT_WRITE_SIZE = 16 * 1024 * 1024
+
+    # Track type as written in CUE/GDI files
+    CUE_TRACK_TYPES = {
+         :MODE1          => 'MODE1/2048',
+         :MODE1_RAW      => 'MODE1/2352',
+         :MODE2          => 'MODE2/2336',
+         :MODE2_FORM1    => 'MODE2/2048',
+         :MODE2_FORM2    => 'MODE2/2324',
+         :MODE2_FORM_MIX => 'MODE2/2336',
+         :MODE2_RAW      => 'MODE2/2352',
+         :AUDIO          => 'AUDIO',
+    }.freeze
+
+    # Extract the CD-ROM / GD-ROM to disk.
+    #
+    # Supported formats are:
+    # * `:bin_cue` : all the tracks in a single BIN file, described
+    #                by a CUE sheet
+    # * `:iso`     : the first data track, as 2048 bytes sectors
+    #                (the CUE path is not used)
+    # * `:gdi`     : one file per track (`.bin` for data, `.raw` for audio),
+    #                named after the BIN path suffixed with the track number,
+    #                described by a GDI file
+    #
+    # As in chdman, audio samples are written in little-endian order,
+    # and subcode data (if any) follows the sector data of each frame.
+    #
+    # Hunks are decoded in parallel using independent accesses to the
+    # CHD file (if it was opened from a path), and written to disk in
+    # large blocks.
+    #
+    # @param bin_path [String]      path of the BIN/ISO file (or template
+    #                               of the track files for GDI)
+    # @param cue_path [String, nil] path of the CUE/GDI file
+    # @param format   [:bin_cue, :iso, :gdi] output format
+    # @param threads  [Integer]     number of decoding threads
+    #
+    # @yieldparam bytes [Integer]   number of bytes written so far
+    # @yieldparam total [Integer]   total number of bytes to write
+    #
+    # @raise [ArgumentError]        if the CUE/GDI path is missing
+    # @raise [NotFoundError]        if no data track exists (ISO)
+    #
+    # @return [Hash{Symbol => Object}] extraction statistics
+    #                                  (`:bytes`, `:frames`, `:seconds`,
+    #                                   `:throughput` in bytes/second)
+    #
+    # @example
+    #   cd = CHD::CD.new(CHD.new('game.chd'))
+    #   cd.extract('game.bin', 'game.cue') {|bytes, total|
+    #       print "\r%3d%%" % [ 100 * bytes / total ]
+    #   }
+    #
+    def extract(bin_path, cue_path = nil, format: :bin_cue,
+                threads: Parallel.threads, &progress)
+        if (format != :iso) && cue_path.nil?
+            raise ArgumentError, "a CUE/GDI path is required for #{format}"
+        end
+
+        segments = _extract_segments(bin_path, format)
+        jobs     = _extract_jobs(segments)
+        total    = segments.sum {|seg| seg[:frames] * seg[:bytes] }
+        written  = 0
+        started  = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        files    = {}
+        buffer   = nil
+        current  = nil
+
+        flush    = ->() {
+            files[current] ||= File.open(current, 'wb')
+            files[current].write(buffer)
+            buffer.clear
+        }
+
+        work     = ->(chd, (seg, first, count)) {
+            _extract_frames(chd, seg, first, count)
+        }
+
+        Parallel.each(@chd, jobs, threads: threads, work: work) do |data, idx|
+            path = jobs[idx][0][:path]
+            if path != current
+                flush.() if buffer
+                current, buffer = path, String.new(capacity: EXTRACT_WRITE_SIZE)
+            end
+
+            buffer << data
+            written += data.bytesize
+            flush.() if buffer.bytesize >= EXTRACT_WRITE_SIZE
+            progress&.call(written, total)
+        end
+        flush.() if buffer
+
+        # Generate the description file
+        case format
+        when :bin_cue then File.write(cue_path, _extract_cue(bin_path))
+        when :gdi     then File.write(cue_path, _extract_gdi(segments))
+        end
+
+        seconds = Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+        { :bytes      => written,
+          :frames     => segments.sum {|seg| seg[:frames] },
+          :seconds    => seconds,
+          :throughput => seconds.zero? ? nil : written / seconds,
+        }
+    ensure
+        files&.each_value(&:close)
+    end
+
+
+    private
+
+    # Description of the data to extract for each track
+    def _extract_segments(bin_path, format)
+        tracks = @toc.each_with_index.map {|trackinfo, idx|
+            [ trackinfo, @mapping[idx] ]
+        }
+
+        if format == :iso
+            tracks = [ tracks.find {|trackinfo, _| trackinfo[:trktype] != :AUDIO }]
+            if tracks.first.nil?
+                raise NotFoundError, "no data track found"
+            end
+        end
+
+        tracks.map {|trackinfo, mapping|
+            tracktype      = trackinfo[:trktype]
+            offset, length = format == :iso ? CD.conversion(tracktype, :MODE1)
+                                            : [ 0, trackinfo[:datasize] ]
+            subsize = format == :iso ? 0 : trackinfo[:subsize]
+            path    = if format == :gdi
+                          ext  = tracktype == :AUDIO ? '.raw' : '.bin'
+                          base = bin_path.delete_suffix(File.extname(bin_path))
+                          "%s%02d%s" % [ base, trackinfo[:track], ext ]
+                      else
+                          bin_path
+                      end
+
+            { :trackinfo => trackinfo,
+              :path      => path,
+              :first     => mapping[:chdframeofs],
+              :frames    => trackinfo[:frames],
+              :offset    => offset,
+              :length    => length,
+              :subsize   => subsize,
+              :swap      => tracktype == :AUDIO,
+              :bytes     => length + subsize,
+            }
+        }
+    end
+
+    # Split the segments in jobs of whole hunks
+    def _extract_jobs(segments)
+        frames_per_hunk = @chd.hunk_bytes / FRAME_SIZE
+        chunk           = [ EXTRACT_CHUNK_SIZE / @chd.hunk_bytes, 1 ].max *
+                          frames_per_hunk
+
+        segments.flat_map {|seg|
+            jobs  = []
+            first = seg[:first]
+            last  = seg[:first] + seg[:frames]
+            while first < last
+                count = [ (first / chunk + 1) * chunk, last ].min - first
+                jobs << [ seg, first, count ]
+                first += count
+            end
+            jobs
+        }
+    end
+
+    # Gather the frames data (and subcode) of a job, decoding each
+    # hunk once (the subcode is at the end of the frame)
+    def _extract_frames(chd, seg, first, count)
+        chd.read_units(first, count, offset: seg[:offset],
+                                     length: seg[:length],
+                                     tail:   seg[:subsize],
+                                     swap:   seg[:swap])
+    end
+
+    # Generate CUE sheet (single BIN file)
+    def _extract_cue(bin_path)
+        frameofs = 0
+        cue      = "FILE \"#{File.basename(bin_path)}\" BINARY\n"
+        @toc.each do |trackinfo|
+            pregap  = trackinfo[:pregap]
+            infile  = ! trackinfo[:pgdatasize].zero?
+
+            cue << "  TRACK %02d %s\n" % [
+                       trackinfo[:track], CUE_TRACK_TYPES[trackinfo[:trktype]] ]
+            if pregap > 0
+                cue << (infile ? "    INDEX 00 %s\n" % [ CHD.msf(frameofs) ]
+                               : "    PREGAP %s\n"   % [ CHD.msf(pregap)   ])
+            end
+            cue << "    INDEX 01 %s\n" % [
+                       CHD.msf(frameofs + (infile ? pregap : 0)) ]
+            if trackinfo[:postgap] > 0
+                cue << "    POSTGAP %s\n" % [ CHD.msf(trackinfo[:postgap]) ]
+            end
+
+            frameofs += trackinfo[:frames]
+        end
+        cue
+    end
+
+    # Generate GDI description
+    def _extract_gdi(segments)
+        frameofs = 0
+        gdi      = "#{segments.size}\n"
+        segments.each do |seg|
+            trackinfo = seg[:trackinfo]
+            gdi << "%d %d %d %d %s %d\n" % [
+                       trackinfo[:track], frameofs,
+                       trackinfo[:trktype] == :AUDIO ? 0 : 4,
+                       trackinfo[:datasize], File.basename(seg[:path]), 0 ]
+            frameofs += trackinfo[:frames] + trackinfo[:padframes]
+        end
+        gdi
+    end
+end
+end
@@ -0,0 +1,391 @@
+class CHD
+class CD
+
+    # Filesystem of the data track (see {Filesystem}).
+    #
+    # The index is built on first use, and kept.
+    #
+    # @return [Filesystem]
+    #
+    def filesystem
+        @filesystem ||= Filesystem.new(self)
+    end
+
+
+#
+# Read-only access to the ISO9660 filesystem of a CD-ROM.
+#
+# The directories are enumerated from the path table, and their
+# records are read once to build a path → extent index, so that
+# a file is read as runs of consecutive sectors (see {CD#read_sectors})
+# without walking the directory tree again.
+#
+# Joliet names are used when a Joliet volume descriptor is present.
+# UDF is not supported: UDF discs are accessed through their ISO9660
+# bridge, if any.
+#
+# Lookups are case-insensitive, version suffixes (`;1`) are ignored.
+#
+# @note Sector numbers (of the volume descriptors, path table,
+#       and extents) are relative to the start of the first data
+#       track, as in an ISO image of that track: a pregap, stored
+#       or not, is not part of the filesystem.
+#
+# @example
+#   fs = CHD::CD.new(CHD.new('game.chd')).filesystem
+#   fs.each {|entry| puts entry.path unless entry.directory? }
+#   fs.read_file('/MANUAL/MANUAL.PDF')
+#
+class Filesystem
+    include Enumerable
+
+    # Logical sector size
+    SECTOR_SIZE        = 2048
+
+    # Sector of the first volume descriptor
+    VOLUME_DESCRIPTORS = 16
+
+    # Number of sectors read at once from a file ({Reader})
+    READ_SECTORS       = 64
+
+    # Joliet escape sequences (UCS-2 level 1, 2, and 3)
+    JOLIET_ESCAPES     = [ '%/@', '%/C', '%/E' ].freeze
+
+    # Directory record flags
+    FLAG_HIDDEN        = 0x01
+    FLAG_DIRECTORY     = 0x02
+    FLAG_MULTI_EXTENT  = 0x80
+
+    private_constant :FLAG_HIDDEN, :FLAG_DIRECTORY, :FLAG_MULTI_EXTENT
+
+    #
+    # Indexed file or directory.
+    #
+    # @!attribute [r] path
+    #   @return [String]  absolute path (`/` separated)
+    # @!attribute [r] size
+    #   @return [Integer] size in bytes
+    # @!attribute [r] extents
+    #   @return [Array<Array(Integer, Integer)>] sector and size in bytes
+    #                                            of each extent
+    # @!attribute [r] flags
+    #   @return [Integer] ISO9660 file flags
+    #
+    Entry = Struct.new(:path, :size, :extents, :flags) do
+        # Is it a directory?
+        def directory? ; (flags & FLAG_DIRECTORY) != 0 ; end
+
+        # Is it hidden?
+        def hidden?    ; (flags & FLAG_HIDDEN   ) != 0 ; end
+    end
+
+
+    # Parse the volume descriptors, and index the filesystem.
+    #
+    # @param cd [CD] CD-ROM
+    #
+    # @raise [NotFoundError] if no data track or no ISO9660 filesystem
+    #                        is found
+    #
+    def initialize(cd)
+        @cd    = cd
+        track  = cd.toc.find {|trackinfo| trackinfo[:trktype] != :AUDIO }
+        raise NotFoundError, "no data track found" if track.nil?
+        @start = cd.track_start(track[:track])
+
+        primary, joliet = _volume_descriptors
+        @type           = joliet ? :joliet : :iso9660
+        @volume_id      = primary[40, 32].strip
+        @index          = _build_index(joliet || primary)
+    end
+
+    # Type of the filesystem (`:iso9660` or `:joliet`)
+    #
+    # @return [Symbol]
+    #
+    attr_reader :type
+
+    # Volume identifier
+    #
+    # @return [String]
+    #
+    attr_reader :volume_id
+
+    # Retrieve an entry.
+    #
+    # @param path [String] path of the file or directory
+    #
+    # @return [Entry, nil]
+    #
+    def entry(path)
+        @index[_key(path)]
+    end
+
+    # Does the file or directory exist?
+    #
+    # @param path [String] path of the file or directory
+    #
+    def exist?(path)
+        @index.key?(_key(path))
+    end
+
+    # Iterate over the entries (in directory order).
+    #
+    # @yieldparam entry [Entry]
+    #
+    # @return [Enumerator] if no block given
+    #
+    def each(&block)
+        return enum_for(:each) unless block_given?
+        @index.each_value(&block)
+        self
+    end
+
+    # Read the content of a file.
+    #
+    # The sectors of each extent are read as a single run.
+    #
+    # @param file   [String, Entry] path or entry of the file
+    # @param offset [Integer]       offset in the file
+    # @param length [Integer, nil]  number of bytes (nil: up to the end)
+    #
+    # @raise [NotFoundError] if there is no such file
+    #
+    # @return [String]
+    #
+    def read_file(file, offset = 0, length = nil)
+        entry  = file.kind_of?(Entry) ? file : _file(file)
+        offset = offset.clamp(0, entry.size)
+        length = [ length || entry.size, entry.size - offset ].min
+        data   = String.new(capacity: length, encoding: Encoding::BINARY)
+        entry.extents.each do |lba, size|
+            break if length <= 0
+            if offset >= size
+                offset -= size
+                next
+            end
+            chunk   = [ length, size - offset ].min
+            data   << _read(lba, offset, chunk)
+            length -= chunk
+            offset  = 0
+        end
+        data
+    end
+
+    # Open a file for reading.
+    #
+    # If the optional code block is given, it will be passed the reader,
+    # and its value returned.
+    #
+    # @param path [String] path of the file
+    #
+    # @raise [NotFoundError] if there is no such file
+    #
+    # @yieldparam reader [Reader]
+    #
+    # @return [Reader]
+    #
+    def open_file(path)
+        reader = Reader.new(self, _file(path))
+        block_given? ? yield(reader) : reader
+    end
+
+
+    #
+    # Sequential reader of a file, reading consecutive sectors
+    # by batches.
+    #
+    class Reader
+        # @!visibility private
+        def initialize(fs, entry)
+            @fs, @entry, @pos = fs, entry, 0
+        end
+
+        # Indexed entry
+        #
+        # @return [Entry]
+        #
+        attr_reader :entry
+
+        # Current position
+        #
+        # @return [Integer]
+        #
+        attr_accessor :pos
+
+        # Size of the file
+        #
+        # @return [Integer]
+        #
+        def size
+            @entry.size
+        end
+
+        # End of file reached?
+        def eof?
+            @pos >= size
+        end
+
+        # Move to the beginning of the file
+        def rewind
+            @pos = 0
+        end
+
+        # Read at most length bytes (or up to the end of the file).
+        #
+        # @param length [Integer, nil] number of bytes
+        # @param outbuf [String, nil]  string receiving the data
+        #
+        # @return [String] data read
+        # @return [nil]    at end of file, if length was given
+        #
+        def read(length = nil, outbuf = nil)
+            return (length.nil? ? String.new : nil) if eof? && length != 0
+            length = [ length || size, size - @pos ].min
+            data   = @fs.read_file(@entry, @pos, length)
+            @pos  += data.bytesize
+            outbuf ? outbuf.replace(data) : data
+        end
+
+        # Iterate over the content by chunks.
+        #
+        # @param chunk [Integer] chunk size
+        #
+        # @yieldparam data [String]
+        #
+        def each_chunk(chunk = READ_SECTORS * SECTOR_SIZE)
+            return enum_for(:each_chunk, chunk) unless block_given?
+            while data = read(chunk)
+                yield(data)
+            end
+        end
+
+        # Nothing to release (compatibility with IO)
+        def close
+        end
+    end
+
+
+    private
+
+    # Primary and Joliet (if any) volume descriptors
+    def _volume_descriptors
+        primary = joliet = nil
+        (VOLUME_DESCRIPTORS ..).each do |lba|
+            vd = _read(lba, 0, SECTOR_SIZE)
+            break if vd[1, 5] != 'CD001'
+            case vd.getbyte(0)
+            when 1   then primary ||= vd
+            when 2   then joliet  ||= vd if JOLIET_ESCAPES.include?(vd[88, 3])
+            when 255 then break
+            end
+        end
+        raise NotFoundError, "no ISO9660 filesystem found" if primary.nil?
+        [ primary, joliet ]
+    end
+
+    # Build the index from the path table and the directory records
+    def _build_index(vd)
+        @joliet  = vd.getbyte(0) == 2
+        size     = vd[132, 4].unpack1('V')
+        lba      = vd[140, 4].unpack1('V')
+        table    = _read(lba, 0, size)
+
+        # Directories, as listed in the path table
+        # (parent directories are listed first)
+        dirs     = []
+        offset   = 0
+        while offset + 8 <= table.bytesize
+            len, extent, parent = table.unpack('CxVv', offset: offset)
+            name    = table[offset + 8, len]
+            path    = dirs.empty? ? '' : "#{dirs[parent - 1][0]}/#{_decode(name)}"
+            dirs   << [ path, extent ]
+            offset += 8 + len + (len & 1)
+        end
+
+        # Entries of each directory
+        # (the root is described in the volume descriptor)
+        extent, size = vd.unpack('x158Vx4V')
+        index    = { '/' => Entry.new('/', size, [ [ extent, size ] ],
+                                      FLAG_DIRECTORY) }
+        dirs.each do |path, extent|
+            _directory(path, extent).each do |entry|
+                key = _key(entry.path)
+                if (prev = index[key]) && (prev.flags & FLAG_MULTI_EXTENT) != 0
+                    prev.extents.concat(entry.extents)
+                    prev.size  += entry.size
+                    prev.flags  = entry.flags
+                else
+                    index[key] = entry
+                end
+            end
+        end
+        index.each_value(&:freeze)
+        index.freeze
+    end
+
+    # Entries of a directory (the "." record gives the directory size)
+    def _directory(path, extent)
+        first   = _read(extent, 0, SECTOR_SIZE)
+        size    = first[10, 4].unpack1('V')
+        data    = size > SECTOR_SIZE ? _read(extent, 0, size) : first
+        entries = []
+        offset  = 0
+        while offset < data.bytesize
+            len = data.getbyte(offset)
+            if len.zero?   # records don't cross sector boundaries
+                offset = (offset / SECTOR_SIZE + 1) * SECTOR_SIZE
+                next
+            end
+            lba, size = data.unpack('x2Vx4V', offset: offset)
+            flags     = data.getbyte(offset + 25)
+            namelen   = data.getbyte(offset + 32)
+            name      = data[offset + 33, namelen]
+            offset   += len
+            next if (namelen == 1) && (name.getbyte(0) <= 1)   # . and ..
+
+            entries << Entry.new("#{path}/#{_decode(name)}", size,
+                                 [ [ lba, size ] ], flags)
+        end
+        entries
+    end
+
+    # Decode a file identifier (dropping the version suffix)
+    def _decode(name)
+        name = if @joliet
+                   name.dup.force_encoding(Encoding::UTF_16BE)
+                       .encode(Encoding::UTF_8, invalid: :replace,
+                                                undef:   :replace)
+               else
+                   name.dup.force_encoding(Encoding::UTF_8).scrub
+               end
+        name.sub(/;\d*\z/, '').then {|n| n.end_with?('.') ? n.chop : n }
+    end
+
+    # Index key of a path
+    def _key(path)
+        path = "/#{path}".squeeze('/').chomp('/').sub(/;\d*\z/, '')
+        path.empty? ? '/' : path.downcase
+    end
+
+    def _file(path)
+        entry = entry(path)
+        if entry.nil? || entry.directory?
+            raise NotFoundError, "no such file (#{path})"
+        end
+        entry
+    end
+
+    # Read bytes of an extent, as a run of consecutive sectors
+    # (lba is relative to the start of the data track)
+    def _read(lba, offset, length)
+        return String.new if length <= 0
+        first = offset / SECTOR_SIZE
+        count = (offset + length + SECTOR_SIZE - 1) / SECTOR_SIZE - first
+        @cd.read_sectors(@start + lba + first, count, :MODE1)
+           .byteslice(offset % SECTOR_SIZE, length)
+    end
+end
+
+end
+end
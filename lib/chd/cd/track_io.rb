@@ -0,0 +1,250 @@
+class CHD
+class CD
+
+    # IO-like access to the user data of a track (see {TrackIO}).
+    #
+    # @param track    [Integer]     track number (start at 1)
+    # @param datatype [Symbol, nil] type of data (nil: as stored)
+    #
+    # @return [TrackIO]
+    #
+    def track_io(track, datatype: :MODE1)
+        TrackIO.new(self, track, datatype)
+    end
+
+
+#
+# Read-only IO-like view of a track, as a contiguous stream of the
+# sector data of the requested type (for example, the 2048 bytes of
+# user data of MODE1 sectors, without sync, header, EDC/ECC, and
+# subcode).
+#
+# Byte offsets are translated to sectors of the track (starting at
+# its index 1), which are read by batches of consecutive sectors
+# (see {CD#read_sectors}), so that each hunk is decoded and stripped
+# once for sequential reads. The last batch is kept for the
+# following reads.
+#
+# It is usable where a readable IO is expected (`IO.copy_stream`,
+# `Zlib::GzipReader`, ...).
+#
+# @note As IO, a TrackIO is not meant to be shared between threads.
+#
+# @example
+#   cd = CHD::CD.new(CHD.new('game.chd'))
+#   io = cd.track_io(1)
+#   io.seek(16 * 2048)
+#   io.read(2048)                          # primary volume descriptor
+#   IO.copy_stream(io.tap(&:rewind), 'track01.iso')
+#
+class TrackIO
+    # Minimum number of sectors read at once
+    READ_SECTORS = 64
+
+    # @!visibility private
+    def initialize(cd, track, datatype = :MODE1)
+        start     = cd.track_start(track)
+        trackinfo = cd.toc[track - 1]
+        _, @sector_size, promote = CD.conversion(trackinfo[:trktype], datatype)
+        if promote
+            raise NotSupportedError,
+                  "conversion from type %s to type %s not supported" % [
+                      trackinfo[:trktype], datatype ]
+        end
+
+        @cd       = cd
+        @track    = track
+        @datatype = datatype
+        @start    = start
+        @sectors  = trackinfo[:frames]
+        @sectors -= trackinfo[:pregap] unless trackinfo[:pgdatasize].zero?
+        @size     = @sectors * @sector_size
+        @pos      = 0
+        @batch    = nil
+        @closed   = false
+    end
+
+    # Track number
+    #
+    # @return [Integer]
+    #
+    attr_reader :track
+
+    # Number of bytes of each sector
+    #
+    # @return [Integer]
+    #
+    attr_reader :sector_size
+
+    # Size of the track data
+    #
+    # @return [Integer]
+    #
+    attr_reader :size
+
+    # Current position
+    #
+    # @return [Integer]
+    #
+    attr_reader :pos
+    alias tell pos
+
+    # Set the current position.
+    #
+    # @param offset [Integer] position (can be beyond the end)
+    #
+    def pos=(offset)
+        seek(offset)
+    end
+
+    # Move to the given position.
+    #
+    # @param offset [Integer]
+    # @param whence [Integer, Symbol] `IO::SEEK_SET`, `IO::SEEK_CUR`,
+    #                                 or `IO::SEEK_END` (or `:SET`, ...)
+    #
+    # @raise [Errno::EINVAL] if the resulting position is negative
+    #
+    # @return [0]
+    #
+    def seek(offset, whence = IO::SEEK_SET)
+        _ensure_opened
+        base = case whence
+               when IO::SEEK_SET, :SET then 0
+               when IO::SEEK_CUR, :CUR then @pos
+               when IO::SEEK_END, :END then @size
+               else raise ArgumentError, "unknown whence (#{whence})"
+               end
+        raise Errno::EINVAL, "negative position" if base + offset < 0
+        @pos = base + offset
+        0
+    end
+
+    # Move to the beginning of the track.
+    #
+    # @return [0]
+    #
+    def rewind
+        seek(0)
+    end
+
+    # End of track reached?
+    def eof?
+        _ensure_opened
+        @pos >= @size
+    end
+    alias eof eof?
+
+    # Read at most length bytes (or up to the end of the track),
+    # as IO#read.
+    #
+    # @param length [Integer, nil] number of bytes
+    # @param outbuf [String, nil]  string receiving the data
+    #
+    # @return [String] data read
+    # @return [nil]    at end of track, if a length was given
+    #
+    def read(length = nil, outbuf = nil)
+        _ensure_opened
+        raise ArgumentError, "negative length #{length} given" if
+            length&.negative?
+
+        remaining = [ @size - @pos, 0 ].max
+        if remaining.zero? && length&.positive?
+            outbuf&.clear
+            return nil
+        end
+
+        data  = _read(@pos, [ length || remaining, remaining ].min)
+        @pos += data.bytesize
+        outbuf ? outbuf.replace(data) : data
+    end
+
+    # Read at most maxlen bytes, as IO#readpartial.
+    #
+    # @param maxlen [Integer]     number of bytes
+    # @param outbuf [String, nil] string receiving the data
+    #
+    # @raise [EOFError] at end of track
+    #
+    # @return [String]
+    #
+    def readpartial(maxlen, outbuf = nil)
+        read(maxlen, outbuf) or raise EOFError, "end of file reached"
+    end
+
+    # Read at most length bytes from the given offset, without
+    # changing the current position, as IO#pread.
+    #
+    # @param length [Integer]     number of bytes
+    # @param offset [Integer]     offset in the track data
+    # @param outbuf [String, nil] string receiving the data
+    #
+    # @raise [EOFError] if offset is at or beyond the end of track
+    #
+    # @return [String]
+    #
+    def pread(length, offset, outbuf = nil)
+        _ensure_opened
+        raise ArgumentError, "negative length #{length} given" if
+            length.negative?
+        raise Errno::EINVAL, "negative offset" if offset.negative?
+        return (outbuf ? outbuf.clear : String.new) if length.zero?
+        raise EOFError, "end of file reached"   if offset >= @size
+
+        data = _read(offset, [ length, @size - offset ].min)
+        outbuf ? outbuf.replace(data) : data
+    end
+
+    # Release the kept data (the CD is not closed).
+    #
+    # @return [nil]
+    #
+    def close
+        @batch  = nil
+        @closed = true
+        nil
+    end
+
+    # Is it closed?
+    def closed?
+        @closed
+    end
+
+
+    private
+
+    def _ensure_opened
+        raise ::IOError, "closed stream" if @closed
+    end
+
+    # Read length bytes at offset (inside the track)
+    def _read(offset, length)
+        data = String.new(capacity: length, encoding: Encoding::BINARY)
+        while length > 0
+            sector, skip = offset.divmod(@sector_size)
+
+            # Read a new batch of consecutive sectors
+            # (at least those required, up to the end of the track)
+            unless @batch && (sector >= @batch_first) &&
+                   (sector <  @batch_first + @batch.bytesize / @sector_size)
+                needed       = (skip + length + @sector_size - 1) / @sector_size
+                count        = [ [ needed, READ_SECTORS ].max,
+                                 @sectors - sector ].min
+                @batch       = @cd.read_sectors(@start + sector, count,
+                                                @datatype)
+                @batch_first = sector
+            end
+
+            boffset = (sector - @batch_first) * @sector_size + skip
+            chunk   = [ length, @batch.bytesize - boffset ].min
+            data   << @batch.byteslice(boffset, chunk)
+            offset += chunk
+            length -= chunk
+        end
+        data
+    end
+end
+
+end
+end
@@ -0,0 +1,125 @@
+class CHD
+    # Compare with another revision of the CHD file, and report the hunks
+    # that differ.
+    #
+    # The hunk maps are compared first, so that most of the hunks are
+    # classified without being decoded:
+    # * different CRC-16 of the decoded hunks: hunks differ
+    # * references to the same unit of the same parent: hunks are equal
+    # * references (self) to the same hunk known to be equal: hunks are equal
+    # * same codec, length, and CRC-16: the stored bytes are compared,
+    #   if identical hunks are equal
+    #
+    # Only the remaining hunks are decoded and compared, using several
+    # threads if the CHD files were opened from a path.
+    #
+    # @note Only CHD version 5 are supported.
+    #
+    # @param other   [CHD]     other revision of the CHD file
+    # @param threads [Integer] number of threads used for decoding
+    #
+    # @raise [ArgumentError] if hunks are not of the same size
+    #
+    # @return [Hash{Symbol => Object}] result of the comparison:
+    #   * `:ranges`           : ranges of differing hunks
+    #   * `:hunks`            : number of differing hunks
+    #   * `:bytes`            : number of bytes in the differing hunks
+    #   * `:compressed_bytes` : number of bytes stored in this file
+    #                           for the differing hunks
+    #   * `:decoded`          : number of hunks that needed to be decoded
+    #
+    # @example
+    #   CHD.new('v2.chd').diff(CHD.new('v1.chd'))[:ranges]
+    #   # => [ 12..15, 1024..1024 ]
+    #
+    def diff(other, threads: Parallel.threads)
+        if hunk_bytes != other.hunk_bytes
+            raise ArgumentError, "hunks must be of the same size"
+        end
+
+        maps    = [ self, other ].map {|chd| HunkMap.new(chd) }
+        count   = [ hunk_count, other.hunk_count ].min
+        same    = Array.new(count, false)
+        differ  = (count ... [ hunk_count, other.hunk_count ].max).to_a
+        jobs    = []
+
+        count.times do |idx|
+            a, b = maps.map {|map| map.resolve(idx) }
+            case _diff_classify(maps, a, b, same)
+            when :same   then same[idx] = true
+            when :differ then differ << idx
+            else              jobs << [ idx, a, b ]
+            end
+        end
+
+        # Compare stored bytes (if possibly identical), or decoded hunks
+        work    = ->((mine, theirs), (idx, a, b)) {
+            if _diff_stored?(maps, a, b)
+                x, y = [ [ mine, a ], [ theirs, b ] ].map {|chd, entry|
+                    chd.read_compressed_hunk(entry.hunk)[:data]
+                }
+                next [ x == y, false ] if (x == y) || (a.type == HunkMap::NONE)
+            end
+            [ mine.read_hunk(idx) == theirs.read_hunk(idx), true ]
+        }
+        decoded = 0
+        Parallel.each([ self, other ], jobs, threads: threads,
+                      ordered: false, work: work) do |(equal, dec), index|
+            idx      = jobs[index][0]
+            decoded += 1 if dec
+            equal ? same[idx] = true : differ << idx
+        end
+
+        # Summarize
+        differ.sort!
+        ranges  = differ.slice_when {|i, j| j != i + 1 }
+                        .map {|list| list.first .. list.last }
+        stored  = differ.sum {|idx|
+            idx < hunk_count ? maps[0].resolve(idx).length : 0
+        }
+
+        { :ranges           => ranges,
+          :hunks            => differ.size,
+          :bytes            => differ.size * hunk_bytes,
+          :compressed_bytes => stored,
+          :decoded          => decoded,
+        }
+    end
+
+
+    private
+
+    # Classify from the map entries: :same, :differ, or nil (unknown)
+    def _diff_classify(maps, a, b, same)
+        # Copies of the same hunk, known to be equal
+        if (a.hunk == b.hunk) && same[a.hunk]
+            return :same
+        end
+
+        # Same unit of the same parent
+        if (a.type == HunkMap::PARENT) && (b.type == HunkMap::PARENT)
+            parent = maps[0].parent
+            return :same if parent                  &&
+                            parent == maps[1].parent &&
+                            a.offset == b.offset
+            return nil
+        end
+
+        # Decoded data CRC (not available for uncompressed CHD)
+        if a.stored? && b.stored? &&
+           ! maps[0].codecs.empty? && ! maps[1].codecs.empty? &&
+           (a.crc16 != b.crc16)
+            return :differ
+        end
+
+        nil
+    end
+
+    # Are the stored bytes worth comparing?
+    def _diff_stored?(maps, a, b)
+        return false unless a.stored? && b.stored?
+        return false unless a.length == b.length
+        return true  if     (a.type == HunkMap::NONE) && (b.type == HunkMap::NONE)
+        maps[0].type_name(a.type) == maps[1].type_name(b.type)
+    end
+end
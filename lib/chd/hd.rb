@@ -0,0 +1,161 @@
+class CHD
+
+#
+# Access a hard disk in Mame CHD format
+#
+class HD
+    # Read the hard disk geometry.
+    #
+    # @param chd [CHD] a chd opened file
+    #
+    # @raise [NotFoundError] if the CHD file is not of a hard disk type
+    # @raise [ParsingError]  if the geometry is not consistent
+    #                        with the CHD file
+    #
+    # @return [Hash{Symbol => Integer}] geometry (`:cyls`, `:heads`,
+    #                                   `:secs`, `:bps`)
+    #
+    def self.read_geometry(chd)
+        unless md = chd.get_metadata(0, Metadata::HARD_DISK)
+            raise NotFoundError, "provided CHD is not a hard disk"
+        end
+
+        geometry = Metadata.parse(*md)
+        bps      = geometry[:bps]
+        if (chd.hunk_bytes % bps != 0) || (chd.unit_bytes != bps)
+            raise ParsingError, "sector size doesn't match hunk/unit size"
+        end
+        if geometry.values_at(:cyls, :heads, :secs, :bps).inject(:*) >
+           chd.header[:logical_bytes]
+            raise ParsingError, "geometry exceeds logical size"
+        end
+        geometry
+    end
+
+
+    # @param chd      [CHD]                    a chd opened file
+    # @param geometry [Hash{Symbol => Integer}] previously read geometry
+    #                                           (see {HD.read_geometry},
+    #                                           {Index#geometry})
+    #
+    def initialize(chd, geometry: nil)
+        @chd      = chd
+        @geometry = geometry || HD.read_geometry(chd)
+        @sectors  = @geometry.values_at(:cyls, :heads, :secs).inject(:*)
+    end
+
+    # Hard disk geometry
+    #
+    # @return [Hash{Symbol => Integer}]
+    #
+    attr_reader :geometry
+
+    # Number of cylinders
+    #
+    # @return [Integer]
+    #
+    def cylinders
+        @geometry[:cyls]
+    end
+
+    # Number of heads
+    #
+    # @return [Integer]
+    #
+    def heads
+        @geometry[:heads]
+    end
+
+    # Number of sectors per track
+    #
+    # @return [Integer]
+    #
+    def sectors_per_track
+        @geometry[:secs]
+    end
+
+    # Sector size in bytes
+    #
+    # @return [Integer]
+    #
+    def sector_bytes
+        @geometry[:bps]
+    end
+
+    # Number of sectors
+    #
+    # @return [Integer]
+    #
+    attr_reader :sectors
+
+    # Size of the hard disk in bytes
+    #
+    # @return [Integer]
+    #
+    def size
+        @sectors * sector_bytes
+    end
+
+    # Convert CHS address to LBA.
+    #
+    # @param cylinder [Integer] cylinder (start at 0)
+    # @param head     [Integer] head (start at 0)
+    # @param sector   [Integer] sector (start at 1)
+    #
+    # @return [Integer] logical block address
+    #
+    def lba(cylinder, head, sector)
+        (cylinder * heads + head) * sectors_per_track + sector - 1
+    end
+
+    # Read a sector.
+    #
+    # @param lba [Integer] logical block address (start at 0)
+    #
+    # @raise [RangeError] if the requested sector doesn't exist
+    #
+    # @return [String]
+    #
+    def read_sector(lba)
+        read_sectors(lba, 1)
+    end
+
+    # Read consecutive sectors.
+    #
+    # Sectors covering whole hunks are decoded directly in the returned
+    # string, only the partial hunks at both ends go through the hunk
+    # cache.
+    #
+    # @param lba   [Integer] logical block address (start at 0)
+    # @param count [Integer] number of sectors
+    #
+    # @raise [RangeError] if the requested sectors don't exist
+    #
+    # @return [String]
+    #
+    def read_sectors(lba, count)
+        read_sectors_into(String.new, lba, count)
+    end
+
+    # Read consecutive sectors in an existing buffer.
+    #
+    # The buffer content is replaced by the sectors data, which allows
+    # reusing the same buffer (and its allocated memory) across calls.
+    #
+    # @param buffer [String]  buffer receiving the sectors data
+    # @param lba    [Integer] logical block address (start at 0)
+    # @param count  [Integer] number of sectors
+    #
+    # @raise [RangeError] if the requested sectors don't exist
+    #
+    # @return [String] the buffer
+    #
+    def read_sectors_into(buffer, lba, count)
+        if (lba < 0) || (count < 0) || (lba + count > @sectors)
+            raise RangeError, "sectors are out of range (0..#{@sectors - 1})"
+        end
+        @chd.read_bytes(lba * sector_bytes, count * sector_bytes, buffer)
+    end
+end
+
+end
@@ -0,0 +1,136 @@
+class CHD
+
+#
+# Decoded V5 hunk map (see {CHD#hunk_map}), with the codecs and the
+# parent needed to interpret its entries.
+#
+# @example
+#   map = CHD::HunkMap.new(chd)
+#   map.resolve(42)               # => #<struct CHD::HunkMap::Entry ...>
+#   map.count {|entry| entry.type == CHD::HunkMap::PARENT }
+#
+class HunkMap
+    include Enumerable
+
+    # Size of a map entry
+    ENTRY_BYTES = 12
+
+    # Hunk stored uncompressed (types below are compressed hunks,
+    # the type being the index of the codec)
+    NONE        = 4
+
+    # Copy of another hunk of the CHD (offset is the hunk index)
+    SELF        = 5
+
+    # Hunk of the parent (offset is the unit index in the parent)
+    PARENT      = 6
+
+    # Names of the hunk types which are not codecs
+    TYPES       = { NONE => :none, SELF => :self, PARENT => :parent }.freeze
+
+    #
+    # Map entry.
+    #
+    # @!attribute [r] hunk
+    #   @return [Integer] hunk index
+    # @!attribute [r] type
+    #   @return [Integer] hunk type (codec index, {NONE}, {SELF},
+    #                     or {PARENT})
+    # @!attribute [r] length
+    #   @return [Integer] number of bytes stored in the file
+    # @!attribute [r] offset
+    #   @return [Integer] position in the file, hunk index (self),
+    #                     or unit index (parent)
+    # @!attribute [r] crc16
+    #   @return [Integer] CRC-16 of the decoded hunk (0 for an
+    #                     uncompressed CHD)
+    #
+    Entry = Struct.new(:hunk, :type, :length, :offset, :crc16) do
+        # Is the hunk data stored in the file (compressed or not)?
+        def stored?     ; type <= NONE ; end
+
+        # Is the hunk data compressed?
+        def compressed? ; type <  NONE ; end
+    end
+
+
+    # @param chd [CHD] CHD file
+    #
+    # @raise [NotSupportedError] if the CHD is not version 5
+    #
+    def initialize(chd)
+        @map    = chd.hunk_map
+        @codecs = chd.header[:compression] || []
+        @parent = chd.header.dig(:parent, :sha1)
+    end
+
+    # Codecs of the compressed hunks (empty for an uncompressed CHD)
+    #
+    # @return [Array<String>]
+    #
+    attr_reader :codecs
+
+    # SHA-1 of the parent
+    #
+    # @return [String, nil]
+    #
+    attr_reader :parent
+
+    # Number of entries
+    #
+    # @return [Integer]
+    #
+    def size
+        @map.bytesize / ENTRY_BYTES
+    end
+
+    # Map entry of a hunk, as stored.
+    #
+    # @param idx [Integer] hunk index
+    #
+    # @return [Entry]
+    #
+    def [](idx)
+        type, lhi, llo, ohi, olo, crc =
+            @map.unpack('CCnnNn', offset: idx * ENTRY_BYTES)
+        Entry.new(idx, type, (lhi << 16) | llo, (ohi << 32) | olo, crc)
+    end
+
+    # Map entry of a hunk, following the self references
+    # (the entry's hunk is the one holding the data).
+    #
+    # @param idx [Integer] hunk index
+    #
+    # @return [Entry]
+    #
+    def resolve(idx)
+        entry = self[idx]
+        entry = self[entry.offset] while (entry.type == SELF) &&
+                                         (entry.offset < entry.hunk)
+        entry
+    end
+
+    # Name of a hunk type: codec name, or one of {TYPES}.
+    #
+    # @param type [Integer]
+    #
+    # @return [String, Symbol]
+    #
+    def type_name(type)
+        TYPES[type] || @codecs[type]
+    end
+
+    # Iterate over the entries, as stored.
+    #
+    # @yieldparam entry [Entry]
+    #
+    # @return [Enumerator] if no block given
+    #
+    def each
+        return enum_for(:each) unless block_given?
+        size.times {|idx| yield self[idx] }
+        self
+    end
+end
+
+end
@@ -0,0 +1,266 @@
+require 'digest/sha1'
+require 'fileutils'
+
+class CHD
+
+#
+# Persistent index of a CHD file, saved in a sidecar file (next to
+# the CHD file, or in a cache directory), so that the information
+# requiring to read and parse the file is immediately available when
+# it is reopened:
+# * header and metadata
+# * CD-ROM table of content (see {CD.read_toc}) or hard disk geometry
+#   (see {HD.read_geometry})
+# * summary of the hunk map (CHD version 5)
+# * result of the last verification (see {CHD#verify})
+#
+# The index is keyed by the size, modification time, and header
+# digest of the CHD file, it is ignored as soon as one of them changes.
+#
+# @note The index is saved using Marshal, and so must only be
+#       loaded from a trusted location.
+#
+# @example
+#   index = CHD::Index.fetch('game.chd', dir: '/var/cache/chd')
+#   index.open {|chd| CHD::CD.new(chd, toc: index.toc).read_sector(16) }
+#
+class Index
+    # Version of the index format
+    FORMAT = 1
+
+    # Suffix of index files
+    SUFFIX = '.chdidx'
+
+    # Path of the index of a CHD file.
+    #
+    # Without a cache directory, the index is next to the CHD file,
+    # otherwise it is named after the digest of the absolute path.
+    #
+    # @param path [String]      path of the CHD file
+    # @param dir  [String, nil] cache directory
+    #
+    # @return [String]
+    #
+    def self.path_for(path, dir: nil)
+        if dir
+            File.join(dir, Digest::SHA1.hexdigest(File.expand_path(path)) +
+                           SUFFIX)
+        else
+            path + SUFFIX
+        end
+    end
+
+    # Key identifying the state of a CHD file (size, modification
+    # time, and header digest).
+    #
+    # @param path [String] path of the CHD file
+    #
+    # @return [Array]
+    #
+    def self.key(path)
+        stat   = File.stat(path)
+        header = CHD.header(path)
+        [ stat.size, stat.mtime.to_i, stat.mtime.nsec,
+          header[:sha1] || header[:md5] ]
+    end
+
+    # Load the index of a CHD file.
+    #
+    # @param path [String]      path of the CHD file
+    # @param dir  [String, nil] cache directory
+    #
+    # @return [Index] index
+    # @return [nil]   if missing, unreadable, or stale
+    #
+    def self.load(path, dir: nil)
+        key  = self.key(path)
+        data = begin
+                   Marshal.load(File.binread(path_for(path, dir: dir)))
+               rescue SystemCallError, TypeError, ArgumentError
+                   return nil
+               end
+        return nil unless data.kind_of?(Hash)     &&
+                          data[:format] == FORMAT &&
+                          data[:key]    == key
+        new(path, data, dir: dir)
+    end
+
+    # Build the index of a CHD file (it is not saved).
+    #
+    # @param path   [String]      path of the CHD file
+    # @param dir    [String, nil] cache directory
+    # @param parent [CHD, nil]    opened parent of the CHD
+    #
+    # @return [Index]
+    #
+    def self.build(path, dir: nil, parent: nil)
+        key = self.key(path)
+        CHD.open(path, parent: parent) do |chd|
+            toc      = _optional { CD.read_toc(chd)      }
+            geometry = _optional { HD.read_geometry(chd) }
+            new(path, { :format       => FORMAT,
+                        :key          => key,
+                        :header       => chd.header,
+                        :metadata     => chd.metadata,
+                        :toc          => toc,
+                        :geometry     => geometry,
+                        :map          => _map_summary(chd),
+                        :verification => nil,
+                      }, dir: dir)
+        end
+    end
+
+    # Load the index of a CHD file, or build and save it if missing
+    # or stale (failing to save it is ignored).
+    #
+    # @param path   [String]      path of the CHD file
+    # @param dir    [String, nil] cache directory
+    # @param parent [CHD, nil]    opened parent of the CHD
+    #
+    # @return [Index]
+    #
+    def self.fetch(path, dir: nil, parent: nil)
+        load(path, dir: dir) ||
+            build(path, dir: dir, parent: parent).tap {|index|
+                begin
+                    index.save
+                rescue SystemCallError
+                end
+            }
+    end
+
+    # Summary of the hunk map: number of hunks of each type,
+    # and number of bytes stored in the file
+    def self._map_summary(chd)
+        return nil if chd.version < 5
+        map    = HunkMap.new(chd)
+        hunks  = Hash.new(0)
+        stored = 0
+        map.each do |entry|
+            stored += entry.length if entry.stored?
+            hunks[map.type_name(entry.type)] += 1
+        end
+        { :hunks => Hash[hunks], :stored_bytes => stored }
+    end
+
+    # Value of the block, or nil if not applicable to the CHD
+    def self._optional
+        yield
+    rescue Error
+        nil
+    end
+    private_class_method :_map_summary, :_optional
+
+
+    # @!visibility private
+    def initialize(path, data, dir: nil)
+        @path = path
+        @dir  = dir
+        @data = data
+    end
+
+    # Path of the CHD file
+    #
+    # @return [String]
+    #
+    attr_reader :path
+
+    # Header (see {CHD#header})
+    #
+    # @return [Hash{Symbol => Object}]
+    #
+    def header
+        @data[:header]
+    end
+
+    # Metadata (see {CHD#metadata})
+    #
+    # @return [Array<Array(String, Integer, Symbol)>]
+    #
+    def metadata
+        @data[:metadata]
+    end
+
+    # Table of content and flags (to be used with {CD#initialize})
+    #
+    # @return [Array(Array<Hash{Symbol => Object}>, Set)]
+    # @return [nil] if not a CD-ROM / GD-ROM
+    #
+    def toc
+        @data[:toc]
+    end
+
+    # Hard disk geometry (to be used with {HD#initialize})
+    #
+    # @return [Hash{Symbol => Integer}]
+    # @return [nil] if not a hard disk
+    #
+    def geometry
+        @data[:geometry]
+    end
+
+    # Summary of the hunk map:
+    # * `:hunks`        : number of hunks, by codec name or by type
+    #                     (`:none`, `:self`, `:parent`)
+    # * `:stored_bytes` : number of bytes stored in the file
+    #
+    # @return [Hash{Symbol => Object}]
+    # @return [nil] if the CHD is not version 5
+    #
+    def map
+        @data[:map]
+    end
+
+    # Result of the last verification (`:result`, `:time`)
+    #
+    # @return [Hash{Symbol => Object}]
+    # @return [nil] if never verified
+    #
+    def verification
+        @data[:verification]
+    end
+
+    # Open the CHD file.
+    #
+    # @param opts [Hash] options (see {CHD.open})
+    #
+    # @yieldparam chd [CHD]
+    #
+    # @return [CHD, Object] CHD, or value returned by the block
+    #
+    def open(**opts, &block)
+        CHD.open(@path, **opts, &block)
+    end
+
+    # Verify the CHD file (see {CHD#verify}), and save the result.
+    #
+    # @param chd     [CHD, nil] opened CHD (if nil, opened from the path)
+    # @param threads [Integer]  number of threads used for decoding
+    #
+    # @return [Boolean]
+    #
+    def verify(chd = nil, threads: Parallel.threads)
+        result = chd ? chd.verify(threads: threads)
+                     : open {|c| c.verify(threads: threads) }
+        @data[:verification] = { :result => result, :time => Time.now }
+        save
+        result
+    end
+
+    # Save the index (atomically replacing the previous one).
+    #
+    # @return [self]
+    #
+    def save
+        file = Index.path_for(@path, dir: @dir)
+        tmp  = "#{file}.#{Process.pid}.#{Thread.current.object_id}"
+        FileUtils.mkdir_p(File.dirname(file))
+        File.binwrite(tmp, Marshal.dump(@data))
+        File.rename(tmp, file)
+        self
+    ensure
+        File.unlink(tmp) if tmp && File.exist?(tmp)
+    end
+end
+
+end
@@ -33,10 +33,10 @@ module Metadata
 
     private
     
-    HARD_DISK_REGEX          = /\A CYLS:      (?<cyls>%d)        ,
-                                   HEADS:     (?<heads>%d)       ,
-                                   SECS:      (?<secs>%d)        ,
-                                   BPS:       (?<bps>)%d
+    HARD_DISK_REGEX          = /\A CYLS:      (?<cyls>\d+)      ,
+                                   HEADS:     (?<heads>\d+)     ,
+                                   SECS:      (?<secs>\d+)      ,
+                                   BPS:       (?<bps>\d+)
                                 \z /x
     CDROM_TRACK_REGEX        = /\A TRACK:     (?<track>\d+)      \s+
                                    TYPE:      (?<trktype>\w+)    \s+
@@ -48,7 +48,8 @@ module Metadata
                                    SUBTYPE:   (?<subtype>\w+)    \s+
                                    FRAMES:    (?<frames>\d+)     \s+
                                    PREGAP:    (?<pregap>\d+)     \s+
-                                   PGTYPE:  V?(?<pgtype>\w+)     \s+
+                                   PGTYPE:    (?<pgvalid>V?)
+                                              (?<pgtype>\w+)     \s+
                                    PGSUB:     (?<pgsub>\w+)      \s+
                                    POSTGAP:   (?<postgap>\d+)
                                 \z /x
@@ -58,7 +59,8 @@ module Metadata
                                    FRAMES:    (?<frames>\d+)     \s+
                                    PAD:       (?<padframes>\d+)  \s+
                                    PREGAP:    (?<pregap>\d+)     \s+
-                                   PGTYPE:  V?(?<pgtype>\w+)     \s+
+                                   PGTYPE:    (?<pgvalid>V?)
+                                              (?<pgtype>\w+)     \s+
                                    PGSUB:     (?<pgsub>\w+)      \s+
                                    POSTGAP:   (?<postgap>\d+)
                                 \z /x
@@ -148,23 +150,32 @@ module Metadata
                  :postgap   => 0,
                }
        
-        md = dflt.merge(md)
+        # Pregap data is only present in the file if the pregap
+        # type has been prefixed with a 'V'
+        pgvalid = md.delete(:pgvalid) == 'V'
+        md      = dflt.merge(md)
         
         if (md[:track] < 0) || (md[:track] > CD::MAX_TRACKS)
             raise ParsingError, "track number out of range"
         end
         
-        md.merge(:extraframes => CD::TRACK_PADDING -
-                                   md[:frames] % CD::TRACK_PADDING,
+        md.merge(:extraframes => (CD::TRACK_PADDING -
+                                  md[:frames] % CD::TRACK_PADDING) %
+                                 CD::TRACK_PADDING,
                  :datasize    => CD::TRACK_TYPE_DATASIZE[   md[:trktype]],
                  :subsize     => CD::TRACK_SUBTYPE_DATASIZE[md[:subtype]],
-                 :pgdatasize  => CD::TRACK_TYPE_DATASIZE[   md[:pgtype ]],
+                 :pgdatasize  => pgvalid ? CD::TRACK_TYPE_DATASIZE[md[:pgtype]]
+                                         : 0,
                  :pgsubsize   => CD::TRACK_SUBTYPE_DATASIZE[md[:pgsub  ]],
                 )
     end
 
     def self.parse_hard_disk(data, regex)
-        parse_using_regex(data, regex)
+        md = parse_using_regex(data, regex)
+        if md.values_at(:cyls, :heads, :secs, :bps).any?(&:zero?)
+            raise ParsingError, "invalid hard disk geometry"
+        end
+        md
     end
 
     def self.parse_using_regex(data, regex, mapping = nil, &block)
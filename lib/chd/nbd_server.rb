@@ -0,0 +1,512 @@
+require 'socket'
+
+class CHD
+
+#
+# Serve the logical data of a CHD file as a read-only block device,
+# using the NBD protocol (fixed newstyle negotiation, simple replies).
+#
+# This allows mounting or booting a disk/CD image without extracting
+# it first, hunks being decoded on demand.
+#
+# Each connection uses its own access to the CHD file
+# (see {CHD#initialize_copy}), and its own thread, so that several
+# connections decode in parallel. Pending requests of a connection
+# are processed as a batch: reads are sorted and adjacent ones merged.
+# Partially read hunks are kept in a cache shared by all the
+# connections, and sequential accesses trigger a read-ahead of the
+# following hunks.
+#
+# @example Serve on a Unix socket
+#   server = CHD::NBDServer.new(CHD.new('disk.chd'))
+#   server.listen(unix: '/tmp/disk.sock')
+#   server.run
+#   # nbd-client -unix /tmp/disk.sock /dev/nbd0 -name chd -readonly
+#
+class NBDServer
+    # Default TCP port
+    PORT           = 10809
+
+    # Default export name
+    EXPORT_NAME    = 'chd'
+
+    # Maximum size of a read request
+    MAX_REQUEST    = 32 * 1024 * 1024
+
+    # Default number of hunks kept in the shared cache
+    CACHE_HUNKS    = 256
+
+    # Default number of hunks read ahead on sequential accesses
+    READAHEAD      = 4
+
+    # @!visibility private
+    INIT_MAGIC     = 'NBDMAGIC'
+    # @!visibility private
+    OPTS_MAGIC     = 'IHAVEOPT'
+    # @!visibility private
+    REP_MAGIC      = 0x0003e889045565a9
+    # @!visibility private
+    REQUEST_MAGIC  = 0x25609513
+    # @!visibility private
+    REPLY_MAGIC    = 0x67446698
+
+    # @!visibility private
+    FLAG_FIXED_NEWSTYLE = 1 << 0
+    # @!visibility private
+    FLAG_NO_ZEROES      = 1 << 1
+
+    # @!visibility private
+    FLAG_HAS_FLAGS      = 1 << 0
+    # @!visibility private
+    FLAG_READ_ONLY      = 1 << 1
+    # @!visibility private
+    FLAG_SEND_FLUSH     = 1 << 2
+    # @!visibility private
+    FLAG_CAN_MULTI_CONN = 1 << 8
+    # @!visibility private
+    FLAG_SEND_CACHE     = 1 << 10
+
+    # @!visibility private
+    OPT_EXPORT_NAME = 1
+    # @!visibility private
+    OPT_ABORT       = 2
+    # @!visibility private
+    OPT_LIST        = 3
+    # @!visibility private
+    OPT_INFO        = 6
+    # @!visibility private
+    OPT_GO          = 7
+
+    # @!visibility private
+    REP_ACK         = 1
+    # @!visibility private
+    REP_SERVER      = 2
+    # @!visibility private
+    REP_INFO        = 3
+    # @!visibility private
+    REP_ERR_UNSUP   = (1 << 31) + 1
+    # @!visibility private
+    REP_ERR_INVALID = (1 << 31) + 3
+    # @!visibility private
+    REP_ERR_UNKNOWN = (1 << 31) + 6
+
+    # @!visibility private
+    INFO_EXPORT     = 0
+    # @!visibility private
+    INFO_BLOCK_SIZE = 3
+
+    # @!visibility private
+    CMD_READ        = 0
+    # @!visibility private
+    CMD_WRITE       = 1
+    # @!visibility private
+    CMD_DISC        = 2
+    # @!visibility private
+    CMD_FLUSH       = 3
+    # @!visibility private
+    CMD_TRIM        = 4
+    # @!visibility private
+    CMD_CACHE       = 5
+    # @!visibility private
+    CMD_WRITE_ZEROES = 6
+
+    # @!visibility private
+    EPERM           = 1
+    # @!visibility private
+    EIO             = 5
+    # @!visibility private
+    EINVAL          = 22
+    # @!visibility private
+    EOVERFLOW       = 75
+
+    # @!visibility private
+    MAX_OPTION      = 4096
+    # @!visibility private
+    DISCARD_CHUNK   = 64 * 1024
+
+
+    # @!visibility private
+    #
+    # Least recently used decoded hunks, shared between connections.
+    #
+    class HunkCache
+        def initialize(size)
+            @size  = size
+            @hunks = {}
+            @lock  = Mutex.new
+        end
+
+        def [](idx)
+            @lock.synchronize {
+                hunk = @hunks.delete(idx)
+                @hunks[idx] = hunk if hunk
+            }
+        end
+
+        def []=(idx, hunk)
+            return if @size <= 0
+            @lock.synchronize {
+                @hunks.delete(idx)
+                @hunks[idx] = hunk
+                @hunks.shift while @hunks.size > @size
+            }
+        end
+
+        def include?(idx)
+            @lock.synchronize { @hunks.include?(idx) }
+        end
+    end
+
+
+    # Create a NBD server for a CHD file.
+    #
+    # @param chd         [CHD]     opened CHD file
+    # @param name        [String]  export name
+    # @param cache_hunks [Integer] number of hunks in the shared cache
+    # @param readahead   [Integer] number of hunks read ahead
+    #
+    def initialize(chd, name: EXPORT_NAME, cache_hunks: CACHE_HUNKS,
+                        readahead: READAHEAD)
+        @chd        = chd
+        @name       = name
+        @size       = chd.header[:logical_bytes]
+        @hunk_bytes = chd.hunk_bytes
+        @cache      = HunkCache.new(cache_hunks)
+        @readahead  = readahead
+        @servers    = []
+        @clients    = {}
+        @lock       = Mutex.new
+        @stop_r, @stop_w = IO.pipe
+    end
+
+    # Export name
+    #
+    # @return [String]
+    #
+    attr_reader :name
+
+    # Exported size (logical bytes of the CHD file)
+    #
+    # @return [Integer]
+    #
+    attr_reader :size
+
+    # Listen for connections.
+    #
+    # TCP connections are only accepted on the loopback interface
+    # by default.
+    #
+    # @param unix [String, nil]  path of the Unix socket
+    # @param port [Integer, nil] TCP port
+    # @param host [String]       TCP address to bind to
+    #
+    # @return [self]
+    #
+    def listen(unix: nil, port: nil, host: 'localhost')
+        if unix.nil? && port.nil?
+            raise ArgumentError, "a Unix socket path or a TCP port is required"
+        end
+        @servers << UNIXServer.new(unix)          if unix
+        @servers.concat(Socket.tcp_server_sockets(host, port)) if port
+        self
+    end
+
+    # Addresses the server is listening to.
+    #
+    # @return [Array<Addrinfo>]
+    #
+    def addresses
+        @servers.map(&:local_address)
+    end
+
+    # Accept and serve connections, until {#stop} is called.
+    #
+    # When returning, the listening sockets and the connections
+    # are closed.
+    #
+    # @return [nil]
+    #
+    def run
+        loop do
+            ready, = IO.select(@servers + [ @stop_r ])
+            break if ready.include?(@stop_r)
+
+            ready.each do |server|
+                begin
+                    socket, = server.accept_nonblock
+                rescue IO::WaitReadable, Errno::EINTR
+                    next
+                end
+                @lock.synchronize {
+                    @clients[socket] = Thread.new { serve(socket) }
+                }
+            end
+        end
+        nil
+    ensure
+        @servers.each {|server|
+            path = server.local_address.unix_path if server.kind_of?(UNIXServer)
+            server.close
+            File.unlink(path) if path && File.socket?(path)
+        }
+        @servers.clear
+        clients = @lock.synchronize { @clients.dup }
+        clients.each {|socket, thread| socket.close rescue nil ; thread.join }
+        @stop_r.read_nonblock(64, exception: false)
+    end
+
+    # Request {#run} to stop.
+    #
+    # Can be called from another thread or a signal handler.
+    #
+    # @return [nil]
+    #
+    def stop
+        @stop_w.write_nonblock('.', exception: false)
+        nil
+    end
+
+    # Serve a single connection (negotiation and transmission).
+    #
+    # @param socket [IO] connected socket
+    #
+    # @return [nil]
+    #
+    def serve(socket)
+        socket.setsockopt(Socket::IPPROTO_TCP, Socket::TCP_NODELAY, 1) if
+            socket.respond_to?(:local_address) && socket.local_address.ip?
+        if _negotiate(socket)
+            begin
+                chd = @chd.dup
+            rescue NotSupportedError
+                chd = @chd
+            end
+            begin
+                _transmission(socket, chd)
+            ensure
+                chd.close unless chd.equal?(@chd)
+            end
+        end
+        nil
+    rescue ::IOError, SystemCallError
+        # Connection lost
+        nil
+    ensure
+        socket.close unless socket.closed?
+        @lock.synchronize { @clients.delete(socket) }
+    end
+
+
+    private
+
+    # Read exactly length bytes, or raise EOFError
+    def _read(socket, length)
+        data = socket.read(length)
+        if data.nil? || (data.bytesize != length)
+            raise EOFError, "connection closed by peer"
+        end
+        data
+    end
+
+    # Read and discard length bytes, by bounded chunks
+    def _discard(socket, length)
+        while length > 0
+            length -= _read(socket, [ length, DISCARD_CHUNK ].min).bytesize
+        end
+    end
+
+    # Negotiation phase, returns true if transmission is to be started
+    def _negotiate(socket)
+        socket.write(INIT_MAGIC, OPTS_MAGIC,
+                     [ FLAG_FIXED_NEWSTYLE | FLAG_NO_ZEROES ].pack('n'))
+        flags      = _read(socket, 4).unpack1('N')
+        no_zeroes  = (flags & FLAG_NO_ZEROES) != 0
+
+        loop do
+            magic, option, length = _read(socket, 16).unpack('a8NN')
+            return false if (magic != OPTS_MAGIC) || (length > MAX_OPTION)
+            data = _read(socket, length)
+
+            case option
+            when OPT_EXPORT_NAME
+                return false if data != @name
+                socket.write([ @size, _transmission_flags ].pack('Q>n'),
+                             no_zeroes ? '' : "\0" * 124)
+                return true
+
+            when OPT_ABORT
+                _reply(socket, option, REP_ACK)
+                return false
+
+            when OPT_LIST
+                _reply(socket, option, REP_SERVER,
+                       [ @name.bytesize, @name ].pack('Na*'))
+                _reply(socket, option, REP_ACK)
+
+            when OPT_INFO, OPT_GO
+                namelen = data.unpack1('N') if data.bytesize >= 4
+                if namelen.nil? || (data.bytesize < 6 + namelen)
+                    _reply(socket, option, REP_ERR_INVALID)
+                elsif data.byteslice(4, namelen) != @name
+                    _reply(socket, option, REP_ERR_UNKNOWN)
+                else
+                    _reply(socket, option, REP_INFO,
+                           [ INFO_EXPORT, @size, _transmission_flags ]
+                               .pack('nQ>n'))
+                    _reply(socket, option, REP_INFO,
+                           [ INFO_BLOCK_SIZE, 1, @hunk_bytes, MAX_REQUEST ]
+                               .pack('nNNN'))
+                    _reply(socket, option, REP_ACK)
+                    return true if option == OPT_GO
+                end
+
+            else
+                _reply(socket, option, REP_ERR_UNSUP)
+            end
+        end
+    end
+
+    def _reply(socket, option, type, data = '')
+        socket.write([ REP_MAGIC, option, type, data.bytesize ].pack('Q>NNN'),
+                     data)
+    end
+
+    def _transmission_flags
+        FLAG_HAS_FLAGS | FLAG_READ_ONLY | FLAG_SEND_FLUSH |
+            FLAG_CAN_MULTI_CONN | FLAG_SEND_CACHE
+    end
+
+    # Transmission phase: requests are read by a dedicated thread,
+    # and processed by batch of pending requests
+    def _transmission(socket, chd)
+        requests = Queue.new
+        reader   = Thread.new {
+            begin
+                loop do
+                    magic, _, type, handle, offset, length =
+                        _read(socket, 28).unpack('NnnQ>Q>N')
+                    break if (magic != REQUEST_MAGIC) || (type == CMD_DISC)
+                    # Write commands carry a payload, which is discarded
+                    # (the connection is dropped if larger than allowed)
+                    if type == CMD_WRITE
+                        break if length > MAX_REQUEST
+                        _discard(socket, length)
+                    end
+                    requests << [ type, handle, offset, length ]
+                end
+            rescue ::IOError, SystemCallError
+            ensure
+                requests.close
+            end
+        }
+
+        following = nil
+        while request = requests.pop
+            batch = [ request ]
+            batch << requests.pop until requests.empty?
+            following = _process(socket, chd, batch, following)
+        end
+    ensure
+        reader&.kill&.join
+    end
+
+    # Process a batch of requests, returns the offset following the
+    # last read (used to detect sequential accesses)
+    def _process(socket, chd, batch, following)
+        replies = []
+        reads   = []
+        batch.each do |type, handle, offset, length|
+            error = if    ! [ CMD_READ, CMD_CACHE ].include?(type)
+                        case type
+                        when CMD_FLUSH                             then 0
+                        when CMD_WRITE, CMD_TRIM, CMD_WRITE_ZEROES then EPERM
+                        else                                            EINVAL
+                        end
+                    elsif length > MAX_REQUEST                     then EOVERFLOW
+                    elsif offset + length > @size                  then EINVAL
+                    elsif type == CMD_CACHE
+                        _fetch(chd, offset, length, true) rescue nil
+                        0
+                    end
+            if error
+                replies << [ REPLY_MAGIC, error, handle ].pack('NNQ>')
+            else
+                reads   << [ offset, length, handle ]
+            end
+        end
+        if reads.empty?
+            socket.write(*replies)
+            return following
+        end
+
+        # Merge adjacent reads, and read them at once
+        reads.sort_by!(&:first)
+        reads.slice_when {|(o1, l1), (o2, _)| o1 + l1 != o2 }.each do |run|
+            offset = run.first[0]
+            length = run.sum {|_, l| l }
+            begin
+                data  = _fetch(chd, offset, length)
+                error = 0
+            rescue CHD::Error
+                data  = nil
+                error = EIO
+            end
+            run.each do |o, l, handle|
+                replies << [ REPLY_MAGIC, error, handle ].pack('NNQ>')
+                replies << data.byteslice(o - offset, l) if data
+            end
+        end
+        socket.write(*replies)
+
+        # Sequential access, read ahead the following hunks
+        sequential = reads.first[0] == following
+        following  = reads.map {|o, l, _| o + l }.max
+        if sequential && (@readahead > 0) && (following < @size)
+            length = [ @readahead * @hunk_bytes, @size - following ].min
+            _fetch(chd, following, length, true) rescue nil
+        end
+        following
+    end
+
+    # Retrieve data, using the shared cache for hunks partially
+    # covered, and decoding the whole hunks directly
+    # (if cache_only, hunks are only loaded in the cache)
+    def _fetch(chd, offset, length, cache_only = false)
+        data  = String.new(capacity: cache_only ? 0 : length)
+        last  = offset + length
+        idx   = offset / @hunk_bytes
+        run   = nil
+
+        flush = ->() {
+            data << chd.read_bytes(run * @hunk_bytes,
+                                   (idx - run) * @hunk_bytes) if run
+            run = nil
+        }
+
+        while idx * @hunk_bytes < last
+            start = idx * @hunk_bytes
+            first = [ offset - start, 0 ].max
+            count = [ last - start, @hunk_bytes ].min - first
+            whole = (count == @hunk_bytes)
+
+            if cache_only
+                @cache[idx] = chd.read_hunk(idx) unless @cache.include?(idx)
+            elsif hunk = @cache[idx]
+                flush.()
+                data << hunk.byteslice(first, count)
+            elsif whole
+                run ||= idx
+            else
+                flush.()
+                hunk        = chd.read_hunk(idx)
+                @cache[idx] = hunk
+                data << hunk.byteslice(first, count)
+            end
+            idx += 1
+        end
+        flush.()
+        data
+    end
+end
+
+end
@@ -0,0 +1,122 @@
+require 'etc'
+
+class CHD
+
+# @!visibility private
+#
+# Run jobs against a CHD file using several threads.
+#
+# As hunk decoding is performed without holding the GVL, the work
+# is really done in parallel, each thread using its own
+# independent access to the CHD file (see {CHD#initialize_copy}).
+#
+module Parallel
+    # Default number of jobs being processed or waiting to be consumed,
+    # per thread.
+    WINDOW = 4
+
+    # Number of threads to use by default.
+    #
+    # @return [Integer]
+    #
+    def self.threads
+        Etc.nprocessors
+    end
+
+    # Process the jobs, and yield the results.
+    #
+    # If the CHD can't be duplicated (opened from an IO), the jobs
+    # are processed in the current thread.
+    #
+    # The work block is called with an access to the CHD (dedicated to
+    # the running thread) and the job, its returned value is the result
+    # yielded to the consumer block. If several CHD are given, the
+    # work block is called with an array of accesses.
+    #
+    # @param chd     [CHD, Array<CHD>] opened CHD file(s)
+    # @param jobs    [Array]           jobs to process
+    # @param threads [Integer]         number of threads
+    # @param ordered [Boolean]         yield results in the jobs order
+    #                                  (otherwise in completion order)
+    # @param window  [Integer]         number of jobs in flight
+    # @param work    [Proc]            work to perform on a job
+    #
+    # @yieldparam result [Object]      result of the work
+    # @yieldparam index  [Integer]     index of the job
+    #
+    # @return [void]
+    #
+    def self.each(chd, jobs, threads: 1, ordered: true,
+                  window: threads * WINDOW, work:)
+        threads = [ threads, jobs.size ].min
+        handles = []
+        begin
+            # (each access is listed as soon as created, to be closed
+            #  if a following one can't be)
+            threads.times {
+                handles << (handle = [])
+                Array(chd).each {|c| handle << c.dup }
+            } if threads > 1
+        rescue NotSupportedError
+            handles.flatten.each(&:close)
+            handles.clear
+        end
+
+        # Not worth it (or not possible), perform work in the current thread
+        if handles.empty?
+            jobs.each_with_index {|job, index| yield(work.(chd, job), index) }
+            return
+        end
+
+        credits = SizedQueue.new(window)
+        results = Queue.new
+        lock    = Mutex.new
+        nextjob = 0
+        window.times { credits << true }
+
+        workers = handles.map {|handle|
+            Thread.new {
+                begin
+                    while credits.pop
+                        index = lock.synchronize { (nextjob += 1) - 1 }
+                        break if index >= jobs.size
+                        access  = chd.kind_of?(Array) ? handle : handle.first
+                        results << [ index, work.(access, jobs[index]) ]
+                    end
+                rescue Exception => e
+                    results << [ nil, e ]
+                ensure
+                    handle.each(&:close)
+                end
+            }
+        }
+
+        pending = {}
+        expect  = 0
+        jobs.size.times do
+            index, result = results.pop
+            raise result if index.nil?
+
+            if ordered
+                pending[index] = result
+                while pending.include?(expect)
+                    yield(pending.delete(expect), expect)
+                    expect  += 1
+                    credits << true
+                end
+            else
+                yield(result, index)
+                credits << true
+            end
+        end
+    ensure
+        if workers
+            credits.close
+            workers.each(&:kill).each(&:join)
+        elsif handles
+            handles.flatten.each(&:close)
+        end
+    end
+end
+
+end
@@ -0,0 +1,116 @@
+class CHD
+    # Maximum gap (in bytes) between stored hunks for them to be
+    # read ahead as a single extent.
+    READ_HUNKS_GAP    = 64 * 1024
+
+    # Maximum size (in bytes) of an extent read ahead at once.
+    READ_HUNKS_EXTENT = 4 * 1024 * 1024
+
+    # Read a set of hunks, scheduling the file accesses by position.
+    #
+    # The hunks are located in the file using the map (following
+    # self references), sorted by position, and merged into extents
+    # (allowing gaps of {READ_HUNKS_GAP} bytes, up to
+    # {READ_HUNKS_EXTENT} bytes). Each extent is read ahead as a
+    # single sequential access, in increasing file order, while
+    # the hunks of previous extents are decoded in parallel (if
+    # the CHD was opened from a path).
+    #
+    # Hunks not stored in the file (parent references), and hunks
+    # of CHD prior to version 5 (no map available), are read by
+    # increasing index.
+    #
+    # @param indices [Array<Integer>, Range] hunk indices (duplicates
+    #                                        are read once)
+    # @param threads [Integer]               number of threads used
+    #                                        for decoding
+    #
+    # @yieldparam data [String]  hunk data
+    # @yieldparam idx  [Integer] hunk index
+    #
+    # @raise [RangeError] if one of the hunks doesn't exist
+    #
+    # @return [Array<String>] hunks data, in the order of the indices
+    #                         (if no block given)
+    # @return [self]          if a block is given, the hunks being
+    #                         yielded as soon as decoded
+    #
+    # @example
+    #   chd.read_hunks([ 1200, 3, 1201, 42 ])     # => [ ..., ..., ..., ... ]
+    #   chd.read_hunks(changed) {|data, idx| out.pwrite(data, idx * size) }
+    #
+    def read_hunks(indices, threads: Parallel.threads)
+        indices = indices.to_a
+        indices.each do |idx|
+            next if (0 ... hunk_count).include?(idx)
+            raise RangeError, "hunk index (%d) is out of range (%d..%d)" % [
+                      idx, 0, hunk_count - 1 ]
+        end
+
+        extents = _read_hunks_extents(indices.uniq)
+        window  = threads * Parallel::WINDOW
+        ahead   = 0
+        readahead = ->(count) {
+            while (ahead < extents.size) && (count > 0)
+                offset, length, _ = extents[ahead]
+                _readahead(offset, length) if length > 0
+                ahead += 1
+                count -= 1
+            end
+        }
+
+        work    = ->(chd, (_, _, hunks)) {
+            hunks.map {|idx| [ idx, chd.read_hunk(idx) ] }
+        }
+        results = {} unless block_given?
+        readahead.(window)
+        Parallel.each(self, extents, threads: threads, ordered: false,
+                      window: window, work: work) do |list, _|
+            readahead.(1)
+            list.each do |idx, data|
+                block_given? ? yield(data, idx) : results[idx] = data
+            end
+        end
+
+        block_given? ? self : indices.map {|idx| results[idx] }
+    end
+
+
+    private
+
+    # Extents (offset, length, and hunk indices) to read, in the order
+    # of the file (length is 0 for hunks not stored in the file)
+    def _read_hunks_extents(hunks)
+        map      = begin
+                       HunkMap.new(self)
+                   rescue NotSupportedError
+                       nil
+                   end
+        stored   = []
+        unstored = []
+        hunks.each do |idx|
+            entry = map&.resolve(idx)
+            if entry && entry.stored? && (entry.length > 0)
+                stored   << [ entry.offset, entry.length, idx ]
+            else
+                unstored << idx
+            end
+        end
+
+        extents = []
+        stored.sort.each do |offset, length, idx|
+            last = extents.last
+            if last && (offset <= last[0] + last[1] + READ_HUNKS_GAP) &&
+                       (offset + length - last[0] <= READ_HUNKS_EXTENT)
+                last[1] = [ last[1], offset + length - last[0] ].max
+                last[2] << idx
+            else
+                extents << [ offset, length, [ idx ] ]
+            end
+        end
+
+        per_job  = [ READ_HUNKS_EXTENT / hunk_bytes, 1 ].max
+        unstored.sort.each_slice(per_job) {|list| extents << [ 0, 0, list ] }
+        extents
+    end
+end
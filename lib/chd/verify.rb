@@ -0,0 +1,44 @@
+require 'digest/sha1'
+
+class CHD
+    # Number of hunks decoded by a single verification job.
+    VERIFY_HUNKS = 64
+
+    # Verify the integrity of the data, by computing the SHA-1 of
+    # the logical data and comparing it with the one recorded in
+    # the header (`:sha1_raw`).
+    #
+    # Hunks are decoded in parallel, if the CHD was opened from a path.
+    #
+    # @note Only CHD version 4 and later are supported (raw data SHA-1).
+    #
+    # @param threads [Integer] number of threads used for decoding
+    #
+    # @raise [NotSupportedError] if the CHD has no raw data SHA-1
+    #
+    # @return [Boolean]
+    #
+    def verify(threads: Parallel.threads)
+        expected = header[:sha1_raw]
+        if expected.nil?
+            raise NotSupportedError, "no raw data SHA-1 (CHD version < 4)"
+        end
+
+        digest    = Digest::SHA1.new
+        remaining = header[:logical_bytes]
+        jobs      = (0 ... hunk_count).step(VERIFY_HUNKS).map {|first|
+            first ... [ first + VERIFY_HUNKS, hunk_count ].min
+        }
+        work      = ->(chd, hunks) { hunks.map {|idx| chd.read_hunk(idx) } }
+        Parallel.each(self, jobs, threads: threads, work: work) do |data, _|
+            data.each do |hunk|
+                break if remaining <= 0
+                digest.update(remaining < hunk.bytesize ? hunk[0, remaining]
+                                                        : hunk)
+                remaining -= hunk.bytesize
+            end
+        end
+
+        digest.digest == expected
+    end
+end
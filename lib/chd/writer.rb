@@ -0,0 +1,427 @@
+require 'digest'
+
+class CHD
+
+#
+# Write a CHD file (version 5) from hunks that are already encoded,
+# as returned by {CHD#read_compressed_hunk}, or from plain data.
+#
+# No codec is implemented here: compressed hunks are stored as given,
+# and plain data is stored uncompressed. This allows copying, repacking,
+# or re-containerizing CHD files without decompressing them.
+#
+# Hunks are to be appended in order, metadata can be added at any time
+# before closing.
+#
+# @note The hunk types of the map are written using a fixed 4-bit code,
+#       instead of the huffman/RLE encoding of chdman
+#       (which only makes the map slightly bigger).
+#
+# @example Copy a CHD without decompressing it
+#   CHD::Writer.copy(CHD.new('file.chd'), 'copy.chd')
+#
+# @example Append hunks
+#   CHD::Writer.open('file.chd', hunk_bytes: 19584, unit_bytes: 2448,
+#                                compression: [ 'cdlz' ]) do |w|
+#       w.add_metadata(:CHT2, 'TRACK:1 TYPE:MODE1 ...')
+#       w << chd.read_compressed_hunk(0)
+#       w.write_data(data)
+#   end
+#
+class Writer
+    # Size of the V5 header
+    HEADER_SIZE          = 124
+
+    # Size of the header of a metadata entry
+    METADATA_HEADER_SIZE = 16
+
+    # Maximum number of codecs
+    MAX_CODECS           = 4
+
+    # @!visibility private
+    MAP_TYPE_NONE        = HunkMap::NONE
+    # @!visibility private
+    MAP_TYPE_SELF        = HunkMap::SELF
+    # @!visibility private
+    MAP_TYPE_PARENT      = HunkMap::PARENT
+
+    # @!visibility private
+    NO_DIGEST            = ("\0" * 20).b.freeze
+
+
+    # Create a CHD writer.
+    #
+    # With no associated block {Writer.open} is synonym for {Writer.new}.
+    # If the optional code block is given, it will be passed the writer
+    # as an argument, and the CHD file will be finalized when the block
+    # terminates.
+    #
+    # @param (see #initialize)
+    #
+    # @yield [writer] the CHD writer
+    #
+    # @return [Writer]
+    #
+    def self.open(path, **opts)
+        writer = new(path, **opts)
+        return writer unless block_given?
+
+        begin
+            yield writer
+        rescue Exception
+            writer.abort
+            raise
+        end
+        writer.close
+        writer
+    end
+
+
+    # Copy a CHD file, without decompressing the hunks.
+    #
+    # Hunks referencing the parent are kept as such, so the copy
+    # still requires the same parent.
+    #
+    # @param chd  [CHD]    opened CHD file (version 5)
+    # @param path [String] path of the created CHD file
+    #
+    # @return [void]
+    #
+    def self.copy(chd, path)
+        header = chd.header
+
+        self.open(path, hunk_bytes:    header[:hunk_bytes   ],
+                        unit_bytes:    header[:unit_bytes   ],
+                        logical_bytes: header[:logical_bytes],
+                        compression:   header[:compression  ],
+                        parent_sha1:   header.dig(:parent, :sha1),
+                        raw_sha1:      header[:sha1_raw     ],
+                        sha1:          header[:sha1         ]) do |writer|
+            chd.metadata(raw: true).each do |data, flags, tag|
+                writer.add_metadata(tag, data, flags)
+            end
+            chd.hunk_count.times do |idx|
+                writer << chd.read_compressed_hunk(idx)
+            end
+        end
+    end
+
+
+    # Create a CHD writer.
+    #
+    # If the SHA-1 digests are not provided, they are computed if all
+    # the hunks were given as plain data, otherwise they are left blank.
+    #
+    # @param path          [String]         path of the CHD file to create
+    # @param hunk_bytes    [Integer]        number of bytes in a hunk
+    # @param unit_bytes    [Integer]        number of bytes in a unit
+    # @param logical_bytes [Integer, nil]   logical size of the data
+    #                                       (default to all the hunks)
+    # @param compression   [Array<String>]  codecs used by compressed hunks,
+    #                                       an empty list creates an
+    #                                       uncompressed CHD
+    # @param parent_sha1   [String, CHD, nil] parent SHA-1 digest
+    #                                       (or parent CHD)
+    # @param raw_sha1      [String, nil]    SHA-1 digest of the raw data
+    # @param sha1          [String, nil]    SHA-1 digest of raw data and
+    #                                       metadata
+    #
+    def initialize(path, hunk_bytes:, unit_bytes:, logical_bytes: nil,
+                   compression: [], parent_sha1: nil,
+                   raw_sha1: nil, sha1: nil)
+        if (hunk_bytes % unit_bytes) != 0
+            raise ArgumentError, "hunk is not a multiple of unit"
+        end
+        if compression.size > MAX_CODECS
+            raise ArgumentError, "at most #{MAX_CODECS} codecs can be used"
+        end
+        if parent_sha1.kind_of?(CHD)
+            parent_sha1 = parent_sha1.header[:sha1]
+        end
+
+        @hunk_bytes    = hunk_bytes
+        @unit_bytes    = unit_bytes
+        @logical_bytes = logical_bytes
+        @compression   = compression.map {|codec| codec.to_s.b }
+        @parent_sha1   = parent_sha1
+        @raw_sha1      = raw_sha1
+        @sha1          = sha1
+        @raw_digest    = Digest::SHA1.new
+        @raw_hashed    = 0
+        @metadata      = []
+        @map           = []
+        @file          = File.open(path, 'wb')
+        @file.write("\0" * HEADER_SIZE)
+    end
+
+    # SHA-1 digest of the raw data.
+    #
+    # Can be set until the file is closed, when it is only known once
+    # all the data was processed (compressed hunks being appended).
+    #
+    # @return [String, nil]
+    #
+    attr_writer :raw_sha1
+
+    # Number of hunks written so far
+    #
+    # @return [Integer]
+    #
+    def hunk_count
+        @map.size
+    end
+
+    # Add a metadata.
+    #
+    # @note Text metadata (such as CD-ROM tracks) are expected to be
+    #       terminated by a null-char.
+    #
+    # @param tag   [Symbol, String] 4-char tag
+    # @param data  [String]         metadata
+    # @param flags [Integer]        metadata flags
+    #
+    # @return [self]
+    #
+    def add_metadata(tag, data, flags = METADATA_FLAG_CHECKSUM)
+        tag = tag.to_s.b
+        if tag.size != 4
+            raise ArgumentError, "tag must be a 4-char symbol"
+        end
+        @metadata << [ tag, data.b, flags ]
+        self
+    end
+
+    # Append a hunk, as returned by {CHD#read_compressed_hunk}.
+    #
+    # @param hunk [Hash{Symbol => Object}]
+    #
+    # @return [self]
+    #
+    def write_hunk(hunk)
+        case hunk[:type]
+        when :compressed
+            codec = @compression.index(hunk[:codec].b)
+            if codec.nil?
+                raise ArgumentError, "codec #{hunk[:codec]} is not declared"
+            end
+            _write(codec, hunk[:data], hunk[:crc16])
+            @raw_digest = nil
+        when :none
+            _hash_raw(hunk[:data])
+            _write(MAP_TYPE_NONE, hunk[:data],
+                   hunk[:crc16] || CHD.crc16(hunk[:data]))
+        when :self
+            if hunk[:offset] >= @map.size
+                raise ArgumentError, "self reference must be to a previous hunk"
+            end
+            @map << [ MAP_TYPE_SELF, 0, hunk[:offset], 0 ]
+            @raw_digest = nil
+        when :parent
+            if @parent_sha1.nil?
+                raise ArgumentError, "parent reference without a parent"
+            end
+            @map << [ MAP_TYPE_PARENT, 0, hunk[:offset], 0 ]
+            @raw_digest = nil
+        else
+            raise ArgumentError, "unknown hunk type (#{hunk[:type]})"
+        end
+        self
+    end
+    alias << write_hunk
+
+    # Append a hunk of plain data (stored uncompressed).
+    #
+    # @param data [String]
+    #
+    # @return [self]
+    #
+    def write_data(data)
+        write_hunk(:type => :none, :data => data)
+    end
+
+    # Finalize the CHD file (metadata, map, and header).
+    #
+    # @return [nil]
+    #
+    def close
+        return if @file.nil?
+
+        @logical_bytes ||= @map.size * @hunk_bytes
+        metaoffset       = _write_metadata
+        mapoffset        = @file.pos
+        @file.write(@compression.empty? ? _uncompressed_map : _compressed_map)
+        @file.rewind
+        @file.write(_header(mapoffset, metaoffset))
+        @file.close
+        @file = nil
+    end
+
+    # Close the file, leaving it unfinalized.
+    #
+    # @return [nil]
+    #
+    def abort
+        @file&.close
+        @file = nil
+    end
+
+
+    private
+
+    def _write(type, data, crc16)
+        if data.bytesize > @hunk_bytes
+            raise ArgumentError, "hunk data is too big"
+        end
+        if (type == MAP_TYPE_NONE) && (data.bytesize != @hunk_bytes)
+            raise ArgumentError, "uncompressed hunk must be #{@hunk_bytes} bytes"
+        end
+
+        # Uncompressed CHD needs hunk-aligned data
+        if @compression.empty?
+            padding = -@file.pos % @hunk_bytes
+            @file.write("\0" * padding) if padding > 0
+        end
+
+        @map << [ type, data.bytesize, @file.pos, crc16 ]
+        @file.write(data)
+    end
+
+    def _hash_raw(data)
+        return if @raw_digest.nil?
+        length = @logical_bytes ? [ @logical_bytes - @raw_hashed, 0 ].max
+                                : data.bytesize
+        @raw_digest << data.byteslice(0, length)
+        @raw_hashed += data.bytesize
+    end
+
+    def _write_metadata
+        return 0 if @metadata.empty?
+
+        offset = @file.pos
+        @metadata.each_with_index do |(tag, data, flags), idx|
+            nxt = (idx == @metadata.size - 1) ? 0
+                : @file.pos + METADATA_HEADER_SIZE + data.bytesize
+            @file.write([ tag, flags, data.bytesize >> 16,
+                          data.bytesize & 0xffff, nxt ].pack('a4CCnQ>'))
+            @file.write(data)
+        end
+        offset
+    end
+
+    # Map of an uncompressed CHD: offset of each hunk in hunk unit,
+    # 0 meaning that data comes from the parent
+    def _uncompressed_map
+        @map.each_with_index.map {|(type, _, offset), idx|
+            case type
+            when MAP_TYPE_NONE
+                offset / @hunk_bytes
+            when MAP_TYPE_PARENT
+                if offset * @unit_bytes != idx * @hunk_bytes
+                    raise NotSupportedError,
+                          "uncompressed CHD only allows parent's same hunk"
+                end
+                0
+            else
+                raise NotSupportedError,
+                      "uncompressed CHD only allows uncompressed hunk"
+            end
+        }.pack('N*')
+    end
+
+    # Map of a compressed CHD:
+    #   header: length(4), first offset(6), crc(2),
+    #           length bits(1), self bits(1), parent bits(1), reserved(1)
+    #   huffman tree of the hunk types (16 codes of 4 bits)
+    #   hunk types
+    #   length/crc, self or parent offset, depending on the hunk type
+    def _compressed_map
+        maxbits    = ->(type) {
+            @map.select {|t, _| type === t }.map {|_, l, o|
+                type == MAP_TYPE_SELF || type == MAP_TYPE_PARENT ? o : l
+            }.max.to_i.bit_length.clamp(1, 48)
+        }
+        lengthbits = maxbits.(0...MAP_TYPE_NONE)
+        selfbits   = maxbits.(MAP_TYPE_SELF)
+        parentbits = maxbits.(MAP_TYPE_PARENT)
+        firstoffs  = @map.find {|t, _| t <= MAP_TYPE_NONE }&.[](2) || 0
+        bits       = BitWriter.new
+
+        16.times { bits.write(4, 4) }
+        @map.each {|type, _| bits.write(type, 4) }
+        @map.each {|type, length, offset, crc16|
+            case type
+            when 0...MAP_TYPE_NONE
+                bits.write(length, lengthbits)
+                bits.write(crc16,  16)
+            when MAP_TYPE_NONE   then bits.write(crc16,  16)
+            when MAP_TYPE_SELF   then bits.write(offset, selfbits)
+            when MAP_TYPE_PARENT then bits.write(offset, parentbits)
+            end
+        }
+        data       = bits.to_s
+
+        # CRC of the decoded map:
+        #   type(1), length(3), offset(6), crc16(2)
+        rawmap     = @map.map {|type, length, offset, crc16|
+            [ type, length >> 16, length & 0xffff,
+              offset >> 32, offset & 0xffffffff, crc16 ].pack('CCnnNn')
+        }.join
+
+        [ data.bytesize, firstoffs >> 32, firstoffs & 0xffffffff,
+          CHD.crc16(rawmap), lengthbits, selfbits, parentbits, 0
+        ].pack('NnNnCCCC') + data
+    end
+
+    def _header(mapoffset, metaoffset)
+        raw_sha1 = @raw_sha1
+        raw_sha1 ||= @raw_digest.digest if @raw_digest && ! @map.empty?
+        sha1     = @sha1
+        sha1   ||= _overall_sha1(raw_sha1) if raw_sha1
+
+        [ 'MComprHD', HEADER_SIZE, 5,
+          *MAX_CODECS.times.map {|i| @compression[i] || "\0" * 4 },
+          @logical_bytes, mapoffset, metaoffset, @hunk_bytes, @unit_bytes,
+          raw_sha1 || NO_DIGEST, sha1 || NO_DIGEST, @parent_sha1 || NO_DIGEST,
+        ].pack('a8NNa4a4a4a4Q>Q>Q>NNa20a20a20')
+    end
+
+    # SHA-1 of the raw data, followed by the sorted
+    # tag and SHA-1 of the checksummed metadata
+    def _overall_sha1(raw_sha1)
+        hashes = @metadata.select {|_, _, flags|
+            (flags & METADATA_FLAG_CHECKSUM) != 0
+        }.map {|tag, data, _|
+            tag + Digest::SHA1.digest(data)
+        }.sort
+        Digest::SHA1.digest(raw_sha1 + hashes.join)
+    end
+
+
+    # @!visibility private
+    #
+    # Bitstream writer (most significant bit first)
+    #
+    class BitWriter
+        def initialize
+            @data  = String.new
+            @accum = 0
+            @bits  = 0
+        end
+
+        def write(value, bits)
+            @accum = (@accum << bits) | (value & ((1 << bits) - 1))
+            @bits += bits
+            while @bits >= 8
+                @bits  -= 8
+                @data  << ((@accum >> @bits) & 0xff)
+                @accum &= (1 << @bits) - 1
+            end
+        end
+
+        def to_s
+            @bits > 0 ? @data + ((@accum << (8 - @bits)) & 0xff).chr : @data
+        end
+    end
+end
+
+end
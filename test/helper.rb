@@ -0,0 +1,127 @@
+require 'minitest/autorun'
+require 'tmpdir'
+require 'fileutils'
+require 'zlib'
+require 'chd'
+require_relative '../bench/generator'
+
+#
+# Images used by the tests, generated in a temporary directory
+# (removed at the end of the run).
+#
+module TestImages
+    # Directory holding the generated images
+    DIR = Dir.mktmpdir('chd-test')
+    Minitest.after_run { FileUtils.rm_rf(DIR) }
+
+    # Content of a data sector: track number and frame index
+    # (inside the track, counting stored pregap), padded with zeros
+    def self.sector(track, idx, length)
+        ("T%02d F%06d" % [ track, idx ]).ljust(length, "\0")
+    end
+
+    # Content of the subcode of a frame (see {#cd_image})
+    def self.subcode(track, idx)
+        ("S%02d F%06d" % [ track, idx ]).ljust(CHD::CD::MAX_SUBCODE_DATASIZE,
+                                               "\0")
+    end
+
+    # Path of a generated image (see {CHD::Bench::Generator#generate})
+    def generated_image(layout: :raw, codec: 'none', size: 256 * 1024, **opts)
+        @@generator ||= CHD::Bench::Generator.new(DIR)
+        @@generator.generate(layout: layout, codec: codec, size: size,
+                             **opts)[:path]
+    end
+
+    # Path of a (non-existing) file in the temporary directory
+    def tmp_path(name)
+        File.join(DIR, "#{self.class.name}-#{name}-#{object_id}")
+    end
+
+    # Content of a hunk of a tagged image (see {#tagged_image})
+    def self.tagged_hunk(tag, hunk_bytes = 4096)
+        ("%-16s" % tag * (hunk_bytes / 16)).b
+    end
+
+    # Build a V5 image (zlib, unless no compression) of 4096-byte hunks,
+    # given as tags (see {TestImages.tagged_hunk}) of zlib compressed
+    # hunks, `{ :none => tag }` for uncompressed hunks, or hashes
+    # as accepted by CHD::Writer#write_hunk.
+    #
+    # @return [CHD] the image opened
+    #
+    def tagged_image(name, hunks, compression: [ 'zlib' ], parent: nil)
+        path = tmp_path("#{name}.chd")
+        CHD::Writer.open(path, hunk_bytes: 4096, unit_bytes: 512,
+                               compression: compression,
+                               parent_sha1: parent) do |writer|
+            hunks.each do |hunk|
+                hunk = { :zlib => hunk } if hunk.kind_of?(String)
+                writer << if raw = hunk[:zlib]
+                              raw = TestImages.tagged_hunk(raw)
+                              { :type  => :compressed, :codec => 'zlib',
+                                :crc16 => CHD.crc16(raw),
+                                :data  => Zlib::Deflate.new(9, -Zlib::MAX_WBITS)
+                                                       .deflate(raw, Zlib::FINISH) }
+                          elsif raw = hunk[:none]
+                              { :type => :none,
+                                :data => TestImages.tagged_hunk(raw) }
+                          else
+                              hunk
+                          end
+            end
+        end
+        CHD.new(path, parent: parent)
+    end
+
+    # Build a CD image (one hunk per 8 frames, CHT2 metadata).
+    #
+    # Each track is described by `:type`, `:frames` (including
+    # stored pregap), `:pregap`, and `:stored` (pregap data present
+    # in the file). Data sectors are filled by {TestImages.sector},
+    # or from `:data` (track content, starting after the pregap),
+    # audio sectors by the frame index as big-endian 16-bit
+    # samples (as stored in CHD files). With `:subcode`, frames
+    # have RW subcode filled by {TestImages.subcode}.
+    #
+    def cd_image(name, tracks)
+        path   = tmp_path("#{name}.chd")
+        frames = []
+        CHD::Writer.open(path, hunk_bytes: 8 * CHD::CD::FRAME_SIZE,
+                               unit_bytes: CHD::CD::FRAME_SIZE) do |writer|
+            tracks.each_with_index do |t, idx|
+                type, count = t.fetch(:type), t.fetch(:frames)
+                writer.add_metadata(CHD::Metadata::CDROM_TRACK_PREGAP,
+                    "TRACK:%d TYPE:%s SUBTYPE:%s FRAMES:%d PREGAP:%d " \
+                    "PGTYPE:%s%s PGSUB:RW POSTGAP:0\0" % [
+                        idx + 1, type, t[:subcode] ? 'RW' : 'NONE', count,
+                        t.fetch(:pregap, 0),
+                        t[:stored] ? 'V' : '', type ])
+                datasize = CHD::CD::TRACK_TYPE_DATASIZE[type]
+                skip     = t[:stored] ? t.fetch(:pregap, 0) : 0
+                frames.concat(count.times.map {|i|
+                    if type == :AUDIO
+                        [ i ].pack('s>') * (datasize / 2)
+                    elsif t[:data]
+                        t[:data].byteslice((i - skip) * datasize, datasize)
+                            .to_s if i >= skip
+                    else
+                        TestImages.sector(idx + 1, i, datasize)
+                    end.to_s.ljust(CHD::CD::MAX_SECTOR_DATASIZE, "\0") +
+                    (t[:subcode] ? TestImages.subcode(idx + 1, i) : '')
+                        .ljust(CHD::CD::MAX_SUBCODE_DATASIZE, "\0")
+                })
+                frames.concat([ "\0" * CHD::CD::FRAME_SIZE ] *
+                              (-count % CHD::CD::TRACK_PADDING))
+            end
+            frames.each_slice(8) {|list|
+                writer.write_data(list.join.ljust(8 * CHD::CD::FRAME_SIZE, "\0"))
+            }
+        end
+        path
+    end
+end
+
+class Minitest::Test
+    include TestImages
+end
@@ -0,0 +1,39 @@
+require_relative 'helper'
+require_relative '../bench/workloads'
+
+class TestBench < Minitest::Test
+    def run_workloads(**opts)
+        info = CHD::Bench::Generator.new(DIR).generate(**opts)
+        CHD::Bench::Workloads.new(info, ops: 16, stride: 3, threads: 2).run
+    end
+
+    # Images not larger than the chunk of random reads
+    def test_small_image
+        results = run_workloads(layout: :raw, codec: 'none',
+                                size: 4096, hunk_bytes: 4096)
+        random  = results.find {|r| r[:workload] == :random_bytes }
+        assert_equal 16,        random[:ops]
+        assert_equal 16 * 4096, random[:bytes]
+        results = run_workloads(layout: :raw, codec: 'none',
+                                size: 1024, hunk_bytes: 1024)
+        assert_equal 16 * 1024,
+                     results.find {|r| r[:workload] == :random_bytes }[:bytes]
+    end
+
+    def test_cd_image
+        results = run_workloads(layout: :cd, codec: 'zlib', size: 256 * 1024)
+        assert_equal %i[ sequential_hunk sequential_bytes random_unit
+                         random_bytes threaded_random strided_sector ],
+                     results.map {|r| r[:workload] }
+        assert results.all? {|r| r[:bytes] > 0 && r[:allocations_per_op] }
+    end
+
+    def test_deterministic
+        dir = tmp_path('gen')
+        a, b = [ 1, 2 ].map {|i|
+            CHD::Bench::Generator.new("#{dir}#{i}", seed: 7)
+                .generate(layout: :raw, codec: 'zlib', size: 64 * 1024)
+        }
+        assert_equal File.binread(a[:path]), File.binread(b[:path])
+    end
+end
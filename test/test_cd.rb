@@ -0,0 +1,67 @@
+require_relative 'helper'
+
+class TestCD < Minitest::Test
+    # Track 1: pregap not in the file, track 2: audio,
+    # track 3: pregap stored in the file
+    def setup
+        @cd = CHD::CD.new(CHD.new(cd_image('cd',
+                  [ { :type => :MODE1, :frames => 10, :pregap => 2 },
+                    { :type => :AUDIO, :frames => 6 },
+                    { :type => :MODE1, :frames => 7,  :pregap => 3,
+                      :stored => true } ])))
+    end
+
+    def sector(track, idx)
+        TestImages.sector(track, idx, 2048)
+    end
+
+    def test_toc
+        assert_equal [ 1, 2, 3 ],                @cd.toc.map {|t| t[:track]   }
+        assert_equal [ :MODE1, :AUDIO, :MODE1 ], @cd.toc.map {|t| t[:trktype] }
+        assert_equal [ 0, 0, 2048 ],             @cd.toc.map {|t| t[:pgdatasize] }
+        assert_equal [ 2, 12, 21, 25 ],
+                     [ 1, 2, 3, 0xAA ].map {|t| @cd.track_start(t) }
+        assert_equal [ 0, 10, 16, 23 ],
+                     [ 1, 2, 3, 0xAA ].map {|t| @cd.track_start(t, true) }
+        assert_raises(RangeError) { @cd.track_start(4) }
+    end
+
+    # Pregap not in the file is read as blank sectors
+    def test_read_sector_pregap_not_in_file
+        assert_equal "\0" * 2048, @cd.read_sector(0)
+        assert_equal "\0" * 2048, @cd.read_sector(1, :MODE1)
+        assert_equal sector(1, 0), @cd.read_sector(2)
+        assert_equal sector(1, 9), @cd.read_sector(11)
+        assert_equal "\0" * 4096 + sector(1, 0), @cd.read_sectors(0, 3)
+    end
+
+    # Pregap in the file is skipped (logical addressing), or read
+    # (physical addressing)
+    def test_read_sector_pregap_in_file
+        assert_equal sector(3, 3),  @cd.read_sector(21)
+        assert_equal sector(3, 6),  @cd.read_sector(24)
+        assert_equal sector(3, 0),  @cd.read_sector(16, nil, true)
+        assert_equal (3 .. 6).map {|i| sector(3, i) }.join,
+                     @cd.read_sectors(21, 4)
+    end
+
+    def test_read_audio
+        assert_equal [ 4 ].pack('s>') * 1176, @cd.read_sector(16)
+        assert_equal [ 0 ].pack('s>') * 1176, @cd.read_sector(10, nil, true)
+    end
+
+    def test_read_sectors_across_tracks
+        data = @cd.read_sectors(10, 3)
+        assert_equal sector(1, 8) + sector(1, 9), data.byteslice(0, 4096)
+        assert_equal [ 0 ].pack('s>') * 1176,     data.byteslice(4096, 2352)
+        assert_raises(RangeError) { @cd.read_sectors(24, 2) }
+    end
+
+    def test_conversion
+        assert_equal [ 16, 2048, false ], CHD::CD.conversion(:MODE1_RAW, :MODE1)
+        assert_equal [ 24, 2048, false ], CHD::CD.conversion(:MODE2_RAW, :MODE1)
+        assert_raises(CHD::NotSupportedError) {
+            CHD::CD.conversion(:AUDIO, :MODE1)
+        }
+    end
+end
@@ -0,0 +1,92 @@
+require_relative 'helper'
+
+class TestCDExtract < Minitest::Test
+    def setup
+        @path = cd_image('extract',
+                         [ { :type => :MODE1, :frames => 10 },
+                           { :type => :AUDIO, :frames => 6, :pregap => 2 },
+                           { :type => :MODE1, :frames => 7, :pregap => 3,
+                             :stored => true } ])
+        @cd   = CHD::CD.new(CHD.new(@path))
+        @bin  = tmp_path('disc.bin')
+        @cue  = tmp_path('disc.cue')
+    end
+
+    def audio(count)
+        count.times.map {|i| [ i ].pack('s<') * 1176 }.join
+    end
+
+    def data(track, count, from = 0)
+        (from ... count).map {|i| TestImages.sector(track, i, 2048) }.join
+    end
+
+    def test_bin_cue
+        stats = @cd.extract(@bin, @cue, threads: 2)
+        assert_equal 23, stats[:frames]
+        assert_equal data(1, 10) + audio(6) + data(3, 7), File.binread(@bin)
+        assert_equal <<~EOF, File.read(@cue)
+            FILE "#{File.basename(@bin)}" BINARY
+              TRACK 01 MODE1/2048
+                INDEX 01 00:00:00
+              TRACK 02 AUDIO
+                PREGAP 00:00:02
+                INDEX 01 00:00:10
+              TRACK 03 MODE1/2048
+                INDEX 00 00:00:16
+                INDEX 01 00:00:19
+        EOF
+    end
+
+    def test_gdi
+        gdi = tmp_path('disc.gdi')
+        @cd.extract(@bin, gdi, format: :gdi)
+        base = @bin.delete_suffix(File.extname(@bin))
+        assert_equal <<~EOF, File.read(gdi)
+            3
+            1 0 4 2048 #{File.basename(base)}01.bin 0
+            2 10 0 2352 #{File.basename(base)}02.raw 0
+            3 16 4 2048 #{File.basename(base)}03.bin 0
+        EOF
+        assert_equal data(1, 10), File.binread("#{base}01.bin")
+        assert_equal audio(6),    File.binread("#{base}02.raw")
+        assert_equal data(3, 7),  File.binread("#{base}03.bin")
+    end
+
+    def test_iso
+        @cd.extract(@bin, format: :iso)
+        assert_equal data(1, 10), File.binread(@bin)
+    end
+
+    def test_progress
+        seen = []
+        @cd.extract(@bin, @cue) {|bytes, total| seen << [ bytes, total ] }
+        total = 17 * 2048 + 6 * 2352
+        assert_equal total, seen.last[0]
+        assert seen.all? {|_, t| t == total }
+        assert_equal seen.map(&:first).sort, seen.map(&:first)
+    end
+
+    # Subcode follows the sector data, each hunk being decoded once
+    # (the data track spans more hunks than the cache holds)
+    def test_subcode
+        frames = 8 * 40
+        chd = CHD.new(cd_image('subcode',
+                               [ { :type => :MODE1, :frames => frames,
+                                   :subcode => true },
+                                 { :type => :AUDIO, :frames => 6,
+                                   :subcode => true } ]))
+        CHD::CD.new(chd).extract(@bin, @cue, threads: 1)
+        assert_equal frames.times.map {|i| TestImages.sector(1, i, 2048) +
+                                           TestImages.subcode(1, i) }.join +
+                     6.times.map {|i| [ i ].pack('s<') * 1176 +
+                                      TestImages.subcode(2, i) }.join,
+                     File.binread(@bin)
+        assert_equal chd.hunk_count, chd.stats[:chd_reads]
+    ensure
+        chd&.close
+    end
+
+    def test_missing_cue
+        assert_raises(ArgumentError) { @cd.extract(@bin) }
+    end
+end
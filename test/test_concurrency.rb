@@ -0,0 +1,118 @@
+require_relative 'helper'
+
+class TestConcurrency < Minitest::Test
+    def setup
+        @path = generated_image(layout: :cd, size: 1024 * 1024)
+    end
+
+    # Reads racing with #close either complete or raise CHD::Error,
+    # but never access the released decoder
+    def test_close_during_reads
+        errors = Hash.new(0)
+        mutex  = Mutex.new
+        40.times do |n|
+            chd     = CHD.new(@path)
+            units   = chd.unit_count
+            threads = 4.times.map {|k|
+                Thread.new {
+                    rnd = Random.new(n * 4 + k)
+                    begin
+                        loop {
+                            case k
+                            when 0 then chd.read_hunk(rnd.rand(chd.hunk_count))
+                            when 1 then chd.read_bytes(rnd.rand(500_000), 5000)
+                            when 2 then chd.read_units(rnd.rand(units - 10), 9,
+                                                       offset: 0, length: 2048)
+                            when 3 then chd.read_unit(rnd.rand(units))
+                            end
+                        }
+                    rescue CHD::Error => e
+                        mutex.synchronize { errors[e.message] += 1 }
+                    end
+                }
+            }
+            sleep 0.001 * (n % 5)
+            chd.close
+            threads.each(&:join)
+        end
+        assert_equal [ 'closed' ], errors.keys
+        assert_equal 160, errors['closed']
+    end
+
+    # Cache and statistics accesses (taking the lock without the GVL)
+    # racing with reads, background decoding, and #close
+    def test_close_during_cache_accesses
+        errors = Hash.new(0)
+        mutex  = Mutex.new
+        10.times do |n|
+            chd     = CHD.new(@path)
+            hunks   = chd.hunk_count
+            threads = 4.times.map {|k|
+                Thread.new {
+                    rnd = Random.new(n * 4 + k)
+                    begin
+                        loop {
+                            idx = rnd.rand(hunks)
+                            case k
+                            when 0 then chd.advise(idx .. idx + 3, :willneed,
+                                                   hunks: true)
+                            when 1 then chd.advise(nil, :sequential)
+                                        chd.read_bytes(idx * chd.hunk_bytes, 100)
+                            when 2 then chd.stats
+                                        chd.advise(idx .. idx, :dontneed,
+                                                   hunks: true)
+                            when 3 then chd.read_hunk(idx)
+                            end
+                        }
+                    rescue CHD::Error => e
+                        mutex.synchronize { errors[e.message] += 1 }
+                    end
+                }
+            }
+            sleep 0.002 * (n % 4)
+            chd.close
+            assert threads.all? {|thread| thread.join(10) }
+            assert chd.stats[:chd_reads] >= 0
+        end
+        assert_equal [ 'closed' ], errors.keys
+    end
+
+    # Interrupting a thread waiting for a read (decoding in progress
+    # in other threads) doesn't leave the lock held
+    def test_interrupted_readers
+        chd     = CHD.new(@path)
+        hunks   = chd.hunk_count
+        threads = 8.times.map {|k|
+            Thread.new {
+                loop { chd.read_hunk(k % hunks) ; chd.stats }
+            }
+        }
+        sleep 0.05
+        threads.each(&:kill).each(&:join)
+        assert_equal chd.read_bytes(0, 10), chd.read_hunk(0).byteslice(0, 10)
+        chd.close
+    end
+
+    # Accesses duplicated before one that can't be (opened from an IO)
+    # are closed, the work being done in the current thread
+    def test_parallel_duplication_failure
+        io      = File.open(@path, 'rb')
+        chds    = [ CHD.new(@path), CHD.new(io) ]
+        copies  = []
+        chds.each {|chd|
+            chd.define_singleton_method(:dup) { super().tap {|c| copies << c } }
+        }
+        results = []
+        CHD::Parallel.each(chds, [ 0, 1, 2 ], threads: 2,
+                           work: ->(access, job) {
+                               assert_same chds, access
+                               job
+                           }) {|result, index| results << [ result, index ] }
+        assert_equal [ [ 0, 0 ], [ 1, 1 ], [ 2, 2 ] ], results
+        assert_equal 1, copies.size
+        assert copies.all?(&:closed?)
+    ensure
+        chds&.each(&:close)
+        io&.close
+    end
+end
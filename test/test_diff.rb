@@ -0,0 +1,83 @@
+require_relative 'helper'
+
+class TestDiff < Minitest::Test
+    HUNK_BYTES = 4096
+
+    def chd(name, hunks, **opts)
+        tagged_image(name, hunks, **opts)
+    end
+
+    def test_identical
+        a = chd('a', %w[ a b c d ])
+        b = chd('b', %w[ a b c d ])
+        assert_equal({ :ranges => [], :hunks => 0, :bytes => 0,
+                       :compressed_bytes => 0, :decoded => 0 }, a.diff(b))
+    end
+
+    # Hunks classified from the map: CRC-16 differs, or stored bytes
+    # are identical
+    def test_classified_from_map
+        a = chd('a', %w[ a b c d e f ])
+        b = chd('b', %w[ a X Y d e Z ])
+        res = a.diff(b)
+        assert_equal [ 1..2, 5..5 ], res[:ranges]
+        assert_equal 3,              res[:hunks]
+        assert_equal 3 * HUNK_BYTES, res[:bytes]
+        assert_equal [ 1, 2, 5 ].sum {|i| a.read_compressed_hunk(i)[:data].bytesize },
+                     res[:compressed_bytes]
+        assert_equal 0,              res[:decoded]
+    end
+
+    # Same data stored differently requires decoding
+    def test_decoded
+        a = chd('a', [ 'a', 'b',              'c', { :none => 'd' } ])
+        b = chd('b', [ 'a', { :none => 'b' }, 'c', { :none => 'X' } ])
+        res = a.diff(b)
+        assert_equal [ 3..3 ], res[:ranges]
+        assert_equal 1,        res[:decoded]
+    end
+
+    # Self references to equal hunks are equal
+    def test_self_references
+        a = chd('a', [ 'a', 'b', { :type => :self, :offset => 0 } ])
+        b = chd('b', [ 'a', 'X', { :type => :self, :offset => 0 } ])
+        res = a.diff(b)
+        assert_equal [ 1..1 ], res[:ranges]
+        assert_equal 0,        res[:decoded]
+    end
+
+    # References to the same unit of the same parent are equal
+    def test_parent_references
+        parent = chd('parent', %w[ p q r ].map {|tag| { :none => tag } },
+                     compression: [])
+        a = chd('a', [ { :type => :parent, :offset => 0 },
+                       { :type => :parent, :offset => 8 } ], parent: parent)
+        b = chd('b', [ { :type => :parent, :offset => 0 },
+                       { :type => :parent, :offset => 16 } ], parent: parent)
+        res = a.diff(b)
+        assert_equal [ 1..1 ], res[:ranges]
+        assert_equal 1,        res[:decoded]
+    end
+
+    # Hunks beyond the shorter file differ
+    def test_different_sizes
+        a = chd('a', %w[ a b c d e ])
+        b = chd('b', %w[ a b c ])
+        assert_equal [ 3..4 ], a.diff(b)[:ranges]
+        assert_equal [ 3..4 ], b.diff(a)[:ranges]
+    end
+
+    def test_uncompressed
+        a = chd('a', [ { :none => 'a' }, { :none => 'b' } ], compression: [])
+        b = chd('b', [ { :none => 'a' }, { :none => 'X' } ], compression: [])
+        res = a.diff(b, threads: 2)
+        assert_equal [ 1..1 ], res[:ranges]
+        assert_equal 0,        res[:decoded]
+    end
+
+    def test_hunk_size_mismatch
+        a = chd('a', %w[ a ])
+        b = CHD.new(generated_image(hunk_bytes: 8192, size: 8192))
+        assert_raises(ArgumentError) { a.diff(b) }
+    end
+end
@@ -0,0 +1,181 @@
+require_relative 'helper'
+
+class TestFilesystem < Minitest::Test
+    SECTOR = CHD::CD::Filesystem::SECTOR_SIZE
+
+    FILES  = {
+        '/README.TXT'        => "hello world\n" * 10,
+        '/DOCS/MANUAL.PDF'   => Random.new(3).bytes(5000),
+        '/DOCS/ART/BOX.PNG'  => Random.new(4).bytes(70000),
+        '/EMPTY.DAT'         => '',
+    }.freeze
+
+    DIRS   = [ '/', '/DOCS', '/DOCS/ART' ].freeze
+
+    # Minimal ISO9660 image (primary and Joliet volume descriptors,
+    # L path tables, directories, files), sector numbers starting
+    # at 0 with the image
+    def self.iso
+        @iso ||= begin
+            both16 = ->(v) { [ v, v ].pack('vn') }
+            both32 = ->(v) { [ v, v ].pack('VN') }
+            record = ->(name, lba, size, flags) {
+                len = 33 + name.bytesize + (name.bytesize.even? ? 1 : 0)
+                ([ len, 0 ].pack('CC') + both32.(lba) + both32.(size) +
+                 "\0" * 7 + [ flags, 0, 0 ].pack('CCC') + both16.(1) +
+                 [ name.bytesize ].pack('C') + name).ljust(len, "\0")
+            }
+            name   = ->(path, joliet, dir) {
+                base = File.basename(path)
+                if joliet then base.capitalize.encode(Encoding::UTF_16BE).b
+                elsif dir then base
+                else           "#{base};1"
+                end
+            }
+
+            lba    = 24
+            alloc  = ->(size) { lba.tap { lba += [ (size + SECTOR - 1) / SECTOR, 1 ].max } }
+            dirlba = [ false, true ].to_h {|j| [ j, DIRS.to_h {|d| [ d, alloc.(SECTOR) ] } ] }
+            filelba = FILES.to_h {|path, data| [ path, alloc.(data.bytesize) ] }
+            image  = "\0".b * (lba * SECTOR)
+            put    = ->(at, data) { image[at * SECTOR, data.bytesize] = data }
+            FILES.each {|path, data| put.(filelba[path], data) }
+
+            [ false, true ].each do |joliet|
+                dl = dirlba[joliet]
+                DIRS.each do |dir|
+                    data = record.("\0", dl[dir], SECTOR, 2) +
+                           record.("\1", dl[File.dirname(dir)], SECTOR, 2)
+                    (DIRS - [ '/' ]).select {|d| File.dirname(d) == dir }.each {|d|
+                        data << record.(name.(d, joliet, true), dl[d], SECTOR, 2)
+                    }
+                    FILES.select {|f, _| File.dirname(f) == dir }.each {|f, content|
+                        data << record.(name.(f, joliet, false), filelba[f],
+                                        content.bytesize, 0)
+                    }
+                    put.(dl[dir], data)
+                end
+
+                table = DIRS.map {|dir|
+                    id     = dir == '/' ? "\0" : name.(dir, joliet, true)
+                    parent = dir == '/' ? 1 : DIRS.index(File.dirname(dir)) + 1
+                    [ id.bytesize, 0, dl[dir], parent ].pack('CCVv') + id +
+                        (id.bytesize.odd? ? "\0" : '')
+                }.join
+                put.(joliet ? 22 : 20, table)
+
+                vd = "\0".b * SECTOR
+                vd[0, 7]    = [ joliet ? 2 : 1 ].pack('C') + 'CD001' + "\1"
+                vd[40, 32]  = 'TESTVOL'.ljust(32)
+                vd[80, 8]   = both32.(lba)
+                vd[88, 3]   = '%/E' if joliet
+                vd[128, 4]  = both16.(SECTOR)
+                vd[132, 8]  = both32.(table.bytesize)
+                vd[140, 4]  = [ joliet ? 22 : 20 ].pack('V')
+                vd[156, 34] = record.("\0", dl['/'], SECTOR, 2)
+                put.(joliet ? 17 : 16, vd)
+            end
+            put.(18, "\xFFCD001\1".b)
+            image.freeze
+        end
+    end
+
+    def iso_track(**opts)
+        frames = TestFilesystem.iso.bytesize / SECTOR
+        frames += opts[:pregap] if opts[:stored]
+        { :type => :MODE1, :frames => frames, :data => TestFilesystem.iso,
+          **opts }
+    end
+
+    def filesystem(tracks)
+        chd = CHD.new(cd_image(name, tracks))
+        yield CHD::CD.new(chd).filesystem
+    ensure
+        chd&.close
+    end
+
+    def check(fs)
+        assert_equal :joliet,  fs.type
+        assert_equal 'TESTVOL', fs.volume_id
+        FILES.each do |path, data|
+            assert_equal data, fs.read_file(path),      path
+            assert_equal data, fs.read_file(path.downcase + ';1'), path
+        end
+        assert fs.entry('/docs').directory?
+        assert fs.entry('/docs/art/').directory?
+    end
+
+    def test_data_track_first
+        filesystem([ iso_track ]) {|fs| check(fs) }
+    end
+
+    def test_stored_pregap
+        filesystem([ iso_track(pregap: 150, stored: true) ]) {|fs| check(fs) }
+    end
+
+    def test_pregap_not_in_file
+        filesystem([ iso_track(pregap: 150) ]) {|fs| check(fs) }
+    end
+
+    def test_data_track_after_audio
+        filesystem([ { :type => :AUDIO, :frames => 20 },
+                     iso_track(pregap: 10, stored: true) ]) {|fs| check(fs) }
+    end
+
+    def test_entries
+        filesystem([ iso_track ]) do |fs|
+            paths = fs.map(&:path)
+            assert_equal paths.size, paths.uniq.size
+            assert_includes paths, '/Docs/Art/Box.png'
+            assert_includes paths, '/Readme.txt'
+            assert_equal 70000, fs.entry('/DOCS/ART/BOX.PNG').size
+            assert fs.exist?('Docs//Manual.pdf')
+            refute fs.exist?('/DOCS/NOPE')
+            assert_nil fs.entry('/nope')
+        end
+    end
+
+    def test_partial_read
+        data = FILES['/DOCS/ART/BOX.PNG']
+        filesystem([ iso_track(pregap: 150, stored: true) ]) do |fs|
+            assert_equal data[5000, 3000], fs.read_file('/docs/art/box.png', 5000, 3000)
+            assert_equal data[69990..],    fs.read_file('/docs/art/box.png', 69990)
+            assert_equal '',               fs.read_file('/docs/art/box.png', 80000)
+            assert_equal '',               fs.read_file('/empty.dat')
+        end
+    end
+
+    def test_reader
+        data = FILES['/DOCS/ART/BOX.PNG']
+        filesystem([ iso_track(pregap: 150, stored: true) ]) do |fs|
+            fs.open_file('/docs/art/box.png') do |io|
+                assert_equal data.bytesize, io.size
+                assert_equal data[0, 100], io.read(100)
+                assert_equal data[100..],  io.each_chunk(4096).to_a.join
+                assert io.eof?
+                assert_nil io.read(1)
+                assert_equal '', io.read
+                io.rewind
+                assert_equal data, io.read
+            end
+        end
+    end
+
+    def test_not_found
+        filesystem([ iso_track ]) do |fs|
+            assert_raises(CHD::NotFoundError) { fs.read_file('/nope') }
+            assert_raises(CHD::NotFoundError) { fs.read_file('/docs') }
+            assert_raises(CHD::NotFoundError) { fs.open_file('/nope') }
+        end
+    end
+
+    def test_no_filesystem
+        chd = CHD.new(cd_image('audio', [ { :type => :AUDIO, :frames => 20 } ]))
+        assert_raises(CHD::NotFoundError) { CHD::CD.new(chd).filesystem }
+        chd.close
+        chd = CHD.new(cd_image('data', [ { :type => :MODE1, :frames => 40 } ]))
+        assert_raises(CHD::NotFoundError) { CHD::CD.new(chd).filesystem }
+    ensure
+        chd&.close
+    end
+end
@@ -0,0 +1,80 @@
+require_relative 'helper'
+
+class TestHD < Minitest::Test
+    HUNK_BYTES = 4096
+
+    def disk(name, geometry, unit_bytes: 512, hunks: 4)
+        path = tmp_path("#{name}.chd")
+        CHD::Writer.open(path, hunk_bytes: HUNK_BYTES,
+                               unit_bytes: unit_bytes) do |writer|
+            writer.add_metadata(CHD::Metadata::HARD_DISK, "#{geometry}\0")
+            hunks.times {|idx|
+                writer.write_data(([ idx ].pack('n') * (HUNK_BYTES / 2)).b)
+            }
+        end
+        CHD.new(path)
+    end
+
+    def test_parse
+        assert_equal({ :cyls => 1024, :heads => 16, :secs => 63, :bps => 512 },
+                     CHD::Metadata.parse("CYLS:1024,HEADS:16,SECS:63,BPS:512",
+                                         CHD::METADATA_FLAG_CHECKSUM,
+                                         CHD::Metadata::HARD_DISK))
+    end
+
+    def test_parse_invalid
+        [ "CYLS:1024,HEADS:16,SECS:63",                 # missing field
+          "CYLS:1024,HEADS:16,SECS:63,BPS:512,EXTRA:1", # trailing data
+          "CYLS:1024, HEADS:16,SECS:63,BPS:512",        # spacing
+          "CYLS:-1,HEADS:16,SECS:63,BPS:512",           # sign
+          "CYLS:0,HEADS:16,SECS:63,BPS:512",            # zero value
+          "CYLS:1024,HEADS:16,SECS:63,BPS:512\n",       # trailing newline
+        ].each do |data|
+            assert_raises(CHD::ParsingError, data) {
+                CHD::Metadata.parse(data, 0, CHD::Metadata::HARD_DISK)
+            }
+        end
+    end
+
+    def test_geometry
+        hd = CHD::HD.new(disk('hd', "CYLS:8,HEADS:2,SECS:2,BPS:512"))
+        assert_equal 8,          hd.cylinders
+        assert_equal 2,          hd.heads
+        assert_equal 2,          hd.sectors_per_track
+        assert_equal 512,        hd.sector_bytes
+        assert_equal 32,         hd.sectors
+        assert_equal 32 * 512,   hd.size
+        assert_equal 0,          hd.lba(0, 0, 1)
+        assert_equal 7,          hd.lba(1, 1, 2)
+    end
+
+    def test_read_sectors
+        hd = CHD::HD.new(disk('hd', "CYLS:8,HEADS:2,SECS:2,BPS:512"))
+        assert_equal [ 1 ].pack('n') * 256,   hd.read_sector(8)
+        assert_equal [ 0, 1 ].map {|i| [ i ].pack('n') * 2048 }.join,
+                     hd.read_sectors(0, 16)
+        buffer = String.new('old')
+        assert_same  buffer, hd.read_sectors_into(buffer, 31, 1)
+        assert_equal [ 3 ].pack('n') * 256, buffer
+        assert_raises(RangeError) { hd.read_sectors(31, 2) }
+        assert_raises(RangeError) { hd.read_sector(-1) }
+    end
+
+    def test_invalid_geometry
+        assert_raises(CHD::ParsingError) {      # exceeds the logical size
+            CHD::HD.read_geometry(disk('big', "CYLS:9,HEADS:2,SECS:2,BPS:512"))
+        }
+        assert_raises(CHD::ParsingError) {      # sector is not the unit
+            CHD::HD.read_geometry(disk('bps', "CYLS:4,HEADS:2,SECS:2,BPS:1024"))
+        }
+        assert_raises(CHD::NotFoundError) {
+            CHD::HD.read_geometry(CHD.new(generated_image(layout: :cd)))
+        }
+    end
+
+    def test_generated
+        chd = CHD.new(generated_image(layout: :raw, size: 64 * 1024))
+        hd  = CHD::HD.new(chd)
+        assert_equal chd.header[:logical_bytes], hd.size
+    end
+end
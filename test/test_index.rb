@@ -0,0 +1,123 @@
+require_relative 'helper'
+
+class TestIndex < Minitest::Test
+    HUNK_BYTES = 4096
+    GEOMETRY   = "CYLS:4,HEADS:1,SECS:8,BPS:512\0"
+
+    def write(path, fill)
+        CHD::Writer.open(path, hunk_bytes: HUNK_BYTES,
+                               unit_bytes: 512) do |writer|
+            writer.add_metadata(CHD::Metadata::HARD_DISK, GEOMETRY)
+            4.times {|i| writer.write_data([ fill + i ].pack('N') *
+                                           (HUNK_BYTES / 4)) }
+        end
+        path
+    end
+
+    def setup
+        @path = write(tmp_path('hd.chd'), 0)
+    end
+
+    def teardown
+        FileUtils.rm_f([ @path, CHD::Index.path_for(@path) ])
+    end
+
+    def test_fetch_builds_and_saves
+        refute File.exist?(CHD::Index.path_for(@path))
+        assert_nil CHD::Index.load(@path)
+        index = CHD::Index.fetch(@path)
+        assert File.exist?(CHD::Index.path_for(@path))
+        CHD.open(@path) do |chd|
+            assert_equal chd.header,   index.header
+            assert_equal chd.metadata, index.metadata
+        end
+        assert_nil   index.toc
+        assert_equal 512, index.geometry[:bps]
+        assert_equal({ :hunks => { :none => 4 }, :stored_bytes => 4 * HUNK_BYTES },
+                     index.map)
+        assert_nil   index.verification
+
+        loaded = CHD::Index.load(@path)
+        refute_nil   loaded
+        assert_equal index.header, loaded.header
+        assert_equal index.map,    loaded.map
+    end
+
+    def test_cache_directory
+        dir   = tmp_path('cache')
+        index = CHD::Index.fetch(@path, dir: dir)
+        file  = CHD::Index.path_for(@path, dir: dir)
+        assert_equal dir, File.dirname(file)
+        assert File.exist?(file)
+        refute File.exist?(CHD::Index.path_for(@path))
+        assert_nil CHD::Index.load(@path)
+        assert_equal index.header, CHD::Index.load(@path, dir: dir).header
+    ensure
+        FileUtils.rm_rf(dir)
+    end
+
+    # Modification time change
+    def test_stale_mtime
+        CHD::Index.fetch(@path)
+        mtime = File.mtime(@path)
+        File.utime(mtime, mtime + 1, @path)
+        assert_nil CHD::Index.load(@path)
+    end
+
+    # Same size and modification time, different content
+    def test_stale_content
+        index = CHD::Index.fetch(@path)
+        mtime = File.mtime(@path)
+        size  = File.size(@path)
+        write(@path, 100)
+        File.utime(mtime, mtime, @path)
+        assert_equal size,  File.size(@path)
+        assert_equal mtime, File.mtime(@path)
+        assert_nil CHD::Index.load(@path)
+
+        rebuilt = CHD::Index.fetch(@path)
+        refute_equal index.header[:sha1], rebuilt.header[:sha1]
+        assert_equal rebuilt.header, CHD::Index.load(@path).header
+    end
+
+    # Unreadable, or of another format
+    def test_invalid_index
+        file = CHD::Index.path_for(@path)
+        File.binwrite(file, 'garbage')
+        assert_nil CHD::Index.load(@path)
+        File.binwrite(file, Marshal.dump([ 1, 2 ]))
+        assert_nil CHD::Index.load(@path)
+
+        CHD::Index.fetch(@path).save
+        data = Marshal.load(File.binread(file))
+        File.binwrite(file, Marshal.dump(data.merge(format: 0)))
+        assert_nil CHD::Index.load(@path)
+        File.binwrite(file, Marshal.dump(data)[0, 20])
+        assert_nil CHD::Index.load(@path)
+    end
+
+    def test_verify
+        index = CHD::Index.fetch(@path)
+        assert index.verify
+        assert_equal true, CHD::Index.load(@path).verification[:result]
+
+        # Verification result is dropped with the stale index
+        mtime = File.mtime(@path)
+        File.utime(mtime, mtime + 1, @path)
+        assert_nil CHD::Index.fetch(@path).verification
+    end
+
+    def test_cd_toc
+        path  = cd_image('cd', [ { :type => :MODE1, :frames => 10 },
+                                 { :type => :AUDIO, :frames => 6 } ])
+        index = CHD::Index.fetch(path)
+        assert_nil index.geometry
+        CHD.open(path) do |chd|
+            assert_equal CHD::CD.read_toc(chd), index.toc
+            cd = CHD::CD.new(chd, toc: index.toc)
+            assert_equal TestImages.sector(1, 3, 2048), cd.read_sector(3)
+        end
+    ensure
+        FileUtils.rm_f(CHD::Index.path_for(path)) if path
+    end
+end
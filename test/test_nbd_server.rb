@@ -0,0 +1,162 @@
+require_relative 'helper'
+require 'socket'
+
+class TestNBDServer < Minitest::Test
+    S = CHD::NBDServer
+
+    # Minimal NBD client (fixed newstyle)
+    class Client
+        def initialize(socket)
+            @socket = socket
+            @magic  = socket.read(16)
+            @flags  = socket.read(2).unpack1('n')
+            socket.write([ S::FLAG_FIXED_NEWSTYLE | S::FLAG_NO_ZEROES ].pack('N'))
+        end
+        attr_reader :socket, :magic, :flags
+
+        def option(option, data = '')
+            @socket.write([ S::OPTS_MAGIC, option, data.bytesize, data ]
+                              .pack('a8NNa*'))
+        end
+
+        # Option replies, up to the final one
+        def replies
+            list = []
+            loop do
+                magic, option, type, length = @socket.read(20).unpack('Q>NNN')
+                raise 'bad reply magic' if magic != S::REP_MAGIC
+                list << [ option, type, @socket.read(length) ]
+                return list if type != S::REP_SERVER && type != S::REP_INFO
+            end
+        end
+
+        def request(type, handle, offset, length, payload = nil)
+            @socket.write([ S::REQUEST_MAGIC, 0, type, handle, offset, length ]
+                              .pack('NnnQ>Q>N'), payload || '')
+        end
+
+        # Simple reply: error, handle, and data (if no error)
+        def reply(length = 0)
+            data = @socket.read(16)
+            return nil if data.nil?
+            magic, error, handle = data.unpack('NNQ>')
+            raise 'bad reply magic' if magic != S::REPLY_MAGIC
+            [ error, handle, error.zero? && length > 0 ? @socket.read(length)
+                                                       : nil ]
+        end
+
+        def read(offset, length)
+            request(S::CMD_READ, 1, offset, length)
+            reply(length)
+        end
+    end
+
+    def setup
+        @chd    = CHD.new(generated_image(layout: :raw, size: 256 * 1024))
+        @data   = @chd.read_bytes(0, @chd.header[:logical_bytes])
+        @server = S.new(@chd, cache_hunks: 4)
+        mine, theirs = UNIXSocket.pair
+        @thread = Thread.new { @server.serve(theirs) }
+        @client = Client.new(mine)
+    end
+
+    def teardown
+        @client.socket.close
+        @thread.join
+    end
+
+    def go(name = 'chd')
+        @client.option(S::OPT_GO, [ name.bytesize, name, 0 ].pack('Na*n'))
+        @client.replies
+    end
+
+    def test_negotiation
+        assert_equal 'NBDMAGICIHAVEOPT', @client.magic
+        assert_equal S::FLAG_FIXED_NEWSTYLE | S::FLAG_NO_ZEROES, @client.flags
+
+        @client.option(S::OPT_LIST)
+        assert_equal [ [ S::OPT_LIST, S::REP_SERVER, [ 3, 'chd' ].pack('Na*') ],
+                       [ S::OPT_LIST, S::REP_ACK,    '' ] ], @client.replies
+
+        @client.option(42)
+        assert_equal [ [ 42, S::REP_ERR_UNSUP, '' ] ], @client.replies
+
+        assert_equal S::REP_ERR_UNKNOWN, go('other').last[1]
+
+        replies = go
+        export  = replies.find {|_, type, data|
+            type == S::REP_INFO && data.unpack1('n') == S::INFO_EXPORT }
+        size, flags = export[2].unpack('xxQ>n')
+        assert_equal @data.bytesize, size
+        assert flags & S::FLAG_READ_ONLY != 0
+        assert_equal S::REP_ACK, replies.last[1]
+
+        assert_equal [ 0, 1, @data.byteslice(1000, 5000) ],
+                     @client.read(1000, 5000)
+    end
+
+    def test_export_name
+        @client.option(S::OPT_EXPORT_NAME, 'chd')
+        size, _ = @client.socket.read(10).unpack('Q>n')
+        assert_equal @data.bytesize, size
+        assert_equal @data.byteslice(0, 100), @client.read(0, 100)[2]
+    end
+
+    def test_requests
+        go
+        length = @data.bytesize
+        @client.request(S::CMD_READ,  1, length - 10, 20)
+        @client.request(S::CMD_READ,  2, 0, S::MAX_REQUEST + 1)
+        @client.request(S::CMD_WRITE, 3, 0, 4, 'abcd')
+        @client.request(S::CMD_FLUSH, 4, 0, 0)
+        @client.request(S::CMD_TRIM,  5, 0, 4096)
+        @client.request(99,           6, 0, 0)
+        @client.request(S::CMD_CACHE, 7, 0, 8192)
+        replies = 7.times.map { @client.reply }.to_h {|e, h, _| [ h, e ] }
+        assert_equal({ 1 => S::EINVAL, 2 => S::EOVERFLOW, 3 => S::EPERM,
+                       4 => 0,         5 => S::EPERM,     6 => S::EINVAL,
+                       7 => 0 }, replies)
+
+        # Pipelined reads (sorted and merged by the server)
+        reads = 20.times.map {|i| [ (i * 7919) % (length - 9000), 1 + i * 400 ] }
+        reads.each_with_index {|(o, l), h| @client.request(S::CMD_READ, h, o, l) }
+        got = reads.size.times.to_h {
+            error, handle = @client.reply
+            [ handle, [ error, @client.socket.read(reads[handle][1]) ] ]
+        }
+        reads.each_with_index {|(o, l), h|
+            assert_equal [ 0, @data.byteslice(o, l) ], got[h]
+        }
+    end
+
+    # Oversized write payloads are not read: the connection is dropped
+    def test_oversized_write
+        go
+        @client.request(S::CMD_WRITE, 1, 0, S::MAX_REQUEST + 1)
+        @thread.join(10)
+        assert_nil @client.reply
+    end
+
+    def test_disconnect
+        go
+        @client.request(S::CMD_DISC, 0, 0, 0)
+        assert @thread.join(10)
+    end
+end
+
+class TestNBDServerListen < Minitest::Test
+    def test_run_and_stop
+        chd    = CHD.new(generated_image(layout: :raw, size: 64 * 1024))
+        path   = tmp_path('nbd.sock')
+        server = CHD::NBDServer.new(chd).listen(unix: path)
+        thread = Thread.new { server.run }
+        client = TestNBDServer::Client.new(UNIXSocket.new(path))
+        client.option(CHD::NBDServer::OPT_EXPORT_NAME, 'chd')
+        client.socket.read(10)
+        assert_equal chd.read_bytes(512, 512), client.read(512, 512)[2]
+        server.stop
+        thread.join
+        refute File.exist?(path)
+        assert_raises(ArgumentError) { CHD::NBDServer.new(chd).listen }
+    end
+end
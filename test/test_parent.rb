@@ -0,0 +1,111 @@
+require_relative 'helper'
+
+class TestParent < Minitest::Test
+    HUNK_BYTES = 4096
+    UNIT_BYTES = 512
+    HUNKS      = 16
+
+    def hunk(tag, idx)
+        ("%s %04d " % [ tag, idx ] * (HUNK_BYTES / 10 + 1)).byteslice(0, HUNK_BYTES)
+    end
+
+    # Child hunks: its own data (even), parent data (odd, not
+    # multiple of 3), or a self reference to a parent reference
+    # (multiple of 3)
+    def setup
+        @parent_path = tmp_path('parent.chd')
+        @child_path  = tmp_path('child.chd')
+
+        CHD::Writer.open(@parent_path, hunk_bytes: HUNK_BYTES,
+                                       unit_bytes: UNIT_BYTES) do |writer|
+            HUNKS.times {|idx| writer.write_data(hunk('parent', idx)) }
+        end
+        parent = CHD.new(@parent_path)
+        CHD::Writer.open(@child_path, hunk_bytes:  HUNK_BYTES,
+                                      unit_bytes:  UNIT_BYTES,
+                                      compression: [ 'zlib' ],
+                                      parent_sha1: parent) do |writer|
+            HUNKS.times {|idx|
+                writer << if idx.even?
+                              { :type => :none, :data => hunk('child', idx) }
+                          elsif idx % 3 == 0 && idx > 1
+                              { :type => :self, :offset => 1 }
+                          else
+                              { :type   => :parent,
+                                :offset => idx * HUNK_BYTES / UNIT_BYTES }
+                          end
+            }
+        end
+        parent.close
+    end
+
+    def expected(idx)
+        if    idx.even?    then hunk('child',  idx)
+        elsif idx % 3 == 0 then hunk('parent', 1)
+        else                    hunk('parent', idx)
+        end
+    end
+
+    def test_read
+        chd = CHD.new(@child_path, parent: CHD.new(@parent_path))
+        HUNKS.times {|idx| assert_equal expected(idx), chd.read_hunk(idx) }
+    end
+
+    def test_parent_required
+        assert_raises(CHD::ParentRequiredError) { CHD.new(@child_path) }
+    end
+
+    # The parent handle is kept until the child is closed
+    def test_parent_closed_first
+        parent = CHD.new(@parent_path)
+        chd    = CHD.new(@child_path, parent: parent)
+        chd.read_hunk(0)
+        parent.close
+        assert parent.closed?
+        assert_raises(CHD::Error) { parent.read_hunk(0) }
+        HUNKS.times {|idx| assert_equal expected(idx), chd.read_hunk(idx) }
+        chd.close
+    end
+
+    # Parent closed before the child decoded anything
+    def test_parent_closed_before_loading
+        parent = CHD.new(@parent_path)
+        chd    = CHD.new(@child_path, parent: parent)
+        parent.close
+        assert_equal expected(1), chd.read_hunk(1)
+    end
+
+    # Parent, and children, decoding concurrently through the
+    # same parent handle
+    def test_concurrent_reads
+        parent   = CHD.new(@parent_path)
+        children = 2.times.map { CHD.new(@child_path, parent: parent) }
+        threads  = children.map {|chd|
+            Thread.new {
+                200.times.all? {|n|
+                    idx = n % HUNKS
+                    chd.read_hunk(idx) == expected(idx)
+                }
+            }
+        } + [ Thread.new {
+                  200.times.all? {|n|
+                      idx = n % HUNKS
+                      parent.read_hunk(idx) == hunk('parent', idx)
+                  }
+              } ]
+        assert threads.map(&:value).all?
+    end
+
+    # Parent and children collected together, in any order
+    def test_collected
+        20.times {
+            parent = CHD.new(@parent_path)
+            chd    = CHD.new(@child_path, parent: parent)
+            chd.read_hunk(1)
+        }
+        GC.start
+        assert_equal expected(3), CHD.new(@child_path,
+                                          parent: CHD.new(@parent_path))
+                                     .read_hunk(3)
+    end
+end
@@ -0,0 +1,89 @@
+require_relative 'helper'
+
+class TestRead < Minitest::Test
+    def setup
+        @chd  = CHD.new(generated_image(layout: :raw, codec: 'zlib',
+                                        size: 256 * 1024, hunk_bytes: 16384))
+        @hunk = @chd.hunk_bytes
+        @data = @chd.hunk_count.times.map {|i| @chd.read_hunk(i) }.join
+    end
+
+    # Inside a hunk: in the middle (copied) or up to its end (shared)
+    def test_read_bytes_inside_hunk
+        [ [ 0, 100 ], [ 5 * @hunk + 17, 4000 ], [ 2 * @hunk - 512, 512 ],
+          [ 3 * @hunk, @hunk - 1 ], [ 3 * @hunk + 1, @hunk - 1 ],
+        ].each do |offset, size|
+            assert_equal @data.byteslice(offset, size),
+                         @chd.read_bytes(offset, size), [ offset, size ].inspect
+        end
+    end
+
+    def test_read_bytes_across_hunks
+        [ [ @hunk - 10, 20 ], [ 0, 3 * @hunk ], [ 100, 5 * @hunk ],
+          [ @data.bytesize - 10, 10 ], [ 0, 0 ],
+        ].each do |offset, size|
+            assert_equal @data.byteslice(offset, size),
+                         @chd.read_bytes(offset, size), [ offset, size ].inspect
+        end
+        buffer = String.new('previous')
+        assert_same buffer, @chd.read_bytes(10, 5000, buffer)
+        assert_equal @data.byteslice(10, 5000), buffer
+    end
+
+    def test_read_units
+        units = @hunk / @chd.unit_bytes
+        [ 0, 1, units - 1, units, 3 * units + 5 ].each do |idx|
+            assert_equal @data.byteslice(idx * 512, 512), @chd.read_unit(idx)
+        end
+        assert_equal @data.byteslice(100 * 512, 40 * 512),
+                     @chd.read_units(100, 40)
+        assert_equal (7 ... 10).map {|i| @data.byteslice(i * 512 + 8, 16) }.join,
+                     @chd.read_units(7, 3, offset: 8, length: 16)
+        assert_equal @data.byteslice(9 * 512 + 500, 12),
+                     @chd.read_units(9, 1, offset: 500, length: 12)
+
+        # Slice followed by the end of the unit, swapped or contiguous
+        unit = ->(i) { @data.byteslice(i * 512, 512) }
+        assert_equal (7 ... 10).map {|i| unit.(i).byteslice(8, 16) +
+                                         unit.(i).byteslice(-4, 4) }.join,
+                     @chd.read_units(7, 3, offset: 8, length: 16, tail: 4)
+        assert_equal (7 ... 10).map {|i|
+                         unit.(i).byteslice(8, 16).unpack('n*').pack('v*') +
+                         unit.(i).byteslice(-4, 4) }.join,
+                     @chd.read_units(7, 3, offset: 8, length: 16, tail: 4,
+                                     swap: true)
+        assert_equal unit.(9).byteslice(500, 12),
+                     @chd.read_units(9, 1, offset: 500, length: 8, tail: 4)
+    end
+
+    # Returned strings are independent from the cache
+    def test_results_are_independent
+        mid  = @chd.read_bytes(@hunk + 10, 100)
+        tail = @chd.read_bytes(2 * @hunk - 100, 100)
+        hunk = @chd.read_hunk(1)
+        [ mid, tail, hunk ].each {|str| str.replace('x' * str.bytesize) }
+        assert_equal @data.byteslice(@hunk + 10, 100),
+                     @chd.read_bytes(@hunk + 10, 100)
+        assert_equal @data.byteslice(@hunk, @hunk), @chd.read_hunk(1)
+    end
+
+    # Reads inside a hunk decode it once
+    def test_cached
+        reads = @chd.stats[:chd_reads]
+        10.times {|i| @chd.read_bytes(4 * @hunk + i * 1000, 500) }
+        @chd.read_bytes(5 * @hunk - 10, 10)
+        assert_equal reads + 1, @chd.stats[:chd_reads]
+    end
+
+    def test_out_of_range
+        assert_raises(RangeError)    { @chd.read_hunk(@chd.hunk_count) }
+        assert_raises(RangeError)    { @chd.read_unit(@chd.unit_count) }
+        assert_raises(ArgumentError) { @chd.read_bytes(0, -1) }
+        assert_raises(ArgumentError) {
+            @chd.read_units(0, 1, offset: 500, length: 13)
+        }
+        assert_raises(ArgumentError) {
+            @chd.read_units(0, 1, offset: 500, length: 8, tail: 5)
+        }
+    end
+end
@@ -0,0 +1,108 @@
+require_relative 'helper'
+
+class TestReadHunks < Minitest::Test
+    def setup
+        @parent = tagged_image('parent', [ { :none => 'p' }, { :none => 'q' } ],
+                               compression: [])
+        @chd    = tagged_image('chd',
+                      [ 'a', { :none => 'b' }, 'c',
+                        { :type => :self,   :offset => 0 },
+                        { :type => :parent, :offset => 8 },
+                        { :none => 'd' },
+                        { :type => :self,   :offset => 3 } ],
+                      parent: @parent)
+    end
+
+    def teardown
+        @chd.close
+        @parent.close
+    end
+
+    def hunk(tag)
+        TestImages.tagged_hunk(tag)
+    end
+
+    def test_hunk_map
+        map = CHD::HunkMap.new(@chd)
+        assert_equal 7, map.size
+        assert_equal [ 0, CHD::HunkMap::NONE, 0, CHD::HunkMap::SELF,
+                       CHD::HunkMap::PARENT, CHD::HunkMap::NONE,
+                       CHD::HunkMap::SELF ], map.map(&:type)
+        assert_equal [ 'zlib', :none, 'zlib', :self, :parent, :none, :self ],
+                     map.map {|entry| map.type_name(entry.type) }
+        assert_equal [ 'zlib' ], map.codecs
+        assert_equal @parent.header[:sha1], map.parent
+
+        assert_equal 4096,      map[1].length
+        assert_equal 8,         map[4].offset
+        assert_equal 3,         map[6].offset
+        assert_equal 0,         map.resolve(6).hunk
+        assert_equal map[0],    map.resolve(3)
+        assert_equal map[4],    map.resolve(4)
+        assert_equal @chd.read_compressed_hunk(0)[:data].bytesize,
+                     map.resolve(6).length
+        assert map[2].compressed? && map[2].stored?
+        assert map[5].stored? && !map[5].compressed?
+        refute map[4].stored?
+    end
+
+    # Entries built from the map of an uncompressed CHD
+    def test_hunk_map_uncompressed
+        map = CHD::HunkMap.new(@parent)
+        assert_equal [ :none, :none ], map.map {|entry| map.type_name(entry.type) }
+        assert_equal [], map.codecs
+        assert_nil map.parent
+        assert_equal [ 4096, 4096 ], map.map(&:length)
+        assert_equal 4096, map[1].offset - map[0].offset
+    end
+
+    # Stored hunks (following self references) are read by file
+    # position, parent references at the end
+    def test_extents
+        extents = @chd.send(:_read_hunks_extents, (0 ... 7).to_a.reverse)
+        map     = CHD::HunkMap.new(@chd)
+        stored  = extents.select {|_, length, _| length > 0 }
+        assert_equal 1, stored.size
+        offset, length, hunks = stored.first
+        assert_equal map[0].offset,                            offset
+        assert_equal map[5].offset + map[5].length - offset,   length
+        assert_equal [ 0, 3, 6, 1, 2, 5 ].sort, hunks.sort
+        assert_equal hunks.sort_by {|idx| map.resolve(idx).offset }, hunks
+        assert_equal [ [ 0, 0, [ 4 ] ] ], extents - stored
+    end
+
+    # Hunks too far apart are not merged
+    def test_extents_gap
+        count = CHD::READ_HUNKS_GAP / 4096 + 1
+        chd   = tagged_image('gap', [ 'a', *[ { :none => 'x' } ] * count, 'b' ])
+        map   = CHD::HunkMap.new(chd)
+        assert_equal [ [ map[0].offset,         map[0].length,         [ 0 ] ],
+                       [ map[count + 1].offset, map[count + 1].length,
+                         [ count + 1 ] ] ],
+                     chd.send(:_read_hunks_extents, [ count + 1, 0 ])
+        assert_equal [ hunk('b'), hunk('a') ], chd.read_hunks([ count + 1, 0 ])
+    ensure
+        chd&.close
+    end
+
+    def test_read_hunks
+        expected = [ hunk('a'), hunk('b'), hunk('c'), hunk('a'),
+                     hunk('q'), hunk('d'), hunk('a') ]
+        indices  = [ 6, 4, 0, 2, 2, 5, 1, 3 ]
+        assert_equal indices.map {|idx| expected[idx] },
+                     @chd.read_hunks(indices, threads: 2)
+        assert_equal expected, @chd.read_hunks(0 ... 7, threads: 1)
+
+        yielded = {}
+        assert_same @chd, @chd.read_hunks(indices) {|data, idx|
+            refute yielded.key?(idx)
+            yielded[idx] = data
+        }
+        assert_equal indices.uniq.sort, yielded.keys.sort
+        yielded.each {|idx, data| assert_equal expected[idx], data }
+
+        assert_equal [], @chd.read_hunks([])
+        assert_raises(RangeError) { @chd.read_hunks([ 0, 7 ]) }
+        assert_raises(RangeError) { @chd.read_hunks([ -1 ]) }
+    end
+end
@@ -0,0 +1,88 @@
+require_relative 'helper'
+
+class TestSharedCache < Minitest::Test
+    HUNK_BYTES = 16384
+
+    def setup
+        @path = generated_image(layout: :raw, codec: 'zlib', size: 256 * 1024,
+                                hunk_bytes: HUNK_BYTES)
+    end
+
+    def read_all(chd)
+        chd.hunk_count.times.map {|i| chd.read_hunk(i) }
+    end
+
+    # Hunks decoded by an access are found by another one
+    def test_shared_between_accesses
+        cache = CHD::SharedCache.new(4 * 1024 * 1024, hunk_bytes: HUNK_BYTES)
+        stats = cache.stats
+        assert_equal 0, stats[:slots] % 4
+        assert_equal HUNK_BYTES, stats[:slot_bytes]
+
+        expected = CHD.open(@path) {|chd| read_all(chd) }
+        CHD.open(@path) {|chd| chd.shared_cache = cache; read_all(chd) }
+        CHD.open(@path) do |chd|
+            chd.shared_cache = cache
+            assert_same cache, chd.shared_cache
+            assert_equal expected, read_all(chd)
+        end
+        assert_equal expected.size, cache.stats[:hits]
+        assert_equal expected.size, cache.stats[:stores]
+    end
+
+    def test_unsuitable
+        assert_raises(ArgumentError) { CHD::SharedCache.new(1024) }
+        assert_raises(ArgumentError) {
+            CHD::SharedCache.new(1024 * 1024, hunk_bytes: 0)
+        }
+        cache = CHD::SharedCache.new(1024 * 1024, hunk_bytes: 4096)
+        CHD.open(@path) do |chd|
+            assert_raises(ArgumentError) { chd.shared_cache = cache }
+        end
+    end
+
+    # A file with another geometry is refused
+    def test_file_layout
+        file  = tmp_path('shm')
+        cache = CHD::SharedCache.new(1024 * 1024, hunk_bytes: HUNK_BYTES,
+                                                  path: file)
+        slots = cache.stats[:slots]
+        assert_equal slots,
+            CHD::SharedCache.new(1024 * 1024, hunk_bytes: HUNK_BYTES,
+                                              path: file).stats[:slots]
+        assert_raises(ArgumentError) {
+            CHD::SharedCache.new(2 * 1024 * 1024, hunk_bytes: HUNK_BYTES,
+                                                  path: file)
+        }
+
+        # Geometry of the header not matching the size of the file
+        [ 0, 3, slots + 4, 0xffffffff ].each do |bad|
+            File.open(file, 'r+b') {|io| io.pwrite([ bad ].pack('L'), 8) }
+            assert_raises(ArgumentError) {
+                CHD::SharedCache.new(1024 * 1024, hunk_bytes: HUNK_BYTES,
+                                                  path: file)
+            }
+        end
+    ensure
+        FileUtils.rm_f(file) if file
+    end
+
+    # The geometry is not read again from the segment
+    # (which any process can write)
+    def test_header_overwritten
+        file     = tmp_path('shm')
+        cache    = CHD::SharedCache.new(1024 * 1024, hunk_bytes: HUNK_BYTES,
+                                                     path: file)
+        stats    = cache.stats
+        expected = CHD.open(@path) {|chd| read_all(chd) }
+        CHD.open(@path) do |chd|
+            chd.shared_cache = cache
+            File.open(file, 'r+b') {|io| io.pwrite([ 0, 1 ].pack('LL'), 8) }
+            assert_equal expected, read_all(chd)
+        end
+        assert_equal stats[:slots],      cache.stats[:slots]
+        assert_equal stats[:slot_bytes], cache.stats[:slot_bytes]
+    ensure
+        FileUtils.rm_f(file) if file
+    end
+end
@@ -0,0 +1,130 @@
+require_relative 'helper'
+
+class TestTrackIO < Minitest::Test
+    BATCH = CHD::CD::TrackIO::READ_SECTORS
+
+    # Track 1: pregap not in the file, track 2: audio,
+    # track 3: pregap stored in the file
+    def setup
+        @chd = CHD.new(cd_image('cd',
+                   [ { :type => :MODE1, :frames => 2 * BATCH + 10,
+                       :pregap => 2 },
+                     { :type => :AUDIO, :frames => 20 },
+                     { :type => :MODE1, :frames => 40, :pregap => 3,
+                       :stored => true } ]))
+        @cd  = CHD::CD.new(@chd)
+    end
+
+    def teardown
+        @chd.close
+    end
+
+    def track(track, range)
+        range.map {|i| TestImages.sector(track, i, 2048) }.join
+    end
+
+    def test_size
+        assert_equal (2 * BATCH + 10) * 2048, @cd.track_io(1).size
+        assert_equal 20 * 2352,               @cd.track_io(2, datatype: nil).size
+        assert_equal 37 * 2048,               @cd.track_io(3).size
+        assert_equal 2048,                    @cd.track_io(3).sector_size
+    end
+
+    def test_read_whole_track
+        assert_equal track(1, 0 ... 2 * BATCH + 10), @cd.track_io(1).read
+        assert_equal track(3, 3 ... 40),             @cd.track_io(3).read
+        assert_equal 20.times.map {|i| [ i ].pack('s>') * 1176 }.join,
+                     @cd.track_io(2, datatype: nil).read
+    end
+
+    # Reads across sectors, batches, and up to the end of the track
+    # (never into the next one)
+    def test_read_at_boundaries
+        data = track(1, 0 ... 2 * BATCH + 10)
+        io   = @cd.track_io(1)
+        [ [ 2047, 2 ], [ BATCH * 2048 - 1, 2 ], [ BATCH * 2048 - 100, 4096 ],
+          [ 3 * 2048 + 5, 3 * BATCH * 2048 ], [ data.bytesize - 1, 10 ],
+          [ 0, 1 ], [ 2 * BATCH * 2048, 10 * 2048 ],
+        ].each do |offset, length|
+            io.seek(offset)
+            expected = data.byteslice(offset, length)
+            assert_equal expected, io.read(length), [ offset, length ].inspect
+            assert_equal offset + expected.bytesize, io.pos
+            assert_equal expected, io.pread(length, offset)
+        end
+    end
+
+    def test_end_of_track
+        io = @cd.track_io(3)
+        io.seek(-10, IO::SEEK_END)
+        refute io.eof?
+        assert_equal track(3, 39 ... 40).byteslice(-10, 10), io.read(100)
+        assert io.eof?
+        assert_nil io.read(1)
+        assert_equal '', io.read
+        assert_equal '', io.read(0)
+        assert_raises(EOFError) { io.readpartial(1) }
+        assert_raises(EOFError) { io.pread(1, io.size) }
+        assert_equal '', io.pread(0, io.size)
+
+        io.seek(10, :END)
+        assert_equal io.size + 10, io.tell
+        assert_nil io.read(1)
+        assert_equal '', io.read
+    end
+
+    def test_seek
+        io = @cd.track_io(1)
+        assert_equal 0, io.seek(4096)
+        io.seek(100, IO::SEEK_CUR)
+        assert_equal 4196, io.pos
+        io.seek(-4196, :CUR)
+        assert_equal 0, io.pos
+        io.pos = 2048
+        assert_equal TestImages.sector(1, 1, 2048), io.read(2048)
+        assert_raises(Errno::EINVAL) { io.seek(-1) }
+        assert_raises(Errno::EINVAL) { io.seek(-io.pos - 1, IO::SEEK_CUR) }
+        assert_raises(Errno::EINVAL) { io.pread(1, -1) }
+        assert_raises(ArgumentError) { io.seek(0, :NOPE) }
+        assert_raises(ArgumentError) { io.read(-1) }
+        assert_equal 2 * 2048, io.pos
+        io.rewind
+        assert_equal 0, io.pos
+    end
+
+    def test_outbuf
+        io  = @cd.track_io(3)
+        buf = String.new('previous')
+        assert_same buf, io.read(100, buf)
+        assert_equal track(3, 3 .. 3).byteslice(0, 100), buf
+        assert_same buf, io.pread(10, 2048, buf)
+        assert_equal track(3, 4 .. 4).byteslice(0, 10), buf
+        io.seek(0, :END)
+        assert_nil io.read(10, buf)
+        assert_equal '', buf
+    end
+
+    def test_copy_stream
+        out = StringIO.new(String.new)
+        IO.copy_stream(@cd.track_io(3), out)
+        assert_equal track(3, 3 ... 40), out.string
+    end
+
+    def test_close
+        io = @cd.track_io(1)
+        io.read(10)
+        io.close
+        assert io.closed?
+        assert_raises(IOError) { io.read(1) }
+        assert_raises(IOError) { io.seek(0) }
+        refute @chd.closed?
+    end
+
+    def test_unsupported
+        assert_raises(CHD::NotSupportedError) { @cd.track_io(2) }
+        assert_raises(CHD::NotSupportedError) {
+            @cd.track_io(1, datatype: :MODE1_RAW)
+        }
+        assert_raises(RangeError) { @cd.track_io(4) }
+    end
+end
@@ -0,0 +1,62 @@
+require_relative 'helper'
+
+# CHD version 4: the unit size is not in the header, but guessed
+# from the metadata by libchdr when opening
+class TestVersion4 < Minitest::Test
+    HUNK_BYTES = 4096
+    HUNKS      = 6
+    GEOMETRY   = "CYLS:3,HEADS:2,SECS:8,BPS:512\0"
+
+    # Uncompressed V4 image: hunks 0-3 stored, hunk 4 a mini hunk,
+    # hunk 5 a reference to hunk 1, followed by the metadata
+    def v4_image
+        path   = tmp_path('v4.chd')
+        data   = 4.times.map {|i| Random.new(i).bytes(HUNK_BYTES) }
+        mapend = 108 + 16 * HUNKS + 16
+        meta   = mapend + data.sum(&:bytesize)
+        map    = data.each_index.map {|i|
+            [ mapend + i * HUNK_BYTES, 0, HUNK_BYTES, 0, 2 ].pack('Q>NnCC')
+        }
+        map   << [ 0x0102030405060708, 0, 0, 0, 3 ].pack('Q>NnCC')
+        map   << [ 1, 0, 0, 0, 4 ].pack('Q>NnCC')
+        header = [ 'MComprHD', 108, 4, 0, 0, HUNKS, HUNKS * HUNK_BYTES,
+                   meta, HUNK_BYTES ].pack('a8NNNNNQ>Q>N').ljust(108, "\0")
+        entry  = [ 'GDDD', 1 ].pack('a4C') +
+                 [ GEOMETRY.bytesize ].pack('N')[1, 3] + [ 0 ].pack('Q>')
+        File.binwrite(path, header + map.join + "EndOfListCookie\0" +
+                            data.join + entry + GEOMETRY)
+        [ path, data + [ [ 0x0102030405060708 ].pack('Q>') * (HUNK_BYTES / 8),
+                         data[1] ] ]
+    end
+
+    def test_unit_bytes
+        path, _ = v4_image
+        CHD.open(path) do |chd|
+            assert_equal 4,                       chd.version
+            assert_equal 512,                     chd.unit_bytes
+            assert_equal HUNKS * HUNK_BYTES / 512, chd.header[:unit_count]
+        end
+    end
+
+    def test_read
+        path, hunks = v4_image
+        data        = hunks.join
+        CHD.open(path) do |chd|
+            hunks.each_with_index {|hunk, i| assert_equal hunk, chd.read_hunk(i) }
+            assert_equal data.byteslice(9 * 512, 512), chd.read_unit(9)
+            assert_equal data.byteslice(7 * 512, 12 * 512), chd.read_units(7, 12)
+            assert_equal data.byteslice(HUNK_BYTES - 5, 10000),
+                         chd.read_bytes(HUNK_BYTES - 5, 10000)
+            assert_raises(RangeError) { chd.read_unit(HUNKS * HUNK_BYTES / 512) }
+        end
+    end
+
+    def test_hd
+        path, _ = v4_image
+        CHD.open(path) do |chd|
+            hd = CHD::HD.new(chd)
+            assert_equal 512, hd.sector_bytes
+            assert_equal 48,  hd.sectors
+        end
+    end
+end
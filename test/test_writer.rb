@@ -0,0 +1,97 @@
+require_relative 'helper'
+require 'zlib'
+
+class TestWriter < Minitest::Test
+    HUNK_BYTES = 4096
+    UNIT_BYTES = 512
+
+    # Binary metadata: with inner and trailing null-chars,
+    # and larger than text metadata
+    BINARY     = ([ 0, 1, 2, 0, 255 ].pack('C*') * 200 + "\0").b
+    TEXT       = "CYLS:4,HEADS:1,SECS:8,BPS:512\0"
+    # Binary metadata without null-char
+    KEY        = "\x01\x02key".b
+
+    def hunks
+        4.times.map {|idx| ([ idx ].pack('N') * (HUNK_BYTES / 4)).b }
+    end
+
+    def write(path, **opts)
+        CHD::Writer.open(path, hunk_bytes: HUNK_BYTES,
+                               unit_bytes: UNIT_BYTES, **opts) do |writer|
+            writer.add_metadata(CHD::Metadata::HARD_DISK, TEXT)
+            writer.add_metadata(:IDNT, BINARY, 0)
+            writer.add_metadata(CHD::Metadata::HARD_DISK_KEY, KEY, 0)
+            hunks.each {|data| writer.write_data(data) }
+            yield writer if block_given?
+        end
+        path
+    end
+
+    def test_round_trip
+        chd = CHD.new(write(tmp_path('plain.chd')))
+        assert_equal 5,                   chd.version
+        assert_equal HUNK_BYTES,          chd.hunk_bytes
+        assert_equal UNIT_BYTES,          chd.unit_bytes
+        assert_equal 4,                   chd.hunk_count
+        assert_equal hunks,               4.times.map {|i| chd.read_hunk(i) }
+        assert_equal [ TEXT.chop, 1, :GDDD ], chd.get_metadata(0, :GDDD)
+        assert_equal [ BINARY,    0, :IDNT ], chd.get_metadata(0, :IDNT)
+        assert_equal [ KEY,       0, :'KEY ' ], chd.get_metadata(2)
+        assert_equal [ TEXT,      1, :GDDD ], chd.get_metadata(0, raw: true)
+        assert_equal [ TEXT, BINARY, KEY ], chd.metadata(raw: true).map(&:first)
+        assert_equal Digest::SHA1.digest(hunks.join), chd.header[:sha1_raw]
+    end
+
+    def test_compressed_round_trip
+        path = tmp_path('zlib.chd')
+        CHD::Writer.open(path, hunk_bytes: HUNK_BYTES, unit_bytes: UNIT_BYTES,
+                               compression: [ 'zlib' ]) do |writer|
+            hunks.each {|data|
+                zdata = Zlib::Deflate.new(9, -Zlib::MAX_WBITS)
+                                     .deflate(data, Zlib::FINISH)
+                writer << { :type => :compressed, :codec => 'zlib',
+                            :data => zdata, :crc16 => CHD.crc16(data) }
+            }
+            writer << { :type => :self, :offset => 1 }
+        end
+        chd = CHD.new(path)
+        assert_equal hunks + [ hunks[1] ], 5.times.map {|i| chd.read_hunk(i) }
+        assert_equal :compressed, chd.read_compressed_hunk(0)[:type]
+        assert_equal 'zlib',      chd.read_compressed_hunk(0)[:codec]
+    end
+
+    def test_errors
+        path = tmp_path('errors.chd')
+        assert_raises(ArgumentError) {
+            CHD::Writer.new(path, hunk_bytes: 1000, unit_bytes: 512)
+        }
+        CHD::Writer.open(path, hunk_bytes: HUNK_BYTES,
+                               unit_bytes: UNIT_BYTES) do |writer|
+            assert_raises(ArgumentError) { writer.write_data('short') }
+            assert_raises(ArgumentError) {
+                writer << { :type => :self, :offset => 0 }
+            }
+            assert_raises(ArgumentError) {
+                writer << { :type => :parent, :offset => 0 }
+            }
+            assert_raises(ArgumentError) {
+                writer << { :type => :compressed, :codec => 'lzma',
+                            :data => 'x', :crc16 => 0 }
+            }
+            assert_raises(ArgumentError) { writer.add_metadata(:GD, 'x') }
+        end
+    end
+
+    # Copy preserves the metadata bytes, and the hunks as stored
+    def test_copy
+        [ generated_image(layout: :raw, codec: 'zlib', size: 128 * 1024),
+          generated_image(layout: :cd,  codec: 'none', size: 128 * 1024),
+          write(tmp_path('binary.chd')),
+        ].each do |source|
+            copy = tmp_path('copy.chd')
+            CHD.open(source) {|chd| CHD::Writer.copy(chd, copy) }
+            assert_equal File.binread(source), File.binread(copy)
+        end
+    end
+end